@@ -70,6 +70,8 @@
 #include <sys/stat.h>
 #include <time.h>
 
+#include "echofx.h"
+
 #ifdef _WIN32
     #include <windows.h>
     #include <io.h>
@@ -164,6 +166,10 @@ static int vibrato_enabled = 1; // V
 static int tremolo_enabled = 1; // T
 static int echo_enabled = 1;    // E
 
+// Слитная цепочка из echofx.h (--fused-fx): те же эффекты за один векторизуемый проход по блоку
+static int fused_fx = 0;
+static EchoFx echofx;
+
 // Флаг для выхода по Ctrl+C, Ctrl+Z или q
 static volatile int keep_running = 1;
 
@@ -186,6 +192,18 @@ void audio_effect(void* udata, Uint8* stream, int len) {
     Sint16* buffer = (Sint16*)stream;
     int samples = len / sizeof(Sint16);
 
+    if (fused_fx) {
+        echofx.gain = global_volume;
+        echofx.echo_enabled = echo_enabled;
+        echofx.reverb_enabled = reverb_enabled;
+        echofx.chorus_enabled = chorus_enabled;
+        echofx.vibrato.enabled = vibrato_enabled;
+        echofx.tremolo.enabled = tremolo_enabled;
+        echofx.stereo_enabled = stereo_enabled;
+        echofx_process_s16(&echofx, buffer, samples / 2);
+        return;
+    }
+
     // Собираем максимум для финальной нормализации
     Sint32 max_amplitude = 0;
 
@@ -526,6 +544,145 @@ void update_midi_list(MidiList* list, const char* explicit_file) {
     free(new_list);
 }
 
+// Фоновая предзагрузка следующего трека.
+// Mix_LoadMUS() выполняется только в рабочем потоке, поэтому загрузки никогда не идут параллельно.
+typedef struct {
+    SDL_Thread* thread;
+    SDL_mutex* lock;
+    SDL_cond* cond;
+    char* request;       // Путь, ожидающий загрузки
+    char* loading;       // Путь, который загружается прямо сейчас
+    char* ready_path;    // Путь последнего загруженного трека
+    Mix_Music* ready;    // Загруженный трек (NULL при ошибке)
+    char error[256];     // Ошибка загрузки ready_path
+    Uint32 load_ms;      // Время загрузки ready_path
+    int quit;
+} Preloader;
+
+static Preloader preloader = {0};
+
+// Момент окончания трека и сигнал для главного цикла
+static SDL_sem* music_finished_sem = NULL;
+static volatile Uint32 music_finished_ticks = 0;
+
+// Вызывается SDL_mixer из аудиопотока, когда трек закончился или остановлен
+static void music_finished(void) {
+    music_finished_ticks = SDL_GetTicks();
+    SDL_SemPost(music_finished_sem);
+}
+
+static int preload_thread(void* data) {
+    Preloader* p = (Preloader*)data;
+
+    SDL_LockMutex(p->lock);
+
+    while (!p->quit) {
+        if (!p->request) {
+            SDL_CondWait(p->cond, p->lock);
+            continue;
+        }
+
+        p->loading = p->request;
+        p->request = NULL;
+        SDL_UnlockMutex(p->lock);
+
+        Uint32 start = SDL_GetTicks();
+        Mix_Music* music = Mix_LoadMUS(p->loading);
+        Uint32 load_ms = SDL_GetTicks() - start;
+        const char* error = music ? "" : Mix_GetError();
+
+        SDL_LockMutex(p->lock);
+
+        // Невостребованный трек заменяется новым
+        if (p->ready) { Mix_FreeMusic(p->ready); }
+
+        free(p->ready_path);
+        p->ready = music;
+        p->ready_path = p->loading;
+        p->loading = NULL;
+        p->load_ms = load_ms;
+        strncpy(p->error, error, sizeof(p->error) - 1);
+        p->error[sizeof(p->error) - 1] = '\0';
+        SDL_CondBroadcast(p->cond);
+    }
+
+    SDL_UnlockMutex(p->lock);
+    return 0;
+}
+
+int preload_init() {
+    preloader.lock = SDL_CreateMutex();
+    preloader.cond = SDL_CreateCond();
+    music_finished_sem = SDL_CreateSemaphore(0);
+
+    if (!preloader.lock || !preloader.cond || !music_finished_sem) { return 0; }
+
+    preloader.thread = SDL_CreateThread(preload_thread, "preload", &preloader);
+    return preloader.thread != NULL;
+}
+
+// Ставит трек в очередь на загрузку, если он ещё не загружен и не загружается
+void preload_request(const char* filename) {
+    SDL_LockMutex(preloader.lock);
+
+    if (!(preloader.ready_path && strcmp(preloader.ready_path, filename) == 0) &&
+            !(preloader.loading && strcmp(preloader.loading, filename) == 0) &&
+            !(preloader.request && strcmp(preloader.request, filename) == 0)) {
+        free(preloader.request);
+        preloader.request = STRDUP(filename);
+        SDL_CondSignal(preloader.cond);
+    }
+
+    SDL_UnlockMutex(preloader.lock);
+}
+
+// Забирает загруженный трек; если он ещё не готов — ждёт окончания загрузки.
+// *preloaded = 1, если трек был готов до вызова (загрузка не задержала воспроизведение).
+Mix_Music* preload_take(const char* filename, Uint32* load_ms, int* preloaded, char* error, size_t error_size) {
+    preload_request(filename);
+
+    SDL_LockMutex(preloader.lock);
+    *preloaded = preloader.ready_path && strcmp(preloader.ready_path, filename) == 0;
+
+    while (!(preloader.ready_path && strcmp(preloader.ready_path, filename) == 0)) {
+        SDL_CondWait(preloader.cond, preloader.lock);
+    }
+
+    Mix_Music* music = preloader.ready;
+    *load_ms = preloader.load_ms;
+    strncpy(error, preloader.error, error_size - 1);
+    error[error_size - 1] = '\0';
+    preloader.ready = NULL;
+    free(preloader.ready_path);
+    preloader.ready_path = NULL;
+    SDL_UnlockMutex(preloader.lock);
+    return music;
+}
+
+void preload_shutdown() {
+    if (preloader.thread) {
+        SDL_LockMutex(preloader.lock);
+        preloader.quit = 1;
+        SDL_CondSignal(preloader.cond);
+        SDL_UnlockMutex(preloader.lock);
+        SDL_WaitThread(preloader.thread, NULL);
+        preloader.thread = NULL;
+    }
+
+    if (preloader.ready) { Mix_FreeMusic(preloader.ready); }
+
+    free(preloader.request);
+    free(preloader.ready_path);
+    preloader.ready = NULL;
+    preloader.request = preloader.ready_path = NULL;
+
+    if (preloader.cond) { SDL_DestroyCond(preloader.cond); }
+
+    if (preloader.lock) { SDL_DestroyMutex(preloader.lock); }
+
+    if (music_finished_sem) { SDL_DestroySemaphore(music_finished_sem); }
+}
+
 // Кроссплатформенная настройка терминала
 #ifdef _WIN32
 HANDLE hStdin;
@@ -667,7 +824,8 @@ int main(int argc, char* argv[]) {
     printf("Author: Ivan Svarkovsky  <https://github.com/Svarkovsky> License: MIT\n");
     printf("A simple MIDI player with audio effects. Play MIDI files with reverb, chorus, vibrato, tremolo, and stereo widening.\n");
     printf("Controls: Right Arrow (Next), Left Arrow (Previous), P (Pause/Resume), Q (Quit)\n");
-    printf("Effects: R (Reverb), C (Chorus), S (Stereo), V (Vibrato), T (Tremolo), E (Echo)\n\n");
+    printf("Effects: R (Reverb), C (Chorus), S (Stereo), V (Vibrato), T (Tremolo), E (Echo)\n");
+    printf("Options: --fused-fx (one-pass effect chain from echofx.h)\n\n");
 
     init_terminal();
 
@@ -692,6 +850,22 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fused-fx") == 0) { fused_fx = 1; }
+    }
+
+    if (fused_fx) {
+        echofx_init(&echofx, SAMPLE_RATE);
+        echofx.reverb_feedback = reverb_feedback;
+        echofx.chorus_speed = chorus_speed;
+        echofx.normalize = limiter_enabled;
+
+        if (!echofx_setup(&echofx)) {
+            printf("Out of memory for the fused effect chain, using the built-in one\n");
+            fused_fx = 0;
+        }
+    }
+
     Mix_SetPostMix(audio_effect, NULL);
 
     char* soundfont = find_soundfont();
@@ -708,6 +882,18 @@ int main(int argc, char* argv[]) {
     Mix_SetSoundFonts(soundfont);
     free(soundfont);
 
+    if (!preload_init()) {
+        printf("Failed to start preload thread: %s\n", SDL_GetError());
+        preload_shutdown();
+        reset_terminal();
+        Mix_CloseAudio();
+        Mix_Quit();
+        SDL_Quit();
+        return 1;
+    }
+
+    Mix_HookMusicFinished(music_finished);
+
     printf("\nEffect Settings:\n");
     printf("  Global Volume: %.2f\n", global_volume);
     printf("  Echo: %s\n", echo_enabled ? "Enabled" : "Disabled");
@@ -720,7 +906,11 @@ int main(int argc, char* argv[]) {
     printf("\n");
 
     MidiList* midi_list = midi_list_init();
-    const char* explicit_file = (argc > 1) ? argv[1] : NULL;
+    const char* explicit_file = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fused-fx") != 0) { explicit_file = argv[i]; }
+    }
 
     update_midi_list(midi_list, explicit_file);
 
@@ -861,10 +1051,15 @@ int main(int argc, char* argv[]) {
             }
 
             if (file_exists(midi_list->files[current_index])) {
-                music = Mix_LoadMUS(midi_list->files[current_index]);
+                Uint32 load_ms = 0;
+                int preloaded = 0;
+                char load_error[256];
+                music = preload_take(midi_list->files[current_index], &load_ms, &preloaded, load_error, sizeof(load_error));
 
                 if (music) {
-                    if (strlen(last_track) > 0) {
+                    int had_track = strlen(last_track) > 0;
+
+                    if (had_track) {
                         printf("\n");
                     }
 
@@ -881,12 +1076,24 @@ int main(int argc, char* argv[]) {
                     last_track[sizeof(last_track) - 1] = '\0';
                     Mix_PlayMusic(music, 1);
                     start_time = SDL_GetTicks();
+
+                    // Пауза между треками: от окончания предыдущего до запуска текущего
+                    if (had_track) {
+                        printf("Load: %u ms (%s), Gap: %u ms\n", load_ms,
+                               preloaded ? "preloaded" : "waited", start_time - music_finished_ticks);
+                    }
+
+                    else {
+                        printf("Load: %u ms\n", load_ms);
+                    }
+
                     current_index = (current_index + 1) % midi_list->count;
+                    preload_request(midi_list->files[current_index]);
                 }
 
                 else {
                     printf("Failed to load: %s (%s)\n",
-                           midi_list->files[current_index], Mix_GetError());
+                           midi_list->files[current_index], load_error);
                     current_index = (current_index + 1) % midi_list->count;
                 }
             }
@@ -915,15 +1122,20 @@ int main(int argc, char* argv[]) {
             fflush(stdout);
         }
 
-        SDL_Delay(100);
+        // Просыпаемся сразу по окончании трека, чтобы следующий запустился без задержки
+        SDL_SemWaitTimeout(music_finished_sem, 100);
     }
 
     printf("\n");
 
+    Mix_HookMusicFinished(NULL);
+    preload_shutdown();
+
     if (music) { Mix_FreeMusic(music); }
 
     midi_list_free(midi_list);
     Mix_CloseAudio();
+    echofx_free(&echofx);
     Mix_Quit();
     SDL_Quit();
     reset_terminal();
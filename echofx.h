@@ -0,0 +1,589 @@
+// echofx.h — общий движок эффектов EchoMidi (v0.1 и v0.2)
+/*
+    MIT License
+
+    Copyright (c) Ivan Svarkovsky - 2025
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+*/
+
+/*
+    Все эффекты считаются за один проход по блоку. Стерео-блок раскладывается
+    в два float-массива по ECHOFX_CHUNK кадров, и каждая ступень — это простой
+    цикл без ветвлений по этим массивам, который компилятор векторизует сам
+    (-O3 или -Ofast -ftree-vectorize; -fopt-info-vec покажет, какие циклы стали SIMD).
+    Линии задержки читаются и пишутся кусками через memcpy, LFO считается
+    на границах куска и внутри него линейно интерполируется.
+
+    Порядок: вставки (эквалайзер, флэнжер, вращение) → посылы из моно-сигнала
+    (эхо, реверберация, хорус) → амплитудная модуляция → стерео-расширение.
+
+    Заголовок самодостаточный: всё объявлено static, отдельной единицы трансляции нет.
+    Задержки (поля *_ms) задаются до echofx_setup и потом не меняются;
+    остальные параметры можно менять между блоками.
+*/
+
+#ifndef ECHOFX_H
+#define ECHOFX_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#define ECHOFX_CHUNK 256          // Кадров в куске: все рабочие массивы помещаются в L1
+#define ECHOFX_MAX_FRAMES 4096    // Кадров за один проход в 16-битном режиме (буфер нормализации)
+#define ECHOFX_REVERB_TAPS 5
+#define ECHOFX_CHORUS_TAPS 3
+#define ECHOFX_TWO_PI 6.28318530718f
+
+// Кольцевая линия задержки
+typedef struct {
+    float* data;
+    int size;
+    int pos;    // Позиция записи
+    int delay;  // Задержка в кадрах
+} EchoFxLine;
+
+// Амплитудная модуляция: множитель = base + depth * sin(phase)
+typedef struct {
+    int enabled;
+    float base;
+    float depth;
+    float speed;   // Гц
+    float phase;
+} EchoFxAmpMod;
+
+typedef struct {
+    float rate;
+    float gain;    // Входной множитель (громкость)
+    int block;     // Длина куска: не больше самой короткой линии с обратной связью
+
+    // Эхо
+    int echo_enabled;
+    float echo_ms, echo_wet, echo_feedback;
+    EchoFxLine echo;
+
+    // Реверберация: несколько отводов с общей обратной связью
+    int reverb_enabled;
+    float reverb_ms[ECHOFX_REVERB_TAPS];
+    float reverb_tap[ECHOFX_REVERB_TAPS];
+    float reverb_wet, reverb_feedback;
+    EchoFxLine reverb[ECHOFX_REVERB_TAPS];
+
+    // Хорус: отводы, задержку которых раскачивает LFO (как fDepth у DX8: доля задержки, не больше 0.5)
+    int chorus_enabled;
+    float chorus_ms[ECHOFX_CHORUS_TAPS];
+    float chorus_tap[ECHOFX_CHORUS_TAPS];
+    float chorus_phase[ECHOFX_CHORUS_TAPS];
+    float chorus_wet, chorus_depth, chorus_speed;
+    EchoFxLine chorus[ECHOFX_CHORUS_TAPS];
+
+    // Флэнжер: модулируемая короткая задержка с обратной связью, по линии на канал
+    int flanger_enabled;
+    float flanger_ms, flanger_depth, flanger_wet, flanger_feedback, flanger_speed, flanger_phase;
+    EchoFxLine flanger[2];
+
+    // Параметрический эквалайзер (пиковый биквад)
+    int eq_enabled;
+    float eq_center, eq_bandwidth, eq_gain_db;   // Гц, полутона, дБ
+    float eq_b0, eq_b1, eq_b2, eq_a1, eq_a2;
+    float eq_z[2][2];
+    float eq_key[3];                             // Параметры, из которых посчитаны коэффициенты
+
+    EchoFxAmpMod vibrato;
+    EchoFxAmpMod tremolo;
+
+    // Стерео-расширение: задержанное моно в противофазе
+    int stereo_enabled;
+    float stereo_ms, stereo_width;
+    EchoFxLine stereo;
+
+    // Вращение стереопанорамы
+    int rotate_enabled;
+    float rotate_speed, rotate_phase;
+
+    int normalize;   // Масштабировать блок, если пик выше 1.0
+    float peak;      // Пик последнего блока
+    float* scratch;  // Буфер 16-битного режима
+} EchoFx;
+
+// Значения по умолчанию повторяют эффекты EchoMidi v0.1
+static void echofx_init(EchoFx* fx, float rate) {
+    static const float reverb_ms[ECHOFX_REVERB_TAPS] = { 50.0f, 100.0f, 150.0f, 40.0f, 80.0f };
+    static const float chorus_ms[ECHOFX_CHORUS_TAPS] = { 10.0f, 15.0f, 20.0f };
+    float damping = 0.6f;
+
+    memset(fx, 0, sizeof(*fx));
+    fx->rate = rate;
+    fx->gain = 1.0f;
+
+    fx->echo_ms = 250.0f;
+    fx->echo_wet = 0.3f;
+
+    memcpy(fx->reverb_ms, reverb_ms, sizeof(reverb_ms));
+    fx->reverb_tap[0] = 0.5f;
+    fx->reverb_tap[1] = 0.4f;
+    fx->reverb_tap[2] = 0.3f;
+    fx->reverb_tap[3] = 0.3f * (1.0f - damping);
+    fx->reverb_tap[4] = 0.15f * (1.0f - damping);
+    fx->reverb_wet = 0.2f;
+    fx->reverb_feedback = 0.5f;
+
+    memcpy(fx->chorus_ms, chorus_ms, sizeof(chorus_ms));
+    fx->chorus_tap[0] = 0.2f; // Средний уровень отводов v0.1, где LFO качал уровень, а не задержку
+    fx->chorus_tap[1] = 0.2f;
+    fx->chorus_tap[2] = 0.15f;
+    fx->chorus_phase[0] = 0.5f;
+    fx->chorus_phase[1] = 0.5f;
+    fx->chorus_wet = 0.15f;
+    fx->chorus_depth = 0.1f;
+    fx->chorus_speed = 3.0f;
+
+    fx->flanger_ms = 2.0f;
+    fx->flanger_depth = 0.5f;
+    fx->flanger_wet = 0.5f;
+    fx->flanger_feedback = -0.5f;
+    fx->flanger_speed = 5.0f;
+
+    fx->eq_center = 1000.0f;
+    fx->eq_bandwidth = 5.0f;
+    fx->eq_gain_db = 15.0f;
+
+    fx->vibrato = (EchoFxAmpMod) { 0, 1.0f, 0.03f, 3.0f, 0.0f };
+    fx->tremolo = (EchoFxAmpMod) { 0, 0.85f, 0.075f, 3.0f, 0.0f };
+
+    fx->stereo_ms = 5.0f;
+    fx->stereo_width = 0.5f;
+
+    fx->rotate_speed = 0.01f;
+}
+
+static int echofx_ms_to_frames(const EchoFx* fx, float ms) {
+    int frames = (int)(ms * fx->rate / 1000.0f + 0.5f);
+    return frames < 1 ? 1 : frames;
+}
+
+static int echofx_line_alloc(EchoFxLine* line, int delay, int size) {
+    line->data = calloc(size, sizeof(float));
+    line->size = size;
+    line->pos = 0;
+    line->delay = delay;
+    return line->data != NULL;
+}
+
+static void echofx_free(EchoFx* fx) {
+    free(fx->echo.data);
+
+    for (int k = 0; k < ECHOFX_REVERB_TAPS; k++) { free(fx->reverb[k].data); }
+
+    for (int k = 0; k < ECHOFX_CHORUS_TAPS; k++) { free(fx->chorus[k].data); }
+
+    free(fx->flanger[0].data);
+    free(fx->flanger[1].data);
+    free(fx->stereo.data);
+    free(fx->scratch);
+
+    EchoFxLine empty = {0};
+    fx->echo = fx->stereo = fx->flanger[0] = fx->flanger[1] = empty;
+
+    for (int k = 0; k < ECHOFX_REVERB_TAPS; k++) { fx->reverb[k] = empty; }
+
+    for (int k = 0; k < ECHOFX_CHORUS_TAPS; k++) { fx->chorus[k] = empty; }
+
+    fx->scratch = NULL;
+}
+
+// Выделяет линии задержки под текущие *_ms. Возвращает 0, если не хватило памяти
+static int echofx_setup(EchoFx* fx) {
+    int ok = 1;
+    echofx_free(fx);
+
+    // Линии с обратной связью читаются до записи, поэтому кусок не длиннее их задержки
+    fx->block = ECHOFX_CHUNK;
+
+    int delay = echofx_ms_to_frames(fx, fx->echo_ms);
+    ok &= echofx_line_alloc(&fx->echo, delay, delay + ECHOFX_CHUNK);
+
+    if (delay < fx->block) { fx->block = delay; }
+
+    for (int k = 0; k < ECHOFX_REVERB_TAPS; k++) {
+        delay = echofx_ms_to_frames(fx, fx->reverb_ms[k]);
+        ok &= echofx_line_alloc(&fx->reverb[k], delay, delay + ECHOFX_CHUNK);
+
+        if (delay < fx->block) { fx->block = delay; }
+    }
+
+    // Задержка хоруса гуляет от половины до полутора номинальных: линия вмещает верх, кусок не длиннее низа
+    for (int k = 0; k < ECHOFX_CHORUS_TAPS; k++) {
+        delay = echofx_ms_to_frames(fx, fx->chorus_ms[k]);
+        ok &= echofx_line_alloc(&fx->chorus[k], delay, delay + delay / 2 + 2 + ECHOFX_CHUNK);
+
+        if (delay / 2 - 2 < fx->block) { fx->block = delay / 2 - 2; }
+    }
+
+    // Флэнжер считается по кадрам, линия вмещает максимальный размах задержки
+    delay = echofx_ms_to_frames(fx, fx->flanger_ms * 2.0f) + 4;
+    ok &= echofx_line_alloc(&fx->flanger[0], delay, delay);
+    ok &= echofx_line_alloc(&fx->flanger[1], delay, delay);
+
+    delay = echofx_ms_to_frames(fx, fx->stereo_ms);
+    ok &= echofx_line_alloc(&fx->stereo, delay, delay + ECHOFX_CHUNK);
+
+    fx->scratch = malloc(ECHOFX_MAX_FRAMES * 2 * sizeof(float));
+    ok &= fx->scratch != NULL;
+
+    fx->eq_key[0] = -1.0f;
+
+    if (!ok) { echofx_free(fx); }
+
+    return ok;
+}
+
+// Читает n кадров, начиная с позиции записи минус back
+static inline void echofx_line_read(const EchoFxLine* line, int back, float* dst, int n) {
+    int start = line->pos - back;
+
+    if (start < 0) { start += line->size; }
+
+    int first = line->size - start;
+
+    if (first > n) { first = n; }
+
+    memcpy(dst, line->data + start, first * sizeof(float));
+
+    if (first < n) { memcpy(dst + first, line->data, (n - first) * sizeof(float)); }
+}
+
+static inline void echofx_line_write(EchoFxLine* line, const float* src, int n) {
+    int first = line->size - line->pos;
+
+    if (first > n) { first = n; }
+
+    memcpy(line->data + line->pos, src, first * sizeof(float));
+
+    if (first < n) { memcpy(line->data, src + first, (n - first) * sizeof(float)); }
+
+    line->pos = (line->pos + n) % line->size;
+}
+
+// LFO: продвигает фазу на n кадров и возвращает новую
+static inline float echofx_advance(const EchoFx* fx, float* phase, float speed, int n) {
+    *phase += ECHOFX_TWO_PI * speed * n / fx->rate;
+
+    if (*phase > ECHOFX_TWO_PI) { *phase = fmodf(*phase, ECHOFX_TWO_PI); }
+
+    return *phase;
+}
+
+static inline void echofx_ramp(float* restrict dst, float from, float to, int n) {
+    float step = (to - from) / n;
+
+    for (int i = 0; i < n; i++) { dst[i] = from + step * i; }
+}
+
+static void echofx_eq_update(EchoFx* fx) {
+    if (fx->eq_key[0] == fx->eq_center && fx->eq_key[1] == fx->eq_bandwidth && fx->eq_key[2] == fx->eq_gain_db) { return; }
+
+    float a = powf(10.0f, fx->eq_gain_db / 40.0f);
+    float w0 = ECHOFX_TWO_PI * fx->eq_center / fx->rate;
+    float sn = sinf(w0);
+    float cs = cosf(w0);
+    float octaves = fx->eq_bandwidth / 12.0f;
+    float alpha = sn * sinhf(0.34657359f * octaves * w0 / sn); // ln(2)/2
+    float a0 = 1.0f + alpha / a;
+
+    fx->eq_b0 = (1.0f + alpha * a) / a0;
+    fx->eq_b1 = (-2.0f * cs) / a0;
+    fx->eq_b2 = (1.0f - alpha * a) / a0;
+    fx->eq_a1 = (-2.0f * cs) / a0;
+    fx->eq_a2 = (1.0f - alpha / a) / a0;
+    fx->eq_key[0] = fx->eq_center;
+    fx->eq_key[1] = fx->eq_bandwidth;
+    fx->eq_key[2] = fx->eq_gain_db;
+}
+
+// Рекурсивный фильтр по времени не векторизуется, зато оба канала идут в одном цикле
+static void echofx_eq(EchoFx* fx, float* restrict left, float* restrict right, int n) {
+    echofx_eq_update(fx);
+    float b0 = fx->eq_b0, b1 = fx->eq_b1, b2 = fx->eq_b2, a1 = fx->eq_a1, a2 = fx->eq_a2;
+    float l1 = fx->eq_z[0][0], l2 = fx->eq_z[0][1], r1 = fx->eq_z[1][0], r2 = fx->eq_z[1][1];
+
+    for (int i = 0; i < n; i++) {
+        float x = left[i];
+        float y = b0 * x + l1;
+        l1 = b1 * x - a1 * y + l2;
+        l2 = b2 * x - a2 * y;
+        left[i] = y;
+
+        x = right[i];
+        y = b0 * x + r1;
+        r1 = b1 * x - a1 * y + r2;
+        r2 = b2 * x - a2 * y;
+        right[i] = y;
+    }
+
+    fx->eq_z[0][0] = l1;
+    fx->eq_z[0][1] = l2;
+    fx->eq_z[1][0] = r1;
+    fx->eq_z[1][1] = r2;
+}
+
+static void echofx_flanger_channel(EchoFxLine* line, float* restrict x, const float* restrict delay, int n, float wet, float feedback) {
+    float* data = line->data;
+    int size = line->size;
+    int pos = line->pos;
+
+    for (int i = 0; i < n; i++) {
+        float rp = pos - delay[i];
+
+        if (rp < 0.0f) { rp += size; }
+
+        int i0 = (int)rp;
+        float frac = rp - i0;
+        int i1 = i0 + 1 < size ? i0 + 1 : 0;
+        float y = data[i0] + (data[i1] - data[i0]) * frac;
+
+        data[pos] = x[i] + feedback * y;
+        x[i] = x[i] * (1.0f - wet) + y * wet;
+
+        if (++pos == size) { pos = 0; }
+    }
+
+    line->pos = pos;
+}
+
+static void echofx_flanger(EchoFx* fx, float* left, float* right, int n) {
+    float delay[ECHOFX_CHUNK];
+    float center = fx->flanger_ms * fx->rate / 1000.0f;
+    float limit = fx->flanger[0].size - 2.0f;
+    float from = center * (1.0f + fx->flanger_depth * sinf(fx->flanger_phase));
+    float to = center * (1.0f + fx->flanger_depth * sinf(echofx_advance(fx, &fx->flanger_phase, fx->flanger_speed, n)));
+
+    from = from < 2.0f ? 2.0f : from > limit ? limit : from;
+    to = to < 2.0f ? 2.0f : to > limit ? limit : to;
+    echofx_ramp(delay, from, to, n);
+    echofx_flanger_channel(&fx->flanger[0], left, delay, n, fx->flanger_wet, fx->flanger_feedback);
+    echofx_flanger_channel(&fx->flanger[1], right, delay, n, fx->flanger_wet, fx->flanger_feedback);
+}
+
+// Отвод хоруса: чтение с дробной задержкой delay[i] до записи куска, между кадрами — линейная интерполяция
+static void echofx_chorus_read(const EchoFxLine* line, const float* restrict delay, float* restrict dst, int n) {
+    const float* data = line->data;
+    int size = line->size;
+
+    for (int i = 0; i < n; i++) {
+        float rp = line->pos + i - delay[i];
+
+        if (rp < 0.0f) { rp += size; }
+
+        int i0 = (int)rp;
+        float frac = rp - i0;
+        int i1 = i0 + 1 < size ? i0 + 1 : 0;
+        dst[i] = data[i0] + (data[i1] - data[i0]) * frac;
+    }
+}
+
+static void echofx_rotate(EchoFx* fx, float* restrict left, float* restrict right, int n) {
+    float a[ECHOFX_CHUNK];
+    float from = 0.5f + 0.5f * cosf(fx->rotate_phase);
+    float to = 0.5f + 0.5f * cosf(echofx_advance(fx, &fx->rotate_phase, fx->rotate_speed, n));
+    echofx_ramp(a, from, to, n);
+
+    for (int i = 0; i < n; i++) {
+        float l = left[i];
+        float r = right[i];
+        left[i] = a[i] * l + (1.0f - a[i]) * r;
+        right[i] = a[i] * r + (1.0f - a[i]) * l;
+    }
+}
+
+static void echofx_ampmod(const EchoFx* fx, EchoFxAmpMod* mod, float* restrict left, float* restrict right, int n) {
+    float m[ECHOFX_CHUNK];
+    float from = mod->base + mod->depth * sinf(mod->phase);
+    float to = mod->base + mod->depth * sinf(echofx_advance(fx, &mod->phase, mod->speed, n));
+    echofx_ramp(m, from, to, n);
+
+    for (int i = 0; i < n; i++) {
+        left[i] *= m[i];
+        right[i] *= m[i];
+    }
+}
+
+// Один кусок: n <= fx->block
+static void echofx_chunk(EchoFx* fx, float* restrict left, float* restrict right, int n) {
+    float mono[ECHOFX_CHUNK];
+    float send[ECHOFX_CHUNK];
+    float sum[ECHOFX_CHUNK];
+    float tap[ECHOFX_CHUNK];
+    float delay[ECHOFX_CHUNK];
+    int sends = fx->echo_enabled || fx->reverb_enabled || fx->chorus_enabled;
+
+    if (fx->eq_enabled) { echofx_eq(fx, left, right, n); }
+
+    if (fx->flanger_enabled) { echofx_flanger(fx, left, right, n); }
+
+    if (fx->rotate_enabled) { echofx_rotate(fx, left, right, n); }
+
+    if (sends || fx->stereo_enabled) {
+        for (int i = 0; i < n; i++) { mono[i] = 0.5f * (left[i] + right[i]); }
+    }
+
+    if (sends) {
+        for (int i = 0; i < n; i++) { send[i] = 0.0f; }
+    }
+
+    if (fx->echo_enabled) {
+        float wet = fx->echo_wet, feedback = fx->echo_feedback;
+        echofx_line_read(&fx->echo, fx->echo.delay, tap, n);
+
+        for (int i = 0; i < n; i++) {
+            send[i] += wet * tap[i];
+            sum[i] = mono[i] + feedback * tap[i];
+        }
+
+        echofx_line_write(&fx->echo, sum, n);
+    }
+
+    if (fx->reverb_enabled) {
+        float wet = fx->reverb_wet, feedback = fx->reverb_feedback;
+
+        for (int i = 0; i < n; i++) { sum[i] = 0.0f; }
+
+        for (int k = 0; k < ECHOFX_REVERB_TAPS; k++) {
+            float g = fx->reverb_tap[k];
+            echofx_line_read(&fx->reverb[k], fx->reverb[k].delay, tap, n);
+
+            for (int i = 0; i < n; i++) { sum[i] += g * tap[i]; }
+        }
+
+        for (int i = 0; i < n; i++) {
+            send[i] += wet * sum[i];
+            tap[i] = mono[i] + feedback * sum[i];
+        }
+
+        for (int k = 0; k < ECHOFX_REVERB_TAPS; k++) { echofx_line_write(&fx->reverb[k], tap, n); }
+    }
+
+    if (fx->chorus_enabled) {
+        float wet = fx->chorus_wet;
+        float depth = fx->chorus_depth < 0.0f ? 0.0f : fx->chorus_depth > 0.5f ? 0.5f : fx->chorus_depth;
+
+        for (int i = 0; i < n; i++) { sum[i] = 0.0f; }
+
+        for (int k = 0; k < ECHOFX_CHORUS_TAPS; k++) {
+            float g = fx->chorus_tap[k];
+            float center = (float)fx->chorus[k].delay;
+            float from = center * (1.0f + depth * sinf(fx->chorus_phase[k]));
+            float to = center * (1.0f + depth * sinf(echofx_advance(fx, &fx->chorus_phase[k], fx->chorus_speed, n)));
+            echofx_ramp(delay, from, to, n);
+            echofx_chorus_read(&fx->chorus[k], delay, tap, n);
+
+            for (int i = 0; i < n; i++) { sum[i] += g * tap[i]; }
+
+            echofx_line_write(&fx->chorus[k], mono, n);
+        }
+
+        for (int i = 0; i < n; i++) { send[i] += wet * sum[i]; }
+    }
+
+    if (sends) {
+        for (int i = 0; i < n; i++) {
+            left[i] += send[i];
+            right[i] += send[i];
+        }
+    }
+
+    if (fx->vibrato.enabled) { echofx_ampmod(fx, &fx->vibrato, left, right, n); }
+
+    if (fx->tremolo.enabled) { echofx_ampmod(fx, &fx->tremolo, left, right, n); }
+
+    if (fx->stereo_enabled) {
+        float width = fx->stereo_width;
+        // Без обратной связи: сначала запись, затем чтение, так задержка может быть короче куска
+        echofx_line_write(&fx->stereo, mono, n);
+        echofx_line_read(&fx->stereo, fx->stereo.delay + n, tap, n);
+
+        for (int i = 0; i < n; i++) {
+            left[i] += width * tap[i];
+            right[i] -= width * tap[i];
+        }
+    }
+}
+
+// Чередующееся стерео float, обработка на месте
+static void echofx_process_f32(EchoFx* fx, float* buffer, int frames) {
+    float left[ECHOFX_CHUNK];
+    float right[ECHOFX_CHUNK];
+    float gain = fx->gain;
+    float peak = 0.0f;
+
+    for (int done = 0; done < frames;) {
+        int n = frames - done < fx->block ? frames - done : fx->block;
+        float* p = buffer + done * 2;
+
+        for (int i = 0; i < n; i++) {
+            left[i] = p[2 * i] * gain;
+            right[i] = p[2 * i + 1] * gain;
+        }
+
+        echofx_chunk(fx, left, right, n);
+
+        for (int i = 0; i < n; i++) {
+            p[2 * i] = left[i];
+            p[2 * i + 1] = right[i];
+            peak = fmaxf(peak, fmaxf(fabsf(left[i]), fabsf(right[i])));
+        }
+
+        done += n;
+    }
+
+    fx->peak = peak;
+
+    // Нормализация по всему блоку, как в v0.1
+    if (fx->normalize && peak > 1.0f) {
+        float scale = 1.0f / peak;
+
+        for (int i = 0; i < frames * 2; i++) { buffer[i] *= scale; }
+    }
+}
+
+// Чередующееся стерео 16 бит, обработка на месте
+static inline void echofx_process_s16(EchoFx* fx, int16_t* buffer, int frames) {
+    float* scratch = fx->scratch;
+
+    while (frames > 0) {
+        int n = frames < ECHOFX_MAX_FRAMES ? frames : ECHOFX_MAX_FRAMES;
+
+        for (int i = 0; i < n * 2; i++) { scratch[i] = buffer[i] * (1.0f / 32768.0f); }
+
+        echofx_process_f32(fx, scratch, n);
+
+        for (int i = 0; i < n * 2; i++) {
+            float s = scratch[i] * 32768.0f;
+            s = s > 32767.0f ? 32767.0f : s < -32768.0f ? -32768.0f : s;
+            buffer[i] = (int16_t)s;
+        }
+
+        buffer += n * 2;
+        frames -= n;
+    }
+}
+
+#endif // ECHOFX_H
@@ -25,10 +25,10 @@
 
 /*
     linux
-    gcc -o echomidi EchoMidi_player_v02ki.c ./libbass/libbass.so ./libbass/libbassmidi.so ./libbass/libbass_fx.so -lm
+    gcc -o echomidi EchoMidi_player_v02ki.c ./libbass/libbass.so ./libbass/libbassmidi.so ./libbass/libbass_fx.so ./libbass/libbassmix.so -lm -pthread
 
     Or like this, to be more specific:
-    gcc -std=c99 -o echomidi EchoMidi_player_v02ki.c ./libbass/libbass.so ./libbass/libbassmidi.so ./libbass/libbass_fx.so -lm \
+    gcc -std=c99 -o echomidi EchoMidi_player_v02ki.c ./libbass/libbass.so ./libbass/libbassmidi.so ./libbass/libbass_fx.so ./libbass/libbassmix.so -lm -pthread \
     -Ofast -flto=$(nproc) \
     -march=native -mtune=native \
     -mfpmath=sse \
@@ -62,13 +62,18 @@
 #include <ctype.h>
 #include <stdint.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <limits.h>
 
 #include "./libbass/bass.h"
 #include "./libbass/bassmidi.h"
 #include "./libbass/bass_fx.h"
+#include "./libbass/bassmix.h"
+#include "../echofx.h"
 
 #define SAMPLE_RATE 44100
-#define MAX_SOUNDFONTS 10
+#define STATE_DIR ".echomidi" // Снимок состояния и индексы рядом с библиотекой
 
 // Параметры эффектов
 static float global_volume = 0.9f;
@@ -165,14 +170,106 @@ void midi_list_free(MidiList* list) {
     }
 }
 
+// Добавление без проверки дубликатов (строка переходит во владение списка)
+static void midi_list_push(MidiList* list, char* filename) {
+    if (list->count >= list->capacity) {
+        list->capacity *= 2;
+        list->files = realloc(list->files, list->capacity * sizeof(char*));
+    }
+
+    list->files[list->count++] = filename;
+}
+
+static int ends_with_ci(const char *s, const char *suffix) {
+    size_t slen = strlen(s), suffixlen = strlen(suffix);
+    return suffixlen <= slen && strcasecmp(s + slen - suffixlen, suffix) == 0;
+}
+
+static int is_midi_name(const char* name) { return ends_with_ci(name, ".mid") || ends_with_ci(name, ".midi"); }
+
+static char* path_join(const char* dir, const char* name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    char* path = malloc(dlen + nlen + 2);
+    memcpy(path, dir, dlen);
+    path[dlen] = '/';
+    memcpy(path + dlen + 1, name, nlen + 1);
+    return path;
+}
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int64_t stat_mtime_ns(const struct stat* st) { return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec; }
+
+// Состояние SoundFont'а в списке
+#define SF_PENDING 0 // Ещё загружается в фоне
+#define SF_READY 1
+#define SF_FAILED 2
+#define SF_CLOSED 3 // В каталоге, но не открыт (вне рабочего набора или закрыт по LRU)
+
+// Сколько шрифтов держать открытыми одновременно (-w N); остальные открываются по требованию
+static int working_set = 10;
+
+// Пул потоков для загрузки шрифтов (--font-threads N)
+#define MAX_FONT_THREADS 8
+static int font_threads = 0; // 0 — по числу ядер, не больше MAX_FONT_THREADS
+
+// --mmap-fonts: шрифты отображаются в память (BASS_MIDI_FONT_MMAP), страницы сэмплов делятся между процессами через page cache
+static int mmap_fonts = 0;
+
+// Индекс пресетов шрифта: строится один раз через BASS_MIDI_FontGetPresets
+typedef struct {
+    uint8_t bits[128][16];  // bits[bank][preset / 8] & (1 << preset % 8)
+    int8_t first_bank[128]; // Первый банк, где есть пресет (-1 — нет)
+} PresetIndex;
+
+// Готовый выбор для пары банк/пресет при текущем порядке шрифтов
+typedef struct {
+    int16_t sf_index; // -1 — нигде не найден
+    uint8_t preset;
+    uint8_t bank;
+} PresetChoice;
+
+typedef struct {
+    PresetChoice entries[128][128]; // [bank][preset]
+} PresetTable;
+
 typedef struct {
     char** files;
     long* sizes;
     int count;
     int capacity;
-    BASS_MIDI_FONT fonts[MAX_SOUNDFONTS];
+    // Массивы растут вместе с каталогом (только до запуска загрузчиков)
+    BASS_MIDI_FONT* fonts;
+    PresetIndex** presets;
+    PresetTable* table; // Перестраивается под lock при смене активного или набора шрифтов
+    int wanted_font;    // Закрытый шрифт, в котором нашёлся пресет канала (-1 — нет)
+    int pinned_font;    // Готовится к горячей смене, LRU не закрывает (-1 — нет)
+    int* status;
+    int64_t* mtimes;
+    double* load_ms;
+    uint32_t* last_used; // Отметка LRU
+    uint32_t use_clock;
+    const char* catalog_dir; // "bank" или "."
+    MidiList* failed;        // Шрифты, которые не удалось загрузить (для снимка)
     int active_sf;
     HSTREAM current_stream;
+    // fonts[]/status[] меняются фоновым загрузчиком, поэтому читаются под lock
+    pthread_mutex_t lock;
+    pthread_t loaders[MAX_FONT_THREADS];
+    int loader_count;
+    pthread_t indexer;   // Фоновая индексация каталога (soundfont_index_catalog)
+    int indexing;
+    int next_load;       // Следующий индекс для загрузчиков
+    double load_start_ms;
+    int load_reported;   // Отчёт о загрузке выводится один раз, после стартового пула
+    int pending;         // Шрифты, ожидающие загрузки
+    int generation;      // Увеличивается, когда шрифт загрузился
+    int seen_generation; // Последнее поколение, обработанное главным потоком
+    volatile int quit;
 } SoundFontList;
 
 static const struct {
@@ -193,688 +290,4851 @@ static int get_category(int preset) {
     return -1;
 }
 
-SoundFontList* find_soundfonts() {
-    SoundFontList* list = malloc(sizeof(SoundFontList));
-    list->count = 0;
-    list->capacity = MAX_SOUNDFONTS;
-    list->files = malloc(list->capacity * sizeof(char*));
-    list->sizes = malloc(list->capacity * sizeof(long));
-    list->active_sf = 0;
-    list->current_stream = 0;
+#define MIDI_CATEGORY_COUNT (int)(sizeof(midi_categories) / sizeof(midi_categories[0]))
 
-    DIR* dir = opendir("bank");
+static int preset_index_has(const PresetIndex* index, int preset, int bank) { return index->bits[bank][preset >> 3] & (1 << (preset & 7)); }
 
-    if (dir) {
-        struct dirent* entry;
+static PresetIndex* preset_index_alloc() {
+    PresetIndex* index = malloc(sizeof(PresetIndex));
+    memset(index->bits, 0, sizeof(index->bits));
+    memset(index->first_bank, -1, sizeof(index->first_bank));
+    return index;
+}
 
-        while ((entry = readdir(dir)) && list->count < list->capacity) {
-            char* name = entry->d_name;
-            size_t len = strlen(name);
+static void preset_index_add(PresetIndex* index, int preset, int bank) {
+    // Банк 128 (ударные SF2) при поиске по банкам 0–127 не участвует
+    if (preset > 127 || bank > 127) { return; }
 
-            if (len >= 4 && strcasecmp(name + len - 4, ".sf2") == 0) {
-                char filepath[512];
-                snprintf(filepath, sizeof(filepath), "bank/%s", name);
-                list->files[list->count] = strdup(filepath);
-                struct stat file_stat;
+    index->bits[bank][preset >> 3] |= 1 << (preset & 7);
 
-                if (stat(filepath, &file_stat) == 0) {
-                    list->sizes[list->count] = file_stat.st_size;
-                    list->count++;
-                }
-            }
-        }
+    if (index->first_bank[preset] < 0 || bank < index->first_bank[preset]) { index->first_bank[preset] = bank; }
+}
 
-        closedir(dir);
-    }
+static PresetIndex* preset_index_build(HSOUNDFONT font) {
+    BASS_MIDI_FONTINFO info;
 
-    if (list->count == 0) {
-        dir = opendir(".");
+    if (!font || !BASS_MIDI_FontGetInfo(font, &info)) { return NULL; }
 
-        if (dir) {
-            struct dirent* entry;
+    PresetIndex* index = preset_index_alloc();
+    DWORD* presets = malloc((info.presets + 1) * sizeof(DWORD));
 
-            while ((entry = readdir(dir)) && list->count < list->capacity) {
-                char* name = entry->d_name;
-                size_t len = strlen(name);
+    if (BASS_MIDI_FontGetPresets(font, presets)) {
+        for (DWORD i = 0; i < info.presets; i++) { preset_index_add(index, LOWORD(presets[i]), HIWORD(presets[i])); }
+    }
 
-                if (len >= 4 && strcasecmp(name + len - 4, ".sf2") == 0) {
-                    list->files[list->count] = strdup(name);
-                    struct stat file_stat;
+    free(presets);
+    return index;
+}
 
-                    if (stat(name, &file_stat) == 0) {
-                        list->sizes[list->count] = file_stat.st_size;
-                        list->count++;
-                    }
-                }
-            }
+// Тот же порядок поиска, что и у прямого опроса шрифтов: активный шрифт с банком, активный в любом банке,
+// другие шрифты с банком, затем первый пресет той же категории — сначала в активном, потом в остальных.
+// После открытых шрифтов идут закрытые, чьи пресеты известны из индекса .sf2 (их откроют по требованию)
+static void preset_table_rebuild(SoundFontList* list) {
+    int* order = malloc((list->count + 1) * sizeof(int));
+    int16_t (*cat_first)[MIDI_CATEGORY_COUNT] = malloc((list->count + 1) * sizeof(*cat_first)); // preset | bank << 8, -1 — нет
+    int n = 0;
 
-            closedir(dir);
-        }
+    if (list->active_sf < list->count && list->status[list->active_sf] == SF_READY && list->presets[list->active_sf]) {
+        order[n++] = list->active_sf;
     }
 
-    // Инициализация SoundFont'ов и фильтрация некорректных
-    int valid_count = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (i != list->active_sf && list->status[i] == SF_READY && list->presets[i]) { order[n++] = i; }
+    }
 
     for (int i = 0; i < list->count; i++) {
-        list->fonts[i].font = BASS_MIDI_FontInit(list->files[i], 0);
-        list->fonts[i].preset = -1;
-        list->fonts[i].bank = 0;
-
-        if (list->fonts[i].font) {
-            if (i != valid_count) {
-                list->fonts[valid_count] = list->fonts[i];
-                list->files[valid_count] = list->files[i];
-                list->sizes[valid_count] = list->sizes[i];
-                list->files[i] = NULL;
-            }
+        if (i != list->active_sf && list->status[i] != SF_READY && list->status[i] != SF_FAILED && list->presets[i]) { order[n++] = i; }
+    }
 
-            valid_count++;
-        }
+    if (!list->table) { list->table = malloc(sizeof(PresetTable)); }
 
-        else {
-            printf("Failed to load SoundFont %s\n", list->files[i]);
-            free(list->files[i]);
-            list->files[i] = NULL;
+    for (int k = 0; k < n; k++) {
+        const PresetIndex* index = list->presets[order[k]];
+
+        for (int c = 0; c < MIDI_CATEGORY_COUNT; c++) {
+            cat_first[k][c] = -1;
+
+            for (int p = midi_categories[c].min_preset; p <= midi_categories[c].max_preset && cat_first[k][c] < 0; p++) {
+                if (index->first_bank[p] >= 0) { cat_first[k][c] = p | index->first_bank[p] << 8; }
+            }
         }
     }
 
-    list->count = valid_count;
+    const PresetIndex* active = n > 0 && order[0] == list->active_sf ? list->presets[order[0]] : NULL;
 
-    // Сортировка по размеру
-    for (int i = 0; i < list->count - 1; i++) {
-        for (int j = i + 1; j < list->count; j++) {
-            if (list->sizes[i] < list->sizes[j]) {
-                long temp_size = list->sizes[i];
-                char* temp_file = list->files[i];
-                BASS_MIDI_FONT temp_font = list->fonts[i];
-                list->sizes[i] = list->sizes[j];
-                list->files[i] = list->files[j];
-                list->fonts[i] = list->fonts[j];
-                list->sizes[j] = temp_size;
-                list->files[j] = temp_file;
-                list->fonts[j] = temp_font;
+    for (int bank = 0; bank < 128; bank++) {
+        for (int preset = 0; preset < 128; preset++) {
+            PresetChoice* choice = &list->table->entries[bank][preset];
+            choice->sf_index = -1;
+            choice->preset = preset;
+            choice->bank = bank;
+
+            if (active && preset_index_has(active, preset, bank)) {
+                choice->sf_index = list->active_sf;
+                continue;
+            }
+
+            if (active && active->first_bank[preset] >= 0) {
+                choice->sf_index = list->active_sf;
+                choice->bank = active->first_bank[preset];
+                continue;
+            }
+
+            for (int k = active ? 1 : 0; k < n && choice->sf_index < 0; k++) {
+                if (preset_index_has(list->presets[order[k]], preset, bank)) { choice->sf_index = order[k]; }
+            }
+
+            int category = get_category(preset);
+
+            for (int k = 0; k < n && choice->sf_index < 0 && category >= 0; k++) {
+                if (cat_first[k][category] >= 0) {
+                    choice->sf_index = order[k];
+                    choice->preset = cat_first[k][category] & 0xFF;
+                    choice->bank = cat_first[k][category] >> 8;
+                }
             }
         }
     }
 
+    free(order);
+    free(cat_first);
+}
+
+static SoundFontList* soundfont_list_alloc() {
+    SoundFontList* list = malloc(sizeof(SoundFontList));
+    memset(list, 0, sizeof(SoundFontList));
+    list->failed = midi_list_init();
+    list->catalog_dir = "bank";
+    list->wanted_font = -1;
+    list->pinned_font = -1;
+    pthread_mutex_init(&list->lock, NULL);
     return list;
 }
 
-void soundfont_list_free(SoundFontList* list) {
-    if (list) {
-        for (int i = 0; i < list->count; i++) {
-            if (list->files[i]) { free(list->files[i]); }
+// Добавляет шрифт в каталог (путь переходит во владение списка)
+static void soundfont_list_add(SoundFontList* list, char* path, long size, int64_t mtime_ns) {
+    if (list->count >= list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->files = realloc(list->files, list->capacity * sizeof(char*));
+        list->sizes = realloc(list->sizes, list->capacity * sizeof(long));
+        list->fonts = realloc(list->fonts, list->capacity * sizeof(BASS_MIDI_FONT));
+        list->presets = realloc(list->presets, list->capacity * sizeof(PresetIndex*));
+        list->status = realloc(list->status, list->capacity * sizeof(int));
+        list->mtimes = realloc(list->mtimes, list->capacity * sizeof(int64_t));
+        list->load_ms = realloc(list->load_ms, list->capacity * sizeof(double));
+        list->last_used = realloc(list->last_used, list->capacity * sizeof(uint32_t));
+    }
 
-            if (list->fonts[i].font) { BASS_MIDI_FontFree(list->fonts[i].font); }
-        }
+    int i = list->count++;
+    list->files[i] = path;
+    list->sizes[i] = size;
+    list->mtimes[i] = mtime_ns;
+    list->fonts[i].font = 0;
+    list->fonts[i].preset = -1;
+    list->fonts[i].bank = 0;
+    list->presets[i] = NULL;
+    list->status[i] = SF_PENDING;
+    list->load_ms[i] = 0.0;
+    list->last_used[i] = 0;
+}
 
-        free(list->files);
-        free(list->sizes);
-        free(list);
-    }
+typedef struct {
+    char* path;
+    long size;
+    int64_t mtime_ns;
+} FontCatalogEntry;
+
+// Крупные шрифты первыми, при равном размере — по имени
+static int compare_font_entries(const void* a, const void* b) {
+    const FontCatalogEntry* fa = (const FontCatalogEntry*)a;
+    const FontCatalogEntry* fb = (const FontCatalogEntry*)b;
+
+    if (fa->size != fb->size) { return fa->size < fb->size ? 1 : -1; }
+
+    return strcmp(fa->path, fb->path);
 }
 
-int compare_strings(const void* a, const void* b) { return strcmp(*(const char**)a, *(const char**)b); }
+// Упакованный шрифт (--repack) лежит рядом с исходным: "name.sf2" -> "name.sf2pack"
+#define SF2PACK_SUFFIX "pack"
 
-int file_exists(const char* filename) { return access(filename, F_OK) == 0; }
+// 1 — файл уступает соседу: исходный .sf2 — свежему .sf2pack, устаревший .sf2pack — изменённому после него .sf2
+static int soundfont_shadowed(const char* path, int pack, const struct stat* st) {
+    size_t len = strlen(path);
+    char* other = pack ? strndup(path, len - strlen(SF2PACK_SUFFIX)) : malloc(len + sizeof(SF2PACK_SUFFIX));
+    struct stat other_stat;
+    int shadowed = 0;
 
-void update_midi_list(MidiList* list, const char* explicit_file) {
-    MidiList* new_list = midi_list_init();
-    DIR *dir;
-    struct dirent *entry;
-    int found_in_midi = 0;
+    if (!pack) { snprintf(other, len + sizeof(SF2PACK_SUFFIX), "%s" SF2PACK_SUFFIX, path); }
 
-    int ends_with_ci(const char *s, const char *suffix) {
-        size_t slen = strlen(s), suffixlen = strlen(suffix);
-        return suffixlen <= slen && strcasecmp(s + slen - suffixlen, suffix) == 0;
+    if (stat(other, &other_stat) == 0) {
+        shadowed = pack ? stat_mtime_ns(&other_stat) > stat_mtime_ns(st) : stat_mtime_ns(&other_stat) >= stat_mtime_ns(st);
     }
 
-    void find_midi_recursive(MidiList* ml, const char* dirname, int* found) {
-        DIR* d;
-        struct dirent* ent;
+    free(other);
+    return shadowed;
+}
 
-        if (!(d = opendir(dirname))) { return; }
+// Каталог SoundFont'ов: только readdir и stat, сами шрифты загружаются позже.
+// packed — брать упакованные копии вместо исходных, где они есть
+SoundFontList* find_soundfonts(int packed) {
+    SoundFontList* list = soundfont_list_alloc();
+    const char* dirs[] = {"bank", "."};
+    FontCatalogEntry* entries = NULL;
+    int count = 0, capacity = 0;
 
-        while ((ent = readdir(d))) {
-            if (ent->d_type == DT_DIR) {
-                if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) { continue; }
+    for (int d = 0; d < 2 && count == 0; d++) {
+        DIR* dir = opendir(dirs[d]);
 
-                char subdir_path[512];
-                snprintf(subdir_path, sizeof(subdir_path), "%s/%s", dirname, ent->d_name);
-                find_midi_recursive(ml, subdir_path, found);
-            }
+        if (!dir) { continue; }
 
-            else if (ent->d_type == DT_REG && (ends_with_ci(ent->d_name, ".mid") || ends_with_ci(ent->d_name, ".midi"))) {
-                char filepath[512];
-                snprintf(filepath, sizeof(filepath), "%s/%s", dirname, ent->d_name);
-                midi_list_add(ml, filepath);
-                *found = 1;
-            }
-        }
+        list->catalog_dir = dirs[d];
+        struct dirent* entry;
 
-        closedir(d);
-    }
+        while ((entry = readdir(dir))) {
+            int pack = ends_with_ci(entry->d_name, ".sf2" SF2PACK_SUFFIX);
 
-    if ((dir = opendir("midi"))) {
-        closedir(dir);
-        find_midi_recursive(new_list, "midi", &found_in_midi);
-    }
+            if (!ends_with_ci(entry->d_name, ".sf2") && !(pack && packed)) { continue; }
 
-    if (!found_in_midi && (dir = opendir("."))) {
-        while ((entry = readdir(dir)))
-            if (entry->d_type == DT_REG && (ends_with_ci(entry->d_name, ".mid") || ends_with_ci(entry->d_name, ".midi"))) {
-                midi_list_add(new_list, entry->d_name);
+            char* path = d == 0 ? path_join(dirs[d], entry->d_name) : strdup(entry->d_name);
+            struct stat file_stat;
+
+            if (stat(path, &file_stat) != 0 || (packed && soundfont_shadowed(path, pack, &file_stat))) {
+                free(path);
+                continue;
             }
 
-        closedir(dir);
-    }
+            if (count >= capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                entries = realloc(entries, capacity * sizeof(FontCatalogEntry));
+            }
 
-    if (explicit_file) { midi_list_add(new_list, explicit_file); }
+            entries[count].path = path;
+            entries[count].size = file_stat.st_size;
+            entries[count].mtime_ns = stat_mtime_ns(&file_stat);
+            count++;
+        }
 
-    if (new_list->count) { qsort(new_list->files, new_list->count, sizeof(char*), compare_strings); }
+        closedir(dir);
+    }
 
-    for (int i = 0; i < list->count; i++) { free(list->files[i]); }
+    // Сортировка по размеру
+    qsort(entries, count, sizeof(FontCatalogEntry), compare_font_entries);
 
-    free(list->files);
-    list->files = new_list->files;
-    list->count = new_list->count;
-    list->capacity = new_list->capacity;
-    free(new_list);
-}
+    for (int i = 0; i < count; i++) { soundfont_list_add(list, entries[i].path, entries[i].size, entries[i].mtime_ns); }
 
-struct termios old_tio, new_tio;
-void init_terminal() {
-    tcgetattr(STDIN_FILENO, &old_tio);
-    new_tio = old_tio;
-    new_tio.c_lflag &= (~ICANON & ~ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
-    fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
+    free(entries);
+    return list;
 }
 
-void reset_terminal() { tcsetattr(STDIN_FILENO, TCSANOW, &old_tio); }
-
-int get_key() {
-    char c;
-
-    if (read(STDIN_FILENO, &c, 1) != 1) { return -1; }
-
-    if (c == 27) { // Escape-последовательности
-        char seq[3];
+static void soundfont_set_loaded(SoundFontList* list, int i, HSOUNDFONT font, double load_ms) {
+    // Пресеты уже известны из индекса .sf2 — BASS опрашивать не нужно
+    pthread_mutex_lock(&list->lock);
+    int indexed = list->presets[i] != NULL;
+    pthread_mutex_unlock(&list->lock);
 
-        if (read(STDIN_FILENO, &seq, 2) == 2 && seq[0] == '[') {
-            if (seq[1] == 'C') { return 1; } // Вправо
+    PresetIndex* index = indexed ? NULL : preset_index_build(font);
 
-            if (seq[1] == 'D') { return 2; } // Влево
-        }
+    pthread_mutex_lock(&list->lock);
+    list->fonts[i].font = font;
+    list->load_ms[i] = load_ms;
 
-        return -1;
+    // Карта, которую фоновый индекс успел положить за время загрузки, уступает построенной по самому шрифту
+    if (!indexed) {
+        free(list->presets[i]);
+        list->presets[i] = index;
     }
 
-    if (c >= '0' && c <= '9') { return 20 + (c - '0'); }
+    if (list->status[i] == SF_PENDING) { list->pending--; }
 
-    switch (tolower(c)) {
-        case 'p':
-            return 3;  // Pause
+    list->status[i] = font ? SF_READY : SF_FAILED;
+    list->last_used[i] = ++list->use_clock;
+    list->generation++;
+    preset_table_rebuild(list);
+    pthread_mutex_unlock(&list->lock);
+}
 
-        case 'q':
-            return 4;  // Quit
+void soundfont_set_active(SoundFontList* list, int i) {
+    pthread_mutex_lock(&list->lock);
+    list->active_sf = i;
+    list->last_used[i] = ++list->use_clock;
+    preset_table_rebuild(list);
+    pthread_mutex_unlock(&list->lock);
+}
 
-        case 'r':
-            return 5;  // Reverb
+// Загрузка шрифта; размер и время изменения из снимка проверяются только здесь, при первом использовании
+static HSOUNDFONT soundfont_init(SoundFontList* list, int i) {
+    struct stat file_stat;
 
-        case 'c':
-            return 6;  // Chorus
+    if (stat(list->files[i], &file_stat) != 0) { return 0; }
 
-        case 's':
-            return 7;  // Stereo
+    pthread_mutex_lock(&list->lock);
 
-        case 'v':
-            return 8;  // Vibrato
+    // Шрифт заменён на месте: карта пресетов из индекса к нему уже не относится
+    if (list->sizes[i] != file_stat.st_size || list->mtimes[i] != stat_mtime_ns(&file_stat)) {
+        free(list->presets[i]);
+        list->presets[i] = NULL;
+    }
 
-        case 't':
-            return 9;  // Tremolo
+    list->sizes[i] = file_stat.st_size;
+    list->mtimes[i] = stat_mtime_ns(&file_stat);
+    pthread_mutex_unlock(&list->lock);
+    return BASS_MIDI_FontInit(list->files[i], mmap_fonts ? BASS_MIDI_FONT_MMAP : 0);
+}
 
-        case 'e':
-            return 10; // Echo
+// Синхронно загружает первый пригодный шрифт (начиная с preferred), чтобы воспроизведение началось как можно раньше
+int soundfont_load_first(SoundFontList* list, int preferred) {
+    list->pending = list->count;
+    list->load_start_ms = now_ms();
 
-        case '-':
-            return 12; // Decrease rate
+    if (preferred < 0 || preferred >= list->count) { preferred = 0; }
 
-        case '=':
-        case '+':
-            return 13; // Increase rate
+    for (int n = 0; n < list->count; n++) {
+        int i = (preferred + n) % list->count;
+        double start = now_ms();
+        HSOUNDFONT font = soundfont_init(list, i);
+        soundfont_set_loaded(list, i, font, now_ms() - start);
 
-        case 'd':
-            return 14; // 3D Depth
+        if (font) {
+            soundfont_set_active(list, i);
 
-        case ']':
-            return 15; // Increase depth
+            // Остаток рабочего набора загружает пул, шрифты за его пределами открываются по требованию
+            int slots = working_set - 1;
 
-        case '[':
-            return 16; // Decrease depth
+            for (int j = 0; j < list->count; j++) {
+                if (list->status[j] != SF_PENDING) { continue; }
 
-        case 'k':
-            return 17; // Keyboard
+                if (slots > 0) { slots--; }
 
-        case 'i':
-            return 18; // Channel Info
+                else {
+                    list->status[j] = SF_CLOSED;
+                    list->pending--;
+                }
+            }
 
-        default:
-            return -1;
+            return 1;
+        }
     }
+
+    return 0;
 }
 
-void apply_effects(HSTREAM stream, HFX* reverb, HFX* chorus, HFX* echo, HFX* vibrato, HFX* tremolo, HFX* rotate) {
-    if (*reverb) { BASS_ChannelRemoveFX(stream, *reverb); }
+// Открывает закрытый шрифт по требованию (синхронно); 1 — шрифт готов
+int soundfont_open(SoundFontList* list, int i) {
+    pthread_mutex_lock(&list->lock);
+    int status = list->status[i];
+    pthread_mutex_unlock(&list->lock);
 
-    if (*chorus) { BASS_ChannelRemoveFX(stream, *chorus); }
+    if (status != SF_CLOSED) { return status == SF_READY; }
 
-    if (*echo) { BASS_ChannelRemoveFX(stream, *echo); }
+    double start = now_ms();
+    HSOUNDFONT font = soundfont_init(list, i);
+    soundfont_set_loaded(list, i, font, now_ms() - start);
+    return font != 0;
+}
+
+// Закрывает давно не использованные шрифты сверх рабочего набора (активный не трогается).
+// Дескрипторы освобождает soundfont_release_closed(), когда цепочка потока уже перестроена без них
+int soundfont_trim(SoundFontList* list) {
+    int open = 0, closed = 0;
+    pthread_mutex_lock(&list->lock);
 
-    if (*vibrato) { BASS_ChannelRemoveFX(stream, *vibrato); }
+    for (int i = 0; i < list->count; i++) if (list->status[i] == SF_READY) { open++; }
 
-    if (*tremolo) { BASS_ChannelRemoveFX(stream, *tremolo); }
+    while (open > working_set) {
+        int lru = -1;
 
-    if (*rotate) { BASS_ChannelRemoveFX(stream, *rotate); }
+        for (int i = 0; i < list->count; i++) {
+            int in_use = i == list->active_sf || i == list->pinned_font;
 
-    *reverb = *chorus = *echo = *vibrato = *tremolo = *rotate = 0;
+            // Шрифты, из которых сейчас звучат каналы, тоже не закрываются
+            for (int ch = 0; ch < 16 && !in_use; ch++) { in_use = channel_presets[ch].sf_index == i; }
 
-    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_PAN, 0.0f);
-    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_VOL, global_volume);
+            if (list->status[i] == SF_READY && !in_use && (lru < 0 || list->last_used[i] < list->last_used[lru])) { lru = i; }
+        }
 
-    if (reverb_enabled) {
-        *reverb = BASS_ChannelSetFX(stream, BASS_FX_DX8_REVERB, 0);
+        if (lru < 0) { break; }
 
-        if (*reverb) { BASS_FXSetParameters(*reverb, &reverbParams); }
+        // Битовая карта пресетов остаётся: по ней шрифт можно снова открыть по требованию
+        list->status[lru] = SF_CLOSED;
+        open--;
+        closed++;
     }
 
-    if (chorus_enabled) {
-        *chorus = BASS_ChannelSetFX(stream, BASS_FX_DX8_CHORUS, 1);
+    if (closed) { preset_table_rebuild(list); }
 
-        if (*chorus) { BASS_FXSetParameters(*chorus, &chorusParams); }
-    }
+    pthread_mutex_unlock(&list->lock);
+    return closed;
+}
 
-    if (echo_enabled) {
-        *echo = BASS_ChannelSetFX(stream, BASS_FX_DX8_ECHO, 2);
+void soundfont_release_closed(SoundFontList* list) {
+    pthread_mutex_lock(&list->lock);
 
-        if (*echo) { BASS_FXSetParameters(*echo, &echoParams); }
+    for (int i = 0; i < list->count; i++) {
+        if (list->status[i] == SF_CLOSED && list->fonts[i].font) {
+            BASS_MIDI_FontFree(list->fonts[i].font);
+            list->fonts[i].font = 0;
+        }
     }
 
-    if (stereo_pan_enabled) {
-        if (!stream) {
-            printf("Error: Invalid stream for Stereo Rotate\n");
-        }
+    pthread_mutex_unlock(&list->lock);
+}
 
-        else {
-            *rotate = BASS_ChannelSetFX(stream, BASS_FX_BFX_ROTATE, 3);
+// Поток пула: берёт следующий ожидающий шрифт (список уже упорядочен по размеру, крупные первыми)
+static void* soundfont_loader(void* arg) {
+    SoundFontList* list = (SoundFontList*)arg;
 
-            if (*rotate) {
-                BASS_FXSetParameters(*rotate, &rotateParams);
-            }
+    while (!list->quit) {
+        pthread_mutex_lock(&list->lock);
 
-            else {
-                printf("Failed to set Stereo Rotate: %d\n", BASS_ErrorGetCode());
-            }
-        }
-    }
+        while (list->next_load < list->count && list->status[list->next_load] != SF_PENDING) { list->next_load++; }
 
-    if (vibrato_enabled) {
-        *vibrato = BASS_ChannelSetFX(stream, BASS_FX_DX8_FLANGER, 4);
+        int i = list->next_load < list->count ? list->next_load++ : -1;
+        pthread_mutex_unlock(&list->lock);
 
-        if (*vibrato) { BASS_FXSetParameters(*vibrato, &vibratoParams); }
+        if (i < 0) { break; }
+
+        double start = now_ms();
+        HSOUNDFONT font = soundfont_init(list, i);
+        soundfont_set_loaded(list, i, font, now_ms() - start);
     }
 
-    if (tremolo_enabled) {
-        *tremolo = BASS_ChannelSetFX(stream, BASS_FX_DX8_PARAMEQ, 5);
+    return NULL;
+}
 
-        if (*tremolo) { BASS_FXSetParameters(*tremolo, &tremoloParams); }
-    }
+// Остальные шрифты загружаются пулом потоков и подключаются к потоку по мере готовности
+void soundfont_start_loader(SoundFontList* list) {
+    int threads = font_threads > 0 ? font_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
 
-    if (!stereo_pan_enabled && fabsf(depth_3d) > 0.1f) {
-        current_depth = current_depth * 0.9f + depth_3d * 0.1f;
-        float pan = current_depth * 0.1f;
-        float vol = 1.0f - fabsf(current_depth) * 0.02f;
+    if (threads > MAX_FONT_THREADS) { threads = MAX_FONT_THREADS; }
 
-        if (vol < 0.1f) { vol = 0.1f; }
+    if (threads > list->pending) { threads = list->pending; }
 
-        BASS_ChannelSetAttribute(stream, BASS_ATTRIB_PAN, pan);
-        BASS_ChannelSetAttribute(stream, BASS_ATTRIB_VOL, vol * global_volume);
+    for (int t = 0; t < threads; t++) {
+        if (pthread_create(&list->loaders[list->loader_count], NULL, soundfont_loader, list) == 0) { list->loader_count++; }
     }
 }
 
-void draw_spectrum(HSTREAM stream) {
-    float fft[128];
-    char buffer[1024] = {0};
-    char *ptr = buffer;
+static void soundfont_join_loaders(SoundFontList* list) {
+    for (int t = 0; t < list->loader_count; t++) { pthread_join(list->loaders[t], NULL); }
 
-    if (BASS_ChannelGetData(stream, fft, BASS_DATA_FFT256) != -1) {
-        ptr += snprintf(ptr, buffer + sizeof(buffer) - ptr, " Bass: ");
+    list->loader_count = 0;
+}
 
-        for (int i = 0; i < 4; i++) {
-            int h = (int)(fft[i] * 200);
-            ptr += snprintf(ptr, buffer + sizeof(buffer) - ptr,
-                            "%s", h > 3 ? "▓▓▓" : h > 1 ? "▓▓ " : h > 0 ? "▓  " : "   ");
-        }
+// Время загрузки каждого шрифта и общее время пула
+static void soundfont_print_load_times(SoundFontList* list) {
+    printf("SoundFonts loaded in %.1f ms:\n", now_ms() - list->load_start_ms);
 
-        ptr += snprintf(ptr, buffer + sizeof(buffer) - ptr, " Mid: ");
+    for (int i = 0; i < list->count; i++) {
+        if (list->status[i] == SF_CLOSED) { continue; }
 
-        for (int i = 4; i < 8; i++) {
-            int h = (int)(fft[i] * 300);
-            ptr += snprintf(ptr, buffer + sizeof(buffer) - ptr,
-                            "%s", h > 3 ? "▒▒▒" : h > 1 ? "▒▒ " : h > 0 ? "▒  " : "   ");
-        }
+        const char* name = strrchr(list->files[i], '/') ? strrchr(list->files[i], '/') + 1 : list->files[i];
+        double mb = list->sizes[i] / (1024.0 * 1024.0);
+        printf("  %-40s %8.1f MB %9.1f ms%s\n", name, mb, list->load_ms[i], list->status[i] == SF_FAILED ? "  (failed)" : "");
+    }
+}
 
-        ptr += snprintf(ptr, buffer + sizeof(buffer) - ptr, " Treble: ");
+// Удаляет шрифты, которые не удалось загрузить, сохраняя индексы активного шрифта и каналов
+static void soundfont_compact(SoundFontList* list) {
+    int* remap = malloc(list->count * sizeof(int));
+    int valid_count = 0;
 
-        for (int i = 8; i < 12; i++) {
-            int h = (int)(fft[i] * 400);
-            ptr += snprintf(ptr, buffer + sizeof(buffer) - ptr,
-                            "%s", h > 3 ? "░░░" : h > 1 ? "░░ " : h > 0 ? "░  " : "   ");
+    for (int i = 0; i < list->count; i++) {
+        if (list->status[i] != SF_FAILED) {
+            remap[i] = valid_count;
+            list->fonts[valid_count] = list->fonts[i];
+            list->presets[valid_count] = list->presets[i];
+            list->status[valid_count] = list->status[i];
+            list->last_used[valid_count] = list->last_used[i];
+            list->files[valid_count] = list->files[i];
+            list->sizes[valid_count] = list->sizes[i];
+            list->mtimes[valid_count] = list->mtimes[i];
+            list->load_ms[valid_count] = list->load_ms[i];
+            valid_count++;
         }
 
-        printf("%s", buffer);
-        fflush(stdout);
+        else {
+            printf("Failed to load SoundFont %s\n", list->files[i]);
+            remap[i] = -1;
+            free(list->presets[i]);
+            midi_list_push(list->failed, list->files[i]);
+        }
     }
-}
 
-void CALLBACK MidiNoteProc(HSYNC handle, DWORD channel, DWORD data, void* user) {
-    uint8_t note = data & 0x7F;
-    uint8_t velocity = (data >> 8) & 0x7F;
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    uint32_t current_time = (uint32_t)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+    list->count = valid_count;
+    list->active_sf = remap[list->active_sf];
+    preset_table_rebuild(list);
 
-    if (velocity > 0) {
-        note_states[note] = velocity;
-        note_start_times[note] = current_time;
+    for (int i = 0; i < 16; i++) {
+        if (channel_presets[i].sf_index >= 0) { channel_presets[i].sf_index = remap[channel_presets[i].sf_index]; }
     }
 
-    else {
-        note_states[note] = 0;
-    }
+    free(remap);
 }
 
-void draw_midi_keyboard() {
-    if (!keyboard_visible) { return; }
+// Вызывается главным потоком: 1, если набор загруженных шрифтов изменился
+int soundfont_poll(SoundFontList* list) {
+    pthread_mutex_lock(&list->lock);
+    int changed = list->generation != list->seen_generation;
+    int done = changed && list->pending == 0;
+    list->seen_generation = list->generation;
+    pthread_mutex_unlock(&list->lock);
 
-    const int start_note = 60; // C4
-    const int end_note = 95;   // B6
-    const char* note_names[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    uint32_t current_time = (uint32_t)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+    // Потоки пула ждут lock, поэтому присоединяются без него
+    if (done) {
+        int failed = 0;
+        soundfont_join_loaders(list);
 
-    printf("┌─────────────────────[ Live MIDI Keyboard ]─────────────────────┐\n");
-    printf("  ");
+        pthread_mutex_lock(&list->lock);
 
-    for (int note = start_note; note <= end_note; note++) {
-        int key = note % 12;
+        if (list->count > 1 && !list->load_reported) { soundfont_print_load_times(list); }
 
-        if (key == 0 || key == 2 || key == 4 || key == 5 || key == 7 || key == 9 || key == 11) {
-            printf("%-3s", note_names[key]);
-        }
+        list->load_reported = 1;
+
+        for (int i = 0; i < list->count; i++) if (list->status[i] == SF_FAILED) { failed = 1; }
+
+        if (failed) { soundfont_compact(list); }
+
+        pthread_mutex_unlock(&list->lock);
     }
 
-    printf("\n");
-    printf(" ");
+    return changed;
+}
 
-    for (int note = start_note; note <= end_note; note++) {
-        int key = note % 12;
+void soundfont_stop_loader(SoundFontList* list) {
+    list->quit = 1;
+    soundfont_join_loaders(list);
 
-        if (key == 0 || key == 2 || key == 4 || key == 5 || key == 7 || key == 9 || key == 11) {
-            printf("(%d)", (note / 12) - 1);
-        }
+    if (list->indexing) {
+        pthread_join(list->indexer, NULL);
+        list->indexing = 0;
     }
+}
 
-    printf("\n");
-    printf(" ");
+void soundfont_list_free(SoundFontList* list) {
+    if (list) {
+        soundfont_stop_loader(list);
 
-    for (int note = start_note; note <= end_note; note++) {
-        int key = note % 12;
+        for (int i = 0; i < list->count; i++) {
+            if (list->files[i]) { free(list->files[i]); }
 
-        if (key == 0 || key == 2 || key == 4 || key == 5 || key == 7 || key == 9 || key == 11) {
-            if (note_states[note] > 0) {
-                printf(note_states[note] > 90 ? "┌█┐" : note_states[note] > 60 ? "┌▓┐" : "┌░┐");
-            }
+            if (list->fonts[i].font) { BASS_MIDI_FontFree(list->fonts[i].font); }
 
-            else {
-                uint32_t elapsed = current_time - note_start_times[note];
-                printf(elapsed < 300 ? "┌▓┐" : elapsed < 600 ? "┌░┐" : "┌─┐");
-            }
+            free(list->presets[i]);
         }
-    }
 
-    printf("\n");
-    printf("   ");
+        free(list->table);
+        free(list->files);
+        free(list->sizes);
+        free(list->fonts);
+        free(list->presets);
+        free(list->status);
+        free(list->mtimes);
+        free(list->load_ms);
+        free(list->last_used);
+        midi_list_free(list->failed);
+        pthread_mutex_destroy(&list->lock);
+        free(list);
+    }
+}
 
-    for (int note = start_note; note <= end_note; note++) {
-        int key = note % 12;
+// Обслуживание (--repack, --repack-encoder): шрифты каталога пакуются BASS_MIDI_FontPack в соседние .sf2pack.
+// --repack сводит сэмплы к 16 битам и хранит их как WAV (кодировщик "cat"), --repack-encoder сжимает их без потерь
+// внешним кодировщиком (stdin -> stdout); такие шрифты при загрузке декодирует BASS-дополнение из ./libbass
+#define REPACK_PCM_ENCODER "cat"
 
-        if (key == 1 || key == 3) { printf("%-3s", note_names[key]); }
+static const char* repack_encoder = NULL; // NULL — режим не включён
+static int repack_16bit = 0;
 
-        else if (key == 6 || key == 8 || key == 10) { printf("%-3s", note_names[key]); }
+static const char* codec_plugins[] = { "./libbass/libbassflac.so", "./libbass/libbasswv.so", "./libbass/libbassopus.so" };
 
-        else if (key == 0 || key == 5) { printf("   "); }
+void load_codec_plugins() {
+    for (int i = 0; i < (int)(sizeof(codec_plugins) / sizeof(codec_plugins[0])); i++) {
+        if (access(codec_plugins[i], R_OK) == 0) { BASS_PluginLoad(codec_plugins[i], 0); }
     }
+}
 
-    printf("\n");
-    printf("   ");
+static double cpu_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
 
-    for (int note = start_note; note <= end_note; note++) {
-        int key = note % 12;
+// Загружает все сэмплы шрифта: сколько они занимают в памяти и сколько процессорного времени стоили (с декодированием)
+static int repack_measure(const char* path, DWORD* samload, double* cpu) {
+    HSOUNDFONT font = BASS_MIDI_FontInit(path, 0);
+    BASS_MIDI_FONTINFO info = {0};
 
-        if (key == 1 || key == 3 || key == 6 || key == 8 || key == 10) {
-            if (note_states[note] > 0) {
-                printf(note_states[note] > 90 ? " █ " : note_states[note] > 60 ? " ▓ " : " ░ ");
-            }
+    if (!font) { return 0; }
 
-            else {
-                uint32_t elapsed = current_time - note_start_times[note];
-                printf(elapsed < 300 ? " ▓ " : elapsed < 600 ? " ░ " : "   ");
-            }
+    double start = cpu_ms();
+    int ok = BASS_MIDI_FontLoad(font, -1, -1);
+    *cpu = cpu_ms() - start;
+    BASS_MIDI_FontGetInfo(font, &info);
+    *samload = info.samload;
+    BASS_MIDI_FontFree(font);
+    return ok;
+}
+
+int repack_fonts() {
+    SoundFontList* catalog = find_soundfonts(0);
+    double totals[6] = {0};
+    int packed = 0;
+
+    printf("Repacking %d SoundFont(s) in '%s' (%s):\n", catalog->count, catalog->catalog_dir,
+           repack_16bit ? "16-bit PCM" : repack_encoder);
+    printf("  %-28s %9s %9s %9s %9s %9s %9s\n", "", "file MB", "packed", "RAM MB", "packed", "load ms", "packed");
+
+    for (int i = 0; i < catalog->count; i++) {
+        const char* path = catalog->files[i];
+        const char* base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        size_t out_size = strlen(path) + sizeof(SF2PACK_SUFFIX ".tmp");
+        char* out = malloc(out_size);
+        char* tmp = malloc(out_size);
+        DWORD mem_before = 0, mem_after = 0;
+        double cpu_before = 0.0, cpu_after = 0.0;
+        struct stat before, after;
+        snprintf(out, out_size, "%s" SF2PACK_SUFFIX, path);
+        snprintf(tmp, out_size, "%s" SF2PACK_SUFFIX ".tmp", path);
+
+        // Упаковка идёт во временный файл: прерванная на полпути копия новее исходного шрифта и заслонила бы его
+        HSOUNDFONT font = repack_measure(path, &mem_before, &cpu_before) ? BASS_MIDI_FontInit(path, 0) : 0;
+        int ok = font && BASS_MIDI_FontPack(font, tmp, repack_encoder, repack_16bit ? BASS_MIDI_PACK_16BIT : 0);
+
+        if (font) { BASS_MIDI_FontFree(font); }
+
+        if (!ok) { printf("  %-28.28s failed to pack (error: %d)\n", base, BASS_ErrorGetCode()); }
+
+        // Копия, которую не прочитать (нет дополнения под кодировщик), не должна заслонить исходный шрифт
+        else if (!repack_measure(tmp, &mem_after, &cpu_after) || stat(path, &before) != 0 || stat(tmp, &after) != 0) {
+            printf("  %-28.28s packed file does not load back (error: %d), removed\n", base, BASS_ErrorGetCode());
+            ok = 0;
         }
 
-        else if (key == 0 || key == 5) { printf("   "); }
-    }
+        else if (rename(tmp, out) != 0) {
+            printf("  %-28.28s cannot rename to %s: %s\n", base, out, strerror(errno));
+            ok = 0;
+        }
 
-    printf("\n");
-    printf(" Active Notes: \n");
-    int active_count = 0;
+        else {
+            double row[6] = { before.st_size, after.st_size, mem_before, mem_after, cpu_before, cpu_after };
+            printf("  %-28.28s %9.2f %9.2f %9.2f %9.2f %9.1f %9.1f\n", base, row[0] / 1048576.0, row[1] / 1048576.0,
+                   row[2] / 1048576.0, row[3] / 1048576.0, row[4], row[5]);
 
-    for (int note = start_note; note <= end_note; note++) {
-        if (note_states[note] > 0) {
-            printf(" [%s%d]", note_names[note % 12], (note / 12) - 1);
-            active_count++;
+            for (int k = 0; k < 6; k++) { totals[k] += row[k]; }
+
+            packed++;
         }
+
+        if (!ok) { unlink(tmp); }
+
+        free(tmp);
+        free(out);
     }
 
-    if (active_count == 0) { printf(" None"); }
+    if (packed > 1) {
+        printf("  %-28s %9.2f %9.2f %9.2f %9.2f %9.1f %9.1f\n", "total", totals[0] / 1048576.0, totals[1] / 1048576.0,
+               totals[2] / 1048576.0, totals[3] / 1048576.0, totals[4], totals[5]);
+    }
 
-    printf("\n");
-    printf("└────────────────────────────────────────────────────────────────┘\n");
+    int count = catalog->count;
+    printf("%d of %d packed; the player now loads the .sf2" SF2PACK_SUFFIX " copies\n", packed, count);
+    soundfont_list_free(catalog);
+    return packed == count;
 }
 
-void draw_channel_info(SoundFontList* sf_list) {
-    if (!channel_info_visible) { return; }
+// Закрытый шрифт, который понадобился каналу; -1 — нет
+int soundfont_take_wanted(SoundFontList* list) {
+    pthread_mutex_lock(&list->lock);
+    int wanted = list->wanted_font;
+    list->wanted_font = -1;
+    pthread_mutex_unlock(&list->lock);
+    return wanted;
+}
 
-    const int max_line_width = 61;
-    const int fixed_width = 10;
-    printf("┌─────────────────────[ Channel Presets ]────────────────────────┐\n");
+// Разбор SF2 без BASS: файл отображается в память, читаются только заголовки RIFF,
+// размер sdta/smpl и записи pdta/phdr + pbag — страницы с сэмплами не затрагиваются
+#define SF2_PHDR_SIZE 38
+#define SF2_PBAG_SIZE 4
 
-    // Показываем активный SoundFont
-    const char* sf_name = strrchr(sf_list->files[sf_list->active_sf], '/') ?
-                          strrchr(sf_list->files[sf_list->active_sf], '/') + 1 :
-                          sf_list->files[sf_list->active_sf];
-    char short_sf[48];
-    const char* clean_sf = sf_name;
+typedef struct {
+    char name[24];  // 20 байт имени из phdr, дополненные нулём
+    uint16_t preset;
+    uint16_t bank;
+    uint32_t zones; // Число зон по pbag
+} SF2Preset;
 
-    if (strncmp(sf_name, "_SF2__", 6) == 0) { clean_sf = sf_name + 6; }
+typedef struct {
+    uint64_t sample_bytes;
+    int preset_count;
+    SF2Preset* presets;
+} SF2Info;
 
-    else if (strncmp(sf_name, "SF2_", 4) == 0) { clean_sf = sf_name + 4; }
+static uint32_t read_le32(const uint8_t* p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
 
-    strncpy(short_sf, clean_sf, sizeof(short_sf)-1);
-    short_sf[sizeof(short_sf)-1] = '\0';
-    char* ext = strrchr(short_sf, '.');
+static uint16_t read_le16(const uint8_t* p) { return p[0] | p[1] << 8; }
 
-    if (ext && strcasecmp(ext, ".sf2") == 0) { *ext = '\0'; }
+int sf2_parse(const char* path, SF2Info* info) {
+    memset(info, 0, sizeof(SF2Info));
+    int fd = open(path, O_RDONLY);
 
-    int max_sf_header_len = max_line_width - 12;
+    if (fd < 0) { return 0; }
 
- //   if (strlen(short_sf) > max_sf_header_len - 3) {
-    if (strlen(short_sf) > max_sf_header_len - 3 && max_sf_header_len >= 3 && max_sf_header_len <= 48) {
-    short_sf[max_sf_header_len - 3] = '.';
-    short_sf[max_sf_header_len - 2] = '.';
-    short_sf[max_sf_header_len - 1] = '.';
-    short_sf[max_sf_header_len] = '\0';
-    }
+    struct stat st;
+    const uint8_t* data = MAP_FAILED;
 
-    printf("  SoundFont: %s\n", short_sf);
-    printf("├────────────────────────────────────────────────────────────────┤\n");
+    if (fstat(fd, &st) == 0 && st.st_size >= 12) { data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0); }
 
-    int active_channels = 0;
+    close(fd);
 
-    for (int i = 0; i < 16; i++) {
-        if (channel_presets[i].preset >= 0 && channel_presets[i].sf_index != sf_list->active_sf && channel_presets[i].sf_index >= 0) {
-            const char* inst_name = (channel_presets[i].preset < 128) ?
-                                    midi_instrument_names[channel_presets[i].preset] : "Unknown";
-            char display_inst[48];
-            strncpy(display_inst, inst_name, sizeof(display_inst)-1);
-            display_inst[sizeof(display_inst)-1] = '\0';
-            char channel_sf[48];
-            const char* alt_sf = strrchr(sf_list->files[channel_presets[i].sf_index], '/') ?
-                                 strrchr(sf_list->files[channel_presets[i].sf_index], '/') + 1 :
-                                 sf_list->files[channel_presets[i].sf_index];
-            const char* clean_alt_sf = alt_sf;
+    if (data == MAP_FAILED) { return 0; }
 
-            if (strncmp(alt_sf, "_SF2__", 6) == 0) { clean_alt_sf = alt_sf + 6; }
+    size_t size = st.st_size;
+    const uint8_t *phdr = NULL, *pbag = NULL;
+    uint32_t phdr_size = 0, pbag_size = 0;
 
-            else if (strncmp(alt_sf, "SF2_", 4) == 0) { clean_alt_sf = alt_sf + 4; }
+    // Упакованный шрифт (sfpk) устроен так же, сжаты только сэмплы
+    if (memcmp(data, "RIFF", 4) == 0 && (memcmp(data + 8, "sfbk", 4) == 0 || memcmp(data + 8, "sfpk", 4) == 0)) {
+        size_t end = (uint64_t)read_le32(data + 4) + 8 < size ? read_le32(data + 4) + 8 : size;
 
-            strncpy(channel_sf, clean_alt_sf, sizeof(channel_sf)-1);
-            channel_sf[sizeof(channel_sf)-1] = '\0';
-            char* ext = strrchr(channel_sf, '.');
+        for (size_t pos = 12; pos + 8 <= end;) {
+            uint32_t chunk_size = read_le32(data + pos + 4);
+            size_t body = pos + 8;
 
-            if (ext && strcasecmp(ext, ".sf2") == 0) { *ext = '\0'; }
+            if (chunk_size > end - body) { break; }
 
-            int inst_len = strlen(display_inst);
-            int max_sf_len = max_line_width - fixed_width - inst_len;
+            if (memcmp(data + pos, "LIST", 4) == 0 && chunk_size >= 4) {
+                const uint8_t* type = data + body;
 
-            if (max_sf_len < 0) { max_sf_len = 0; }
+                for (size_t sub = body + 4; sub + 8 <= body + chunk_size;) {
+                    uint32_t sub_size = read_le32(data + sub + 4);
 
-            if (strlen(channel_sf) > max_sf_len - 3 && max_sf_len >= 3) {
-                channel_sf[max_sf_len - 3] = '.';
-                channel_sf[max_sf_len - 2] = '.';
-                channel_sf[max_sf_len - 1] = '.';
-                channel_sf[max_sf_len] = '\0';
+                    if (sub_size > body + chunk_size - sub - 8) { break; }
+
+                    if (memcmp(type, "sdta", 4) == 0 && (memcmp(data + sub, "smpl", 4) == 0 || memcmp(data + sub, "sm24", 4) == 0)) {
+                        info->sample_bytes += sub_size;
+                    }
+
+                    else if (memcmp(type, "pdta", 4) == 0 && memcmp(data + sub, "phdr", 4) == 0) {
+                        phdr = data + sub + 8;
+                        phdr_size = sub_size;
+                    }
+
+                    else if (memcmp(type, "pdta", 4) == 0 && memcmp(data + sub, "pbag", 4) == 0) {
+                        pbag = data + sub + 8;
+                        pbag_size = sub_size;
+                    }
+
+                    sub += 8 + sub_size + (sub_size & 1);
+                }
             }
 
-            char format[32];
-            snprintf(format, sizeof(format), "  %%2d: %%-%ds %%s\n", max_sf_len);
-            printf(format, i, channel_sf, display_inst);
-            active_channels++;
+            pos = body + chunk_size + (chunk_size & 1);
         }
     }
 
-    if (active_channels == 0) {
-        printf("  No channels with borrowed instruments\n");
+    // Последняя запись phdr — терминатор EOP, по ней считается число зон предпоследнего пресета
+    int records = phdr_size / SF2_PHDR_SIZE;
+    int bags = pbag_size / SF2_PBAG_SIZE;
+    int ok = phdr && pbag && records >= 1;
+
+    if (ok) {
+        info->preset_count = records - 1;
+        info->presets = calloc(records, sizeof(SF2Preset));
+
+        for (int i = 0; i < info->preset_count; i++) {
+            const uint8_t* rec = phdr + i * SF2_PHDR_SIZE;
+            int bag = read_le16(rec + 24), next_bag = read_le16(rec + SF2_PHDR_SIZE + 24);
+            memcpy(info->presets[i].name, rec, 20);
+            info->presets[i].preset = read_le16(rec + 20);
+            info->presets[i].bank = read_le16(rec + 22);
+            info->presets[i].zones = next_bag >= bag && next_bag <= bags ? next_bag - bag : 0;
+        }
     }
 
-    printf("└────────────────────────────────────────────────────────────────┘\n");
+    munmap((void*)data, size);
+    return ok;
 }
 
-void CALLBACK MidiEventProc(HSYNC handle, DWORD channel, DWORD data, void* user) {
-    SoundFontList* sf_list = (SoundFontList*)user;
+// Постоянный индекс шрифтов: .echomidi/fonts.idx. Запись действительна, пока совпадают размер и время изменения файла.
+// Формат: FontIndexHeader, затем для каждого шрифта FontIndexRecord, путь (дополнен до 8 байт) и preset_count × SF2Preset
+#define FONT_INDEX_FILE STATE_DIR "/fonts.idx"
+#define FONT_INDEX_MAGIC "EMFIDX01"
 
-    if (!sf_list || !sf_list->current_stream) { return; }
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+} FontIndexHeader;
 
-    int chan = channel & 0x0F;
-    int preset = data & 0xFF;
-    int bank = (data >> 16) & 0x7F;
+typedef struct {
+    uint32_t path_len; // С завершающим нулём
+    uint32_t preset_count;
+    int64_t size;
+    int64_t mtime_ns;
+    uint64_t sample_bytes;
+} FontIndexRecord;
 
-    // Сбрасываем пресет канала
-    channel_presets[chan].preset = preset;
-    channel_presets[chan].bank = bank;
-    channel_presets[chan].sf_index = -1;
+typedef struct {
+    char* path;
+    int64_t size;
+    int64_t mtime_ns;
+    SF2Info info;
+} FontIndexEntry;
 
-    // Проверяем активный SoundFont
-    if (sf_list->fonts[sf_list->active_sf].font &&
-            BASS_MIDI_FontGetPreset(sf_list->fonts[sf_list->active_sf].font, preset, bank)) {
-        channel_presets[chan].sf_index = sf_list->active_sf;
-        return;
-    }
+typedef struct {
+    FontIndexEntry* items;
+    int count;
+    int capacity;
+} FontIndex;
 
-    // Проверяем другие банки в активном SoundFont'е
-    if (sf_list->fonts[sf_list->active_sf].font) {
-        for (int b = 0; b <= 127; b++) {
-            if (BASS_MIDI_FontGetPreset(sf_list->fonts[sf_list->active_sf].font, preset, b)) {
-                channel_presets[chan].sf_index = sf_list->active_sf;
-                channel_presets[chan].bank = b;
-                return;
-            }
-        }
+static int compare_font_index(const void* a, const void* b) { return strcmp(((const FontIndexEntry*)a)->path, ((const FontIndexEntry*)b)->path); }
+
+static FontIndexEntry* font_index_add(FontIndex* index) {
+    if (index->count >= index->capacity) {
+        index->capacity = index->capacity ? index->capacity * 2 : 16;
+        index->items = realloc(index->items, index->capacity * sizeof(FontIndexEntry));
     }
 
-    // Ищем в других SoundFont'ах
-    for (int i = 0; i < sf_list->count; i++) {
-        if (i == sf_list->active_sf) { continue; }
+    return &index->items[index->count++];
+}
 
-        if (sf_list->fonts[i].font &&
-                BASS_MIDI_FontGetPreset(sf_list->fonts[i].font, preset, bank)) {
-            channel_presets[chan].sf_index = i;
-            return;
-        }
+void font_index_free(FontIndex* index) {
+    for (int i = 0; i < index->count; i++) {
+        free(index->items[i].path);
+        free(index->items[i].info.presets);
     }
 
-    // Если пресет не найден, ищем в той же категории
-    int category = get_category(preset);
+    free(index->items);
+    memset(index, 0, sizeof(FontIndex));
+}
 
-    if (category >= 0) {
-        int min_preset = midi_categories[category].min_preset;
-        int max_preset = midi_categories[category].max_preset;
+// Загружает индекс (отсортирован по пути); повреждённый файл просто игнорируется
+void font_index_load(FontIndex* index) {
+    memset(index, 0, sizeof(FontIndex));
+    int fd = open(FONT_INDEX_FILE, O_RDONLY);
 
-        // Сначала активный SoundFont
-        if (sf_list->fonts[sf_list->active_sf].font) {
-            for (int p = min_preset; p <= max_preset; p++) {
-                for (int b = 0; b <= 127; b++) {
-                    if (BASS_MIDI_FontGetPreset(sf_list->fonts[sf_list->active_sf].font, p, b)) {
-                        channel_presets[chan].sf_index = sf_list->active_sf;
-                        channel_presets[chan].preset = p;
-                        channel_presets[chan].bank = b;
-                        return;
-                    }
-                }
-            }
-        }
+    if (fd < 0) { return; }
 
-        // Затем другие SoundFont'ы
-        for (int i = 0; i < sf_list->count; i++) {
-            if (i == sf_list->active_sf) { continue; }
+    struct stat st;
+    const uint8_t* data = MAP_FAILED;
 
-            for (int p = min_preset; p <= max_preset; p++) {
-                for (int b = 0; b <= 127; b++) {
-                    if (sf_list->fonts[i].font &&
-                            BASS_MIDI_FontGetPreset(sf_list->fonts[i].font, p, b)) {
-                        channel_presets[chan].sf_index = i;
-                        channel_presets[chan].preset = p;
-                        channel_presets[chan].bank = b;
-                        return;
-                    }
-                }
-            }
-        }
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(FontIndexHeader)) { data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0); }
+
+    close(fd);
+
+    if (data == MAP_FAILED) { return; }
+
+    const FontIndexHeader* header = (const FontIndexHeader*)data;
+    size_t pos = sizeof(FontIndexHeader), size = st.st_size;
+
+    for (uint32_t i = 0; memcmp(header->magic, FONT_INDEX_MAGIC, 8) == 0 && i < header->count; i++) {
+        if (size - pos < sizeof(FontIndexRecord)) { break; }
+
+        const FontIndexRecord* rec = (const FontIndexRecord*)(data + pos);
+        size_t path_space = (rec->path_len + 7) & ~(size_t)7;
+        size_t presets_size = (size_t)rec->preset_count * sizeof(SF2Preset);
+
+        if (rec->path_len == 0 || size - pos - sizeof(FontIndexRecord) < path_space + presets_size) { break; }
+
+        const char* path = (const char*)(rec + 1);
+
+        if (path[rec->path_len - 1] != '\0') { break; }
+
+        FontIndexEntry* entry = font_index_add(index);
+        entry->path = strdup(path);
+        entry->size = rec->size;
+        entry->mtime_ns = rec->mtime_ns;
+        entry->info.sample_bytes = rec->sample_bytes;
+        entry->info.preset_count = rec->preset_count;
+        entry->info.presets = malloc(presets_size + 1);
+        memcpy(entry->info.presets, path + path_space, presets_size);
+        pos += sizeof(FontIndexRecord) + path_space + presets_size;
     }
 
-    // Если ничего не найдено, устанавливаем пресет по умолчанию только для неударных каналов
-    if (chan != 9) { // Канал 10 (9 в 0-индексации) — ударные
-        channel_presets[chan].preset = 0; // Grand Piano
-        channel_presets[chan].bank = 0;
-        channel_presets[chan].sf_index = sf_list->active_sf;
+    munmap((void*)data, size);
+    qsort(index->items, index->count, sizeof(FontIndexEntry), compare_font_index);
+}
+
+int font_index_save(const FontIndex* index) {
+    mkdir(STATE_DIR, 0755);
+    FILE* f = fopen(FONT_INDEX_FILE ".tmp", "wb");
+
+    if (!f) { return 0; }
+
+    FontIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FONT_INDEX_MAGIC, 8);
+    header.count = index->count;
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    static const char padding[8] = {0};
+
+    for (int i = 0; ok && i < index->count; i++) {
+        const FontIndexEntry* entry = &index->items[i];
+        FontIndexRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.path_len = strlen(entry->path) + 1;
+        rec.preset_count = entry->info.preset_count;
+        rec.size = entry->size;
+        rec.mtime_ns = entry->mtime_ns;
+        rec.sample_bytes = entry->info.sample_bytes;
+        size_t pad = ((rec.path_len + 7) & ~7u) - rec.path_len;
+        ok = fwrite(&rec, sizeof(rec), 1, f) == 1 && fwrite(entry->path, 1, rec.path_len, f) == rec.path_len &&
+             fwrite(padding, 1, pad, f) == pad &&
+             fwrite(entry->info.presets, sizeof(SF2Preset), rec.preset_count, f) == rec.preset_count;
     }
 
-    else {
-        // Для ударных оставляем пресет как есть или используем активный SoundFont
-        channel_presets[chan].sf_index = sf_list->active_sf;
+    ok = (fclose(f) == 0) && ok && rename(FONT_INDEX_FILE ".tmp", FONT_INDEX_FILE) == 0;
+
+    if (!ok) { unlink(FONT_INDEX_FILE ".tmp"); }
+
+    return ok;
+}
+
+// Индексирует каталог шрифтов: неизменённые файлы берутся из fonts.idx, остальные разбираются заново.
+// Закрытые шрифты получают битовую карту пресетов, по которой их можно открыть по требованию;
+// у уже загруженных карта построена по самому шрифту и не заменяется.
+// Главный поток может тем временем уплотнить список (soundfont_compact), поэтому путь, размер и время
+// снимаются под lock, а шрифт для карты ищется заново по пути
+void soundfont_index_catalog(SoundFontList* list, int verbose) {
+    FontIndex cached, fresh = {0};
+    double start = now_ms();
+    int parsed = 0;
+    font_index_load(&cached);
+
+    pthread_mutex_lock(&list->lock);
+    int count = list->count;
+    char** paths = malloc((count + 1) * sizeof(char*));
+    long* sizes = malloc((count + 1) * sizeof(long));
+    int64_t* mtimes = malloc((count + 1) * sizeof(int64_t));
+
+    for (int i = 0; i < count; i++) {
+        paths[i] = strdup(list->files[i]);
+        sizes[i] = list->sizes[i];
+        mtimes[i] = list->mtimes[i];
     }
+
+    pthread_mutex_unlock(&list->lock);
+
+    for (int i = 0; i < count && !list->quit; i++) {
+        const char* path = paths[i];
+        long size = sizes[i];
+        int64_t mtime_ns = mtimes[i];
+        FontIndexEntry key = { .path = paths[i] };
+        FontIndexEntry* hit = cached.count ? bsearch(&key, cached.items, cached.count, sizeof(FontIndexEntry), compare_font_index) : NULL;
+        double file_start = now_ms();
+        int cached_hit = hit && hit->size == size && hit->mtime_ns == mtime_ns;
+        SF2Info info;
+
+        if (cached_hit) {
+            info = hit->info;
+            hit->info.presets = NULL; // Переходит в новый индекс
+        }
+
+        else if (sf2_parse(path, &info)) {
+            parsed++;
+        }
+
+        else {
+            if (verbose) { printf("  %-40s not a valid SoundFont 2 file\n", path); }
+
+            continue;
+        }
+
+        PresetIndex* presets = preset_index_alloc();
+
+        for (int p = 0; p < info.preset_count; p++) { preset_index_add(presets, info.presets[p].preset, info.presets[p].bank); }
+
+        pthread_mutex_lock(&list->lock);
+        int at = 0;
+
+        while (at < list->count && strcmp(list->files[at], path) != 0) { at++; }
+
+        if (at < list->count && !list->presets[at] && list->sizes[at] == size && list->mtimes[at] == mtime_ns) {
+            list->presets[at] = presets;
+            presets = NULL;
+            preset_table_rebuild(list);
+        }
+
+        pthread_mutex_unlock(&list->lock);
+        free(presets);
+
+        if (verbose) {
+            printf("  %-40s %4d presets %9.1f MB samples %7.2f ms%s\n", path, info.preset_count,
+                   info.sample_bytes / (1024.0 * 1024.0), now_ms() - file_start, cached_hit ? " (cached)" : "");
+        }
+
+        FontIndexEntry* entry = font_index_add(&fresh);
+        entry->path = strdup(path);
+        entry->size = size;
+        entry->mtime_ns = mtime_ns;
+        entry->info = info;
+    }
+
+    // Индекс перезаписывается, только если что-то разобрано заново или шрифты исчезли из каталога;
+    // прерванный выходом проход неполон и индекс не трогает
+    if ((parsed > 0 || fresh.count != cached.count) && !list->quit) { font_index_save(&fresh); }
+
+    // Фоновый проход молчит: его вывод лёг бы поверх интерфейса
+    if (verbose) {
+        printf("Font index: %d SoundFont(s), %d parsed, %d from %s in %.1f ms\n", fresh.count, parsed, fresh.count - parsed,
+               FONT_INDEX_FILE, now_ms() - start);
+    }
+
+    for (int i = 0; i < count; i++) { free(paths[i]); }
+
+    free(paths);
+    free(sizes);
+    free(mtimes);
+    font_index_free(&cached);
+    font_index_free(&fresh);
+}
+
+static void* soundfont_index_thread(void* arg) {
+    soundfont_index_catalog((SoundFontList*)arg, 0);
+    return NULL;
+}
+
+// Индекс строится после загрузки первого шрифта: разбор незнакомых .sf2 не задерживает первый звук
+void soundfont_start_indexer(SoundFontList* list) {
+    list->indexing = pthread_create(&list->indexer, NULL, soundfont_index_thread, list) == 0;
+}
+
+int compare_strings(const void* a, const void* b) { return strcmp(*(const char**)a, *(const char**)b); }
+
+int file_exists(const char* filename) { return access(filename, F_OK) == 0; }
+
+// Время изменения каталогов: по нему пересканирование пропускается, если в библиотеке ничего не менялось
+typedef struct {
+    char* path;
+    int64_t mtime_ns;
+} DirStamp;
+
+typedef struct {
+    DirStamp* items;
+    int count;
+    int capacity;
+} DirStampList;
+
+static void dir_stamps_add(DirStampList* list, const char* path, int64_t mtime_ns) {
+    if (list->count >= list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->items = realloc(list->items, list->capacity * sizeof(DirStamp));
+    }
+
+    list->items[list->count].path = strdup(path);
+    list->items[list->count].mtime_ns = mtime_ns;
+    list->count++;
+}
+
+static void dir_stamps_clear(DirStampList* list) {
+    for (int i = 0; i < list->count; i++) { free(list->items[i].path); }
+
+    free(list->items);
+    memset(list, 0, sizeof(DirStampList));
+}
+
+// 1, если ни один каталог не изменился с момента сканирования (отсутствующий каталог — mtime 0)
+static int dir_stamps_unchanged(const DirStampList* list) {
+    if (list->count == 0) { return 0; }
+
+    for (int i = 0; i < list->count; i++) {
+        struct stat st;
+        int64_t mtime_ns = stat(list->items[i].path, &st) == 0 ? stat_mtime_ns(&st) : 0;
+
+        if (mtime_ns != list->items[i].mtime_ns) { return 0; }
+    }
+
+    return 1;
+}
+
+// Параллельный обход каталога midi/: общая очередь каталогов, свободные потоки забирают из неё работу
+#define MAX_SCAN_THREADS 64
+
+static int scan_threads = 0; // 0 — по числу ядер
+
+typedef struct {
+    int files;
+    int dirs;
+    int threads;
+    double ms;
+} ScanStats;
+
+static ScanStats last_scan = {0};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char** dirs;         // Каталоги, ожидающие обхода
+    int dir_count;
+    int dir_capacity;
+    int busy;            // Потоки, обходящие каталог прямо сейчас
+    int dirs_scanned;
+    pthread_t threads[MAX_SCAN_THREADS];
+    int thread_count;    // Запущенные вспомогательные потоки
+    int max_threads;
+    MidiList* results[MAX_SCAN_THREADS + 1];
+    DirStampList* stamps; // Может быть NULL
+} ScanQueue;
+
+typedef struct {
+    ScanQueue* queue;
+    MidiList* found;
+} ScanWorker;
+
+static void* scan_worker(void* arg);
+
+static void scan_queue_push(ScanQueue* q, char* dir) {
+    if (q->dir_count >= q->dir_capacity) {
+        q->dir_capacity = q->dir_capacity ? q->dir_capacity * 2 : 64;
+        q->dirs = realloc(q->dirs, q->dir_capacity * sizeof(char*));
+    }
+
+    q->dirs[q->dir_count++] = dir;
+}
+
+// Дополнительный поток запускается, только когда в очереди есть работа для него
+static void scan_queue_spawn(ScanQueue* q) {
+    if (q->dir_count < 2 || q->thread_count + 1 >= q->max_threads) { return; }
+
+    ScanWorker* worker = malloc(sizeof(ScanWorker));
+    worker->queue = q;
+    worker->found = midi_list_init();
+
+    if (pthread_create(&q->threads[q->thread_count], NULL, scan_worker, worker) == 0) {
+        q->results[q->thread_count + 1] = worker->found;
+        q->thread_count++;
+    }
+
+    else {
+        midi_list_free(worker->found);
+        free(worker);
+    }
+}
+
+// Тип записи каталога; "." и ".." пропускаются (DT_UNKNOWN)
+static int dirent_type(DIR* d, struct dirent* ent) {
+    int type = ent->d_type;
+
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) { return DT_UNKNOWN; }
+
+    // На сетевых ФС d_type часто неизвестен
+    if (type == DT_UNKNOWN) {
+        struct stat st;
+
+        if (fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) { return DT_UNKNOWN; }
+
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+
+    return type;
+}
+
+static void scan_directory(ScanQueue* q, const char* dirname, MidiList* found) {
+    DIR* d = opendir(dirname);
+
+    if (!d) { return; }
+
+    MidiList* subdirs = midi_list_init();
+    struct dirent* ent;
+    struct stat dir_stat;
+    int64_t mtime_ns = fstat(dirfd(d), &dir_stat) == 0 ? stat_mtime_ns(&dir_stat) : 0;
+
+    while ((ent = readdir(d))) {
+        int type = dirent_type(d, ent);
+
+        if (type == DT_DIR) { midi_list_push(subdirs, path_join(dirname, ent->d_name)); }
+
+        else if (type == DT_REG && is_midi_name(ent->d_name)) { midi_list_push(found, path_join(dirname, ent->d_name)); }
+    }
+
+    closedir(d);
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->stamps) { dir_stamps_add(q->stamps, dirname, mtime_ns); }
+
+    for (int i = 0; i < subdirs->count; i++) { scan_queue_push(q, subdirs->files[i]); }
+
+    q->busy--;
+    q->dirs_scanned++;
+    scan_queue_spawn(q);
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+
+    free(subdirs->files);
+    free(subdirs);
+}
+
+static void scan_run(ScanQueue* q, MidiList* found) {
+    pthread_mutex_lock(&q->lock);
+
+    for (;;) {
+        while (q->dir_count == 0 && q->busy > 0) { pthread_cond_wait(&q->cond, &q->lock); }
+
+        if (q->dir_count == 0) { break; }
+
+        char* dir = q->dirs[--q->dir_count];
+        q->busy++;
+        pthread_mutex_unlock(&q->lock);
+        scan_directory(q, dir, found);
+        free(dir);
+        pthread_mutex_lock(&q->lock);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void* scan_worker(void* arg) {
+    ScanWorker* worker = (ScanWorker*)arg;
+    scan_run(worker->queue, worker->found);
+    free(worker);
+    return NULL;
+}
+
+// Обходит дерево root и добавляет найденные MIDI-файлы в ml (без сортировки)
+static void find_midi_parallel(MidiList* ml, const char* root, DirStampList* stamps) {
+    ScanQueue q;
+    memset(&q, 0, sizeof(q));
+    q.stamps = stamps;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+    q.max_threads = scan_threads > 0 ? scan_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (q.max_threads < 1) { q.max_threads = 1; }
+
+    if (q.max_threads > MAX_SCAN_THREADS) { q.max_threads = MAX_SCAN_THREADS; }
+
+    q.results[0] = ml;
+    scan_queue_push(&q, strdup(root));
+    scan_run(&q, ml); // Вызывающий поток тоже участвует в обходе
+
+    // Новые потоки запускаются только под блокировкой, поэтому после выхода из scan_run их число не меняется
+    for (int i = 0; i < q.thread_count; i++) { pthread_join(q.threads[i], NULL); }
+
+    // Слияние результатов потоков
+    for (int i = 1; i <= q.thread_count; i++) {
+        MidiList* part = q.results[i];
+
+        for (int j = 0; j < part->count; j++) { midi_list_push(ml, part->files[j]); }
+
+        free(part->files);
+        free(part);
+    }
+
+    last_scan.dirs = q.dirs_scanned;
+    last_scan.threads = q.thread_count + 1;
+    free(q.dirs);
+    pthread_cond_destroy(&q.cond);
+    pthread_mutex_destroy(&q.lock);
+}
+
+// stamps (может быть NULL) получает время изменения всех просмотренных каталогов
+void update_midi_list(MidiList* list, const char* explicit_file, DirStampList* stamps) {
+    MidiList* new_list = midi_list_init();
+    DIR *dir;
+    struct dirent *entry;
+    double scan_start = now_ms();
+    struct stat cwd_stat;
+
+    last_scan.dirs = 0;
+    last_scan.threads = 1;
+
+    // Появление каталога midi/ меняет время изменения текущего каталога
+    if (stamps && stat(".", &cwd_stat) == 0) { dir_stamps_add(stamps, ".", stat_mtime_ns(&cwd_stat)); }
+
+    if ((dir = opendir("midi"))) {
+        closedir(dir);
+        find_midi_parallel(new_list, "midi", stamps);
+    }
+
+    if (new_list->count == 0 && (dir = opendir("."))) {
+        while ((entry = readdir(dir)))
+            if (entry->d_type == DT_REG && is_midi_name(entry->d_name)) {
+                midi_list_push(new_list, strdup(entry->d_name));
+            }
+
+        closedir(dir);
+    }
+
+    if (explicit_file) { midi_list_push(new_list, strdup(explicit_file)); }
+
+    // Сортировка и удаление дубликатов за O(n log n) вместо midi_list_add для каждого файла
+    if (new_list->count) {
+        qsort(new_list->files, new_list->count, sizeof(char*), compare_strings);
+        int unique = 1;
+
+        for (int i = 1; i < new_list->count; i++) {
+            if (strcmp(new_list->files[i], new_list->files[unique - 1]) == 0) { free(new_list->files[i]); }
+
+            else { new_list->files[unique++] = new_list->files[i]; }
+        }
+
+        new_list->count = unique;
+    }
+
+    last_scan.files = new_list->count;
+    last_scan.ms = now_ms() - scan_start;
+
+    for (int i = 0; i < list->count; i++) { free(list->files[i]); }
+
+    free(list->files);
+    list->files = new_list->files;
+    list->count = new_list->count;
+    list->capacity = new_list->capacity;
+    free(new_list);
+}
+
+void print_scan_stats(const ScanStats* st) {
+    printf("Library scan: %d files in %d dirs, %.1f ms (%.0f files/s, %d threads)\n",
+           st->files, st->dirs, st->ms, st->ms > 0 ? st->files * 1000.0 / st->ms : 0.0, st->threads);
+}
+
+// Первый найденный MIDI-файл (обход в глубину с остановкой), чтобы начать играть до полного сканирования
+static char* find_first_midi(const char* dirname) {
+    DIR* d = opendir(dirname);
+
+    if (!d) { return NULL; }
+
+    MidiList* subdirs = midi_list_init();
+    char* result = NULL;
+    struct dirent* ent;
+
+    while (!result && (ent = readdir(d))) {
+        int type = dirent_type(d, ent);
+
+        if (type == DT_DIR) { midi_list_push(subdirs, path_join(dirname, ent->d_name)); }
+
+        else if (type == DT_REG && is_midi_name(ent->d_name)) {
+            result = strcmp(dirname, ".") == 0 ? strdup(ent->d_name) : path_join(dirname, ent->d_name);
+        }
+    }
+
+    closedir(d);
+
+    // В текущем каталоге подкаталоги не обходятся, как и в update_midi_list
+    for (int i = 0; !result && strcmp(dirname, ".") != 0 && i < subdirs->count; i++) {
+        result = find_first_midi(subdirs->files[i]);
+    }
+
+    midi_list_free(subdirs);
+    return result;
+}
+
+// Фоновое сканирование библиотеки: главный поток забирает готовый список через library_poll()
+#define LIBRARY_RESCAN_MS 1000
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int running;
+    volatile int quit;
+    int scanning;
+    const char* explicit_file;
+    MidiList* pending; // Свежий список, ещё не забранный главным потоком
+    ScanStats stats;
+    DirStampList stamps; // Каталоги последнего сканирования (меняются только потоком библиотеки)
+} library = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void* library_thread(void* arg) {
+    while (!library.quit) {
+        // Каталоги не менялись — список тот же, сканировать незачем
+        if (!dir_stamps_unchanged(&library.stamps)) {
+            MidiList* fresh = midi_list_init();
+            DirStampList stamps = {0};
+            update_midi_list(fresh, library.explicit_file, &stamps);
+
+            pthread_mutex_lock(&library.lock);
+            midi_list_free(library.pending);
+            library.pending = fresh;
+            library.stats = last_scan;
+            dir_stamps_clear(&library.stamps);
+            library.stamps = stamps;
+            pthread_mutex_unlock(&library.lock);
+        }
+
+        pthread_mutex_lock(&library.lock);
+        library.scanning = 0;
+        pthread_mutex_unlock(&library.lock);
+
+        for (int waited = 0; waited < LIBRARY_RESCAN_MS && !library.quit; waited += 50) { usleep(50000); }
+    }
+
+    return NULL;
+}
+
+// stamps — каталоги из снимка; если они не изменились, первое сканирование пропускается
+void library_start(const char* explicit_file, DirStampList* stamps) {
+    library.explicit_file = explicit_file;
+
+    if (stamps) {
+        library.stamps = *stamps;
+        memset(stamps, 0, sizeof(DirStampList));
+    }
+
+    library.scanning = 1;
+    library.running = pthread_create(&library.thread, NULL, library_thread, NULL) == 0;
+}
+
+void library_stop() {
+    if (library.running) {
+        library.quit = 1;
+        pthread_join(library.thread, NULL);
+        library.running = 0;
+    }
+
+    midi_list_free(library.pending);
+    library.pending = NULL;
+}
+
+// Снимок состояния для быстрого перезапуска: плейлист, шрифты, текущий трек и позиция.
+// Файл читается через mmap; строки хранятся в общем блоке, записи ссылаются на них смещениями.
+#define SNAPSHOT_FILE STATE_DIR "/snapshot.bin"
+#define SNAPSHOT_MAGIC "EMSNAP01"
+
+typedef struct {
+    char magic[8];
+    uint32_t font_count;
+    uint32_t dir_count;
+    uint32_t track_count;
+    uint32_t strings_size;
+    int32_t active_sf;
+    int32_t current_track;   // -1 — нет
+    uint32_t catalog_dir;    // Строка: каталог шрифтов
+    uint32_t reserved;
+    int64_t catalog_mtime_ns;
+    double position;         // Позиция текущего трека, секунды
+} SnapshotHeader;
+
+typedef struct {
+    uint32_t path;
+    uint32_t valid;
+    int64_t size;
+    int64_t mtime_ns;
+} SnapshotFont;
+
+typedef struct {
+    uint32_t path;
+    uint32_t reserved;
+    int64_t mtime_ns;
+} SnapshotDir;
+
+typedef struct {
+    void* map;
+    size_t map_size;
+    const SnapshotHeader* header;
+    const SnapshotFont* fonts;
+    const SnapshotDir* dirs;
+    const uint32_t* tracks;
+    const char* strings;
+} Snapshot;
+
+static const char* snapshot_string(const Snapshot* snap, uint32_t offset) { return snap->strings + offset; }
+
+void snapshot_close(Snapshot* snap) {
+    if (snap) {
+        munmap(snap->map, snap->map_size);
+        free(snap);
+    }
+}
+
+Snapshot* snapshot_load() {
+    int fd = open(SNAPSHOT_FILE, O_RDONLY);
+
+    if (fd < 0) { return NULL; }
+
+    struct stat st;
+    void* map = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SnapshotHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    close(fd);
+
+    if (map == MAP_FAILED) { return NULL; }
+
+    Snapshot* snap = malloc(sizeof(Snapshot));
+    snap->map = map;
+    snap->map_size = st.st_size;
+    snap->header = (const SnapshotHeader*)map;
+
+    const SnapshotHeader* h = snap->header;
+    uint64_t expected = sizeof(SnapshotHeader) + (uint64_t)h->font_count * sizeof(SnapshotFont) +
+                        (uint64_t)h->dir_count * sizeof(SnapshotDir) + (uint64_t)h->track_count * sizeof(uint32_t) + h->strings_size;
+
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, 8) != 0 || expected != (uint64_t)st.st_size || h->strings_size == 0) {
+        snapshot_close(snap);
+        return NULL;
+    }
+
+    snap->fonts = (const SnapshotFont*)(h + 1);
+    snap->dirs = (const SnapshotDir*)(snap->fonts + h->font_count);
+    snap->tracks = (const uint32_t*)(snap->dirs + h->dir_count);
+    snap->strings = (const char*)(snap->tracks + h->track_count);
+
+    // Все строки должны лежать внутри блока, который заканчивается нулём
+    int valid = snap->strings[h->strings_size - 1] == '\0' && h->catalog_dir < h->strings_size;
+
+    for (uint32_t i = 0; valid && i < h->font_count; i++) { valid = snap->fonts[i].path < h->strings_size; }
+
+    for (uint32_t i = 0; valid && i < h->dir_count; i++) { valid = snap->dirs[i].path < h->strings_size; }
+
+    for (uint32_t i = 0; valid && i < h->track_count; i++) { valid = snap->tracks[i] < h->strings_size; }
+
+    if (!valid) {
+        snapshot_close(snap);
+        return NULL;
+    }
+
+    return snap;
+}
+
+// Список шрифтов из снимка, если каталог шрифтов не менялся; иначе NULL
+SoundFontList* snapshot_soundfonts(const Snapshot* snap) {
+    const char* catalog_dir = snapshot_string(snap, snap->header->catalog_dir);
+    struct stat st;
+
+    if (stat(catalog_dir, &st) != 0 || stat_mtime_ns(&st) != snap->header->catalog_mtime_ns) { return NULL; }
+
+    // Без каталога bank/ шрифты берутся из текущего каталога, и наоборот
+    if (strcmp(catalog_dir, ".") == 0 && stat("bank", &st) == 0) { return NULL; }
+
+    SoundFontList* list = soundfont_list_alloc();
+    list->catalog_dir = strcmp(catalog_dir, ".") == 0 ? "." : "bank";
+
+    for (uint32_t i = 0; i < snap->header->font_count; i++) {
+        const char* path = snapshot_string(snap, snap->fonts[i].path);
+
+        // Правка .sf2 на месте не меняет время каталога, а упакованную копию делает устаревшей
+        if (ends_with_ci(path, ".sf2" SF2PACK_SUFFIX) && (stat(path, &st) != 0 || soundfont_shadowed(path, 1, &st))) {
+            soundfont_list_free(list);
+            return NULL;
+        }
+
+        if (!snap->fonts[i].valid) {
+            midi_list_push(list->failed, strdup(path));
+        }
+
+        else {
+            soundfont_list_add(list, strdup(path), snap->fonts[i].size, snap->fonts[i].mtime_ns);
+        }
+    }
+
+    if (list->count == 0) {
+        soundfont_list_free(list);
+        return NULL;
+    }
+
+    return list;
+}
+
+void snapshot_tracks(const Snapshot* snap, MidiList* list) {
+    for (uint32_t i = 0; i < snap->header->track_count; i++) {
+        midi_list_push(list, strdup(snapshot_string(snap, snap->tracks[i])));
+    }
+}
+
+void snapshot_dirs(const Snapshot* snap, DirStampList* stamps) {
+    for (uint32_t i = 0; i < snap->header->dir_count; i++) {
+        dir_stamps_add(stamps, snapshot_string(snap, snap->dirs[i].path), snap->dirs[i].mtime_ns);
+    }
+}
+
+typedef struct {
+    char* data;
+    uint32_t size;
+    uint32_t capacity;
+} StringBlock;
+
+static uint32_t string_block_add(StringBlock* block, const char* str) {
+    uint32_t len = strlen(str) + 1;
+
+    if (block->size + len > block->capacity) {
+        block->capacity = (block->size + len) * 2;
+        block->data = realloc(block->data, block->capacity);
+    }
+
+    memcpy(block->data + block->size, str, len);
+    block->size += len;
+    return block->size - len;
+}
+
+// Пишется во временный файл и атомарно переименовывается
+// midi_list и stamps могут быть NULL — тогда сохраняются только шрифты
+int snapshot_save(SoundFontList* sf_list, MidiList* midi_list, int current_index, double position, const DirStampList* stamps) {
+    mkdir(STATE_DIR, 0755);
+
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, 8);
+    StringBlock strings = {0};
+
+    int failed = sf_list->failed->count;
+    SnapshotFont* fonts = calloc(sf_list->count + failed + 1, sizeof(SnapshotFont));
+    int dir_count = stamps ? stamps->count : 0;
+    int track_count = midi_list ? midi_list->count : 0;
+    SnapshotDir* dirs = calloc(dir_count + 1, sizeof(SnapshotDir));
+    uint32_t* tracks = calloc(track_count + 1, sizeof(uint32_t));
+
+    pthread_mutex_lock(&sf_list->lock);
+
+    for (int i = 0; i < sf_list->count; i++) {
+        fonts[i].path = string_block_add(&strings, sf_list->files[i]);
+        fonts[i].valid = sf_list->status[i] != SF_FAILED;
+        fonts[i].size = sf_list->sizes[i];
+        fonts[i].mtime_ns = sf_list->mtimes[i];
+
+        // Активный шрифт — индекс среди пригодных, неудачные при загрузке пропускаются
+        if (i < sf_list->active_sf && fonts[i].valid) { h.active_sf++; }
+    }
+
+    for (int i = 0; i < failed; i++) {
+        fonts[sf_list->count + i].path = string_block_add(&strings, sf_list->failed->files[i]);
+    }
+
+    h.font_count = sf_list->count + failed;
+    pthread_mutex_unlock(&sf_list->lock);
+
+    struct stat st;
+    h.catalog_dir = string_block_add(&strings, sf_list->catalog_dir);
+    h.catalog_mtime_ns = stat(sf_list->catalog_dir, &st) == 0 ? stat_mtime_ns(&st) : 0;
+
+    for (int i = 0; i < dir_count; i++) {
+        dirs[i].path = string_block_add(&strings, stamps->items[i].path);
+        dirs[i].mtime_ns = stamps->items[i].mtime_ns;
+    }
+
+    h.dir_count = dir_count;
+
+    for (int i = 0; i < track_count; i++) { tracks[i] = string_block_add(&strings, midi_list->files[i]); }
+
+    h.track_count = track_count;
+    h.current_track = current_index < track_count ? current_index : -1;
+    h.position = position;
+    h.strings_size = strings.size;
+
+    int ok = 0;
+    FILE* f = fopen(SNAPSHOT_FILE ".tmp", "wb");
+
+    if (f) {
+        ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(fonts, sizeof(SnapshotFont), h.font_count, f) == h.font_count &&
+             fwrite(dirs, sizeof(SnapshotDir), h.dir_count, f) == h.dir_count &&
+             fwrite(tracks, sizeof(uint32_t), h.track_count, f) == h.track_count &&
+             fwrite(strings.data, 1, strings.size, f) == strings.size;
+        ok = (fclose(f) == 0) && ok && rename(SNAPSHOT_FILE ".tmp", SNAPSHOT_FILE) == 0;
+
+        if (!ok) { unlink(SNAPSHOT_FILE ".tmp"); }
+    }
+
+    free(fonts);
+    free(dirs);
+    free(tracks);
+    free(strings.data);
+    return ok;
+}
+
+int library_scanning() {
+    pthread_mutex_lock(&library.lock);
+    int scanning = library.scanning;
+    pthread_mutex_unlock(&library.lock);
+    return scanning;
+}
+
+// Подменяет список свежим результатом сканирования, сохраняя текущий трек. 1, если список обновлён
+int library_poll(MidiList* list, int* current_index, ScanStats* stats) {
+    pthread_mutex_lock(&library.lock);
+    MidiList* fresh = library.pending;
+    library.pending = NULL;
+    *stats = library.stats;
+    pthread_mutex_unlock(&library.lock);
+
+    if (!fresh) { return 0; }
+
+    char* current = (*current_index < list->count) ? strdup(list->files[*current_index]) : NULL;
+
+    for (int i = 0; i < list->count; i++) { free(list->files[i]); }
+
+    free(list->files);
+    list->files = fresh->files;
+    list->count = fresh->count;
+    list->capacity = fresh->capacity;
+    free(fresh);
+
+    if (current) {
+        char** found = bsearch(&current, list->files, list->count, sizeof(char*), compare_strings);
+
+        if (found) { *current_index = found - list->files; }
+
+        free(current);
+    }
+
+    if (*current_index >= list->count) { *current_index = 0; }
+
+    return 1;
+}
+
+struct termios old_tio, new_tio;
+void init_terminal() {
+    tcgetattr(STDIN_FILENO, &old_tio);
+    new_tio = old_tio;
+    new_tio.c_lflag &= (~ICANON & ~ECHO);
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
+}
+
+void reset_terminal() { tcsetattr(STDIN_FILENO, TCSANOW, &old_tio); }
+
+int get_key() {
+    char c;
+
+    if (read(STDIN_FILENO, &c, 1) != 1) { return -1; }
+
+    if (c == 27) { // Escape-последовательности
+        char seq[3];
+
+        if (read(STDIN_FILENO, &seq, 2) == 2 && seq[0] == '[') {
+            if (seq[1] == 'C') { return 1; } // Вправо
+
+            if (seq[1] == 'D') { return 2; } // Влево
+        }
+
+        return -1;
+    }
+
+    if (c >= '0' && c <= '9') { return 20 + (c - '0'); }
+
+    switch (tolower(c)) {
+        case 'p':
+            return 3;  // Pause
+
+        case 'q':
+            return 4;  // Quit
+
+        case 'r':
+            return 5;  // Reverb
+
+        case 'c':
+            return 6;  // Chorus
+
+        case 's':
+            return 7;  // Stereo
+
+        case 'v':
+            return 8;  // Vibrato
+
+        case 't':
+            return 9;  // Tremolo
+
+        case 'e':
+            return 10; // Echo
+
+        case '-':
+            return 12; // Decrease rate
+
+        case '=':
+        case '+':
+            return 13; // Increase rate
+
+        case 'd':
+            return 14; // 3D Depth
+
+        case ']':
+            return 15; // Increase depth
+
+        case '[':
+            return 16; // Decrease depth
+
+        case 'k':
+            return 17; // Keyboard
+
+        case 'i':
+            return 18; // Channel Info
+
+        case ',':
+            return 30; // Previous SoundFont
+
+        case '.':
+            return 31; // Next SoundFont
+
+        case '<':
+            return 32; // Slower
+
+        case '>':
+            return 33; // Faster
+
+        case '{':
+            return 34; // Pitch down
+
+        case '}':
+            return 35; // Pitch up
+
+        default:
+            return -1;
+    }
+}
+
+// MIDI-поток под темп-потоком или сам поток, если темп не используется
+HSTREAM stream_source(HSTREAM stream) {
+    HSTREAM source = BASS_FX_TempoGetSource(stream);
+    return source ? source : stream;
+}
+
+// Вывод идёт через микшер bassmix: он играет всё время работы, треки — его декодирующие источники,
+// эффекты стоят на нём самом. Смена трека не перезапускает вывод, хвосты эффектов переходят в следующий трек
+#define MIX_FADING 4
+#define MIX_QUEUE_MS 1500 // За сколько до конца трека следующий встаёт в очередь стыка
+#define MIX_SWAP_MS 300   // Нахлёст при подмене префикса прогрессивного трека полным потоком
+
+static struct {
+    HSTREAM mixer;
+    int crossfade_ms;          // --crossfade: следующий трек входит внахлёст; 0 — стык в стык
+    int fade_in;               // Нарастание громкости для следующего добавленного трека, мс
+    HSTREAM next;              // Трек, который микшер подключит сам в конце текущего
+    HSTREAM fading[MIX_FADING]; // Снятые треки, которые ещё затухают
+    unsigned long joins, crossfades;
+} mix;
+
+// Слитная цепочка эффектов (--fused-fx): вместо шести BASS FX один DSP-обработчик из echofx.h
+// считает все эффекты за один проход по блоку. Параметры DX8 переводятся в параметры движка
+static int fused_fx = 0;
+static EchoFx echofx;
+
+void fused_fx_config(EchoFx* fx) {
+    fx->gain = 1.0f; // Громкость и панорама остаются атрибутами потока
+
+    fx->echo_enabled = echo_enabled;
+    fx->echo_ms = echoParams.fLeftDelay;
+    fx->echo_wet = echoParams.fWetDryMix / 100.0f;
+    fx->echo_feedback = echoParams.fFeedback / 100.0f;
+
+    // Обратная связь подбирается так, чтобы хвост затухал на 60 дБ за fReverbTime (средний отвод ~84 мс)
+    static const float reverb_tap[ECHOFX_REVERB_TAPS] = { 0.3f, 0.25f, 0.2f, 0.15f, 0.1f };
+    fx->reverb_enabled = reverb_enabled;
+
+    for (int k = 0; k < ECHOFX_REVERB_TAPS; k++) {
+        fx->reverb_tap[k] = reverb_tap[k] * (k >= 3 ? 0.5f + 0.5f * reverbParams.fHighFreqRTRatio : 1.0f);
+    }
+
+    fx->reverb_feedback = powf(10.0f, -3.0f * 84.0f / reverbParams.fReverbTime);
+    fx->reverb_wet = 0.3f * powf(10.0f, (reverbParams.fInGain + reverbParams.fReverbMix) / 20.0f);
+
+    fx->chorus_enabled = chorus_enabled;
+    fx->chorus_ms[0] = chorusParams.fDelay;
+    fx->chorus_ms[1] = chorusParams.fDelay * 1.5f;
+    fx->chorus_ms[2] = chorusParams.fDelay * 2.0f;
+    fx->chorus_wet = chorusParams.fWetDryMix / 100.0f * 0.5f;
+    fx->chorus_depth = chorusParams.fDepth / 100.0f;
+    fx->chorus_speed = chorusParams.fFrequency;
+
+    fx->flanger_enabled = vibrato_enabled;
+    fx->flanger_ms = vibratoParams.fDelay;
+    fx->flanger_depth = vibratoParams.fDepth / 100.0f;
+    fx->flanger_wet = vibratoParams.fWetDryMix / 100.0f;
+    fx->flanger_feedback = vibratoParams.fFeedback / 100.0f;
+    fx->flanger_speed = vibratoParams.fFrequency;
+
+    fx->eq_enabled = tremolo_enabled;
+    fx->eq_center = tremoloParams.fCenter;
+    fx->eq_bandwidth = tremoloParams.fBandwidth;
+    fx->eq_gain_db = tremoloParams.fGain;
+
+    fx->rotate_enabled = stereo_pan_enabled;
+    fx->rotate_speed = rotateParams.fRate;
+}
+
+void CALLBACK FusedFxProc(HDSP handle, DWORD channel, void* buffer, DWORD length, void* user) {
+    echofx_process_f32((EchoFx*)user, (float*)buffer, length / (2 * sizeof(float)));
+}
+
+// Граф эффектов: описание каждого FX и его живое состояние на текущем потоке.
+// fx_graph_apply сравнивает желаемое состояние с живым и трогает только то,
+// что изменилось: включённые ставятся, выключенные снимаются, а для тех, у кого
+// поменялись лишь параметры, вызывается BASS_FXSetParameters
+typedef struct {
+    const char* name;
+    char key;                    // Клавиша переключения, она же буква в --chan-fx
+    DWORD type;
+    int priority;
+    int* enabled;
+    const void* params;
+    size_t params_size;
+} FxNode;
+
+typedef struct {
+    HFX handle;
+    unsigned char applied[64];   // Параметры, с которыми FX сейчас работает
+} FxLive;
+
+typedef struct {
+    HSTREAM stream;              // Поток, к которому привязаны handle (микшер)
+    HSTREAM track;               // Трек, которому принадлежат потоки каналов
+    FxNode nodes[6];
+    FxLive live[6];
+    HDSP dsp;                    // Слитная цепочка вместо nodes при --fused-fx
+    // Эффекты отдельных MIDI-каналов (--chan-fx): у канала свой поток от BASS_MIDI_StreamGetChannel,
+    // каналы без эффектов его не получают и идут в общий микс без обработки
+    unsigned chan_mask[16];      // Биты nodes для каждого канала
+    HSTREAM chan_stream[16];
+    FxLive chan_live[16][6];
+    unsigned shed;               // Эффекты, временно снятые регулятором нагрузки
+    float pan, vol;              // Последние выставленные атрибуты
+    unsigned long added, removed, updated;
+} FxGraph;
+
+static FxGraph fx_graph = {
+    .nodes = {
+        { "reverb",  'r', BASS_FX_DX8_REVERB,  0, &reverb_enabled,     &reverbParams,  sizeof(reverbParams) },
+        { "chorus",  'c', BASS_FX_DX8_CHORUS,  1, &chorus_enabled,     &chorusParams,  sizeof(chorusParams) },
+        { "echo",    'e', BASS_FX_DX8_ECHO,    2, &echo_enabled,       &echoParams,    sizeof(echoParams) },
+        { "rotate",  's', BASS_FX_BFX_ROTATE,  3, &stereo_pan_enabled, &rotateParams,  sizeof(rotateParams) },
+        { "vibrato", 'v', BASS_FX_DX8_FLANGER, 4, &vibrato_enabled,    &vibratoParams, sizeof(vibratoParams) },
+        { "tremolo", 't', BASS_FX_DX8_PARAMEQ, 5, &tremolo_enabled,    &tremoloParams, sizeof(tremoloParams) },
+    }
+};
+
+// Разбор --chan-fx: группы "каналы:буквы" через запятую, каналы 0-15 (например "0-8:rc,9:,10-15:r")
+int fx_graph_parse_channels(const char* spec) {
+    const char* p = spec;
+
+    while (*p) {
+        char* end;
+        long from = strtol(p, &end, 10);
+        long to = from;
+
+        if (end == p) { return 0; }
+
+        if (*end == '-') {
+            p = end + 1;
+            to = strtol(p, &end, 10);
+
+            if (end == p) { return 0; }
+        }
+
+        if (*end != ':' || from < 0 || to > 15 || from > to) { return 0; }
+
+        unsigned mask = 0;
+
+        for (p = end + 1; *p && *p != ','; p++) {
+            int found = 0;
+
+            for (int i = 0; i < 6; i++) {
+                if (fx_graph.nodes[i].key == tolower((unsigned char)*p)) {
+                    mask |= 1u << i;
+                    found = 1;
+                }
+            }
+
+            if (!found) { return 0; }
+        }
+
+        for (long ch = from; ch <= to; ch++) { fx_graph.chan_mask[ch] = mask; }
+
+        if (*p == ',') { p++; }
+    }
+
+    return 1;
+}
+
+// Снятый трек уносит свои потоки каналов: их FX затухают вместе с ним, а граф ждёт следующего трека
+void fx_graph_release(HSTREAM stream) {
+    if (!stream || stream != fx_graph.track) { return; }
+
+    fx_graph.track = 0;
+    memset(fx_graph.chan_stream, 0, sizeof(fx_graph.chan_stream));
+    memset(fx_graph.chan_live, 0, sizeof(fx_graph.chan_live));
+}
+
+// Приводит один FX на канале к желаемому состоянию
+void fx_node_sync(DWORD channel, const FxNode* node, FxLive* live, int wanted) {
+    if (!wanted) {
+        if (live->handle) {
+            BASS_ChannelRemoveFX(channel, live->handle);
+            live->handle = 0;
+            fx_graph.removed++;
+        }
+
+        return;
+    }
+
+    if (!live->handle) {
+        live->handle = BASS_ChannelSetFX(channel, node->type, node->priority);
+
+        if (!live->handle) {
+            printf("Failed to set %s: %d\n", node->name, BASS_ErrorGetCode());
+            return;
+        }
+
+        BASS_FXSetParameters(live->handle, node->params);
+        memcpy(live->applied, node->params, node->params_size);
+        fx_graph.added++;
+    }
+
+    else if (memcmp(live->applied, node->params, node->params_size) != 0) {
+        if (BASS_FXSetParameters(live->handle, node->params)) {
+            memcpy(live->applied, node->params, node->params_size);
+            fx_graph.updated++;
+        }
+    }
+}
+
+// Общие эффекты стоят на микшере и ставятся один раз за работу; stream — трек, которому переходят потоки каналов
+// --chan-fx (0 — остаётся прежний). Трек из очереди стыка получает их заранее, до того как микшер его подключит
+void fx_graph_apply(HSTREAM stream) {
+    HSTREAM output = mix.mixer;
+
+    if (!output) { return; }
+
+    // Новый поток приходит без эффектов, старые handle к нему не относятся
+    if (output != fx_graph.stream) {
+        fx_graph.stream = output;
+        fx_graph.pan = NAN;
+        fx_graph.vol = NAN;
+        fx_graph.dsp = 0;
+        memset(fx_graph.live, 0, sizeof(fx_graph.live));
+    }
+
+    if (stream && stream != fx_graph.track) {
+        fx_graph.track = stream;
+        memset(fx_graph.chan_stream, 0, sizeof(fx_graph.chan_stream));
+        memset(fx_graph.chan_live, 0, sizeof(fx_graph.chan_live));
+    }
+
+    if (fused_fx) {
+        if (!fx_graph.dsp) {
+            fx_graph.dsp = BASS_ChannelSetDSP(output, FusedFxProc, &echofx, 0);
+            fx_graph.added++;
+        }
+
+        // Параметры меняются между блоками, а не посреди обработки
+        BASS_ChannelLock(output, TRUE);
+        fused_fx_config(&echofx);
+        BASS_ChannelLock(output, FALSE);
+        fx_graph.updated++;
+    }
+
+    for (int i = 0; i < 6 && !fused_fx; i++) {
+        fx_node_sync(output, &fx_graph.nodes[i], &fx_graph.live[i], *fx_graph.nodes[i].enabled && !(fx_graph.shed >> i & 1));
+    }
+
+    for (int ch = 0; ch < 16; ch++) {
+        if (!fx_graph.chan_mask[ch] || !fx_graph.track) { continue; }
+
+        if (!fx_graph.chan_stream[ch]) {
+            fx_graph.chan_stream[ch] = BASS_MIDI_StreamGetChannel(stream_source(fx_graph.track), ch);
+
+            if (!fx_graph.chan_stream[ch]) {
+                printf("Failed to get MIDI channel %d: %d\n", ch, BASS_ErrorGetCode());
+                fx_graph.chan_mask[ch] = 0;
+                continue;
+            }
+        }
+
+        for (int i = 0; i < 6; i++) {
+            fx_node_sync(fx_graph.chan_stream[ch], &fx_graph.nodes[i], &fx_graph.chan_live[ch][i],
+                         (fx_graph.chan_mask[ch] & ~fx_graph.shed) >> i & 1);
+        }
+    }
+
+    float pan = 0.0f;
+    float vol = global_volume;
+
+    if (!stereo_pan_enabled && fabsf(depth_3d) > 0.1f) {
+        current_depth = current_depth * 0.9f + depth_3d * 0.1f;
+        pan = current_depth * 0.1f;
+        vol = 1.0f - fabsf(current_depth) * 0.02f;
+
+        if (vol < 0.1f) { vol = 0.1f; }
+
+        vol *= global_volume;
+    }
+
+    if (pan != fx_graph.pan) {
+        BASS_ChannelSetAttribute(output, BASS_ATTRIB_PAN, pan);
+        fx_graph.pan = pan;
+    }
+
+    if (vol != fx_graph.vol) {
+        BASS_ChannelSetAttribute(output, BASS_ATTRIB_VOL, vol);
+        fx_graph.vol = vol;
+    }
+}
+
+void draw_spectrum(HSTREAM stream) {
+    float fft[128];
+    char buffer[1024] = {0};
+    char *ptr = buffer;
+
+    if (BASS_ChannelGetData(stream, fft, BASS_DATA_FFT256) != -1) {
+        ptr += snprintf(ptr, buffer + sizeof(buffer) - ptr, " Bass: ");
+
+        for (int i = 0; i < 4; i++) {
+            int h = (int)(fft[i] * 200);
+            ptr += snprintf(ptr, buffer + sizeof(buffer) - ptr,
+                            "%s", h > 3 ? "▓▓▓" : h > 1 ? "▓▓ " : h > 0 ? "▓  " : "   ");
+        }
+
+        ptr += snprintf(ptr, buffer + sizeof(buffer) - ptr, " Mid: ");
+
+        for (int i = 4; i < 8; i++) {
+            int h = (int)(fft[i] * 300);
+            ptr += snprintf(ptr, buffer + sizeof(buffer) - ptr,
+                            "%s", h > 3 ? "▒▒▒" : h > 1 ? "▒▒ " : h > 0 ? "▒  " : "   ");
+        }
+
+        ptr += snprintf(ptr, buffer + sizeof(buffer) - ptr, " Treble: ");
+
+        for (int i = 8; i < 12; i++) {
+            int h = (int)(fft[i] * 400);
+            ptr += snprintf(ptr, buffer + sizeof(buffer) - ptr,
+                            "%s", h > 3 ? "░░░" : h > 1 ? "░░ " : h > 0 ? "░  " : "   ");
+        }
+
+        printf("%s", buffer);
+        fflush(stdout);
+    }
+}
+
+void CALLBACK MidiNoteProc(HSYNC handle, DWORD channel, DWORD data, void* user) {
+    SoundFontList* sf_list = (SoundFontList*)user;
+
+    // Затухающий при смене трека поток клавиатуру уже не трогает
+    if (channel != sf_list->current_stream) { return; }
+
+    uint8_t note = data & 0x7F;
+    uint8_t velocity = (data >> 8) & 0x7F;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint32_t current_time = (uint32_t)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+
+    if (velocity > 0) {
+        note_states[note] = velocity;
+        note_start_times[note] = current_time;
+    }
+
+    else {
+        note_states[note] = 0;
+    }
+}
+
+void draw_midi_keyboard() {
+    if (!keyboard_visible) { return; }
+
+    const int start_note = 60; // C4
+    const int end_note = 95;   // B6
+    const char* note_names[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint32_t current_time = (uint32_t)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+
+    printf("┌─────────────────────[ Live MIDI Keyboard ]─────────────────────┐\n");
+    printf("  ");
+
+    for (int note = start_note; note <= end_note; note++) {
+        int key = note % 12;
+
+        if (key == 0 || key == 2 || key == 4 || key == 5 || key == 7 || key == 9 || key == 11) {
+            printf("%-3s", note_names[key]);
+        }
+    }
+
+    printf("\n");
+    printf(" ");
+
+    for (int note = start_note; note <= end_note; note++) {
+        int key = note % 12;
+
+        if (key == 0 || key == 2 || key == 4 || key == 5 || key == 7 || key == 9 || key == 11) {
+            printf("(%d)", (note / 12) - 1);
+        }
+    }
+
+    printf("\n");
+    printf(" ");
+
+    for (int note = start_note; note <= end_note; note++) {
+        int key = note % 12;
+
+        if (key == 0 || key == 2 || key == 4 || key == 5 || key == 7 || key == 9 || key == 11) {
+            if (note_states[note] > 0) {
+                printf(note_states[note] > 90 ? "┌█┐" : note_states[note] > 60 ? "┌▓┐" : "┌░┐");
+            }
+
+            else {
+                uint32_t elapsed = current_time - note_start_times[note];
+                printf(elapsed < 300 ? "┌▓┐" : elapsed < 600 ? "┌░┐" : "┌─┐");
+            }
+        }
+    }
+
+    printf("\n");
+    printf("   ");
+
+    for (int note = start_note; note <= end_note; note++) {
+        int key = note % 12;
+
+        if (key == 1 || key == 3) { printf("%-3s", note_names[key]); }
+
+        else if (key == 6 || key == 8 || key == 10) { printf("%-3s", note_names[key]); }
+
+        else if (key == 0 || key == 5) { printf("   "); }
+    }
+
+    printf("\n");
+    printf("   ");
+
+    for (int note = start_note; note <= end_note; note++) {
+        int key = note % 12;
+
+        if (key == 1 || key == 3 || key == 6 || key == 8 || key == 10) {
+            if (note_states[note] > 0) {
+                printf(note_states[note] > 90 ? " █ " : note_states[note] > 60 ? " ▓ " : " ░ ");
+            }
+
+            else {
+                uint32_t elapsed = current_time - note_start_times[note];
+                printf(elapsed < 300 ? " ▓ " : elapsed < 600 ? " ░ " : "   ");
+            }
+        }
+
+        else if (key == 0 || key == 5) { printf("   "); }
+    }
+
+    printf("\n");
+    printf(" Active Notes: \n");
+    int active_count = 0;
+
+    for (int note = start_note; note <= end_note; note++) {
+        if (note_states[note] > 0) {
+            printf(" [%s%d]", note_names[note % 12], (note / 12) - 1);
+            active_count++;
+        }
+    }
+
+    if (active_count == 0) { printf(" None"); }
+
+    printf("\n");
+    printf("└────────────────────────────────────────────────────────────────┘\n");
+}
+
+void draw_channel_info(SoundFontList* sf_list) {
+    if (!channel_info_visible) { return; }
+
+    const int max_line_width = 61;
+    const int fixed_width = 10;
+    printf("┌─────────────────────[ Channel Presets ]────────────────────────┐\n");
+
+    // Показываем активный SoundFont
+    const char* sf_name = strrchr(sf_list->files[sf_list->active_sf], '/') ?
+                          strrchr(sf_list->files[sf_list->active_sf], '/') + 1 :
+                          sf_list->files[sf_list->active_sf];
+    char short_sf[48];
+    const char* clean_sf = sf_name;
+
+    if (strncmp(sf_name, "_SF2__", 6) == 0) { clean_sf = sf_name + 6; }
+
+    else if (strncmp(sf_name, "SF2_", 4) == 0) { clean_sf = sf_name + 4; }
+
+    strncpy(short_sf, clean_sf, sizeof(short_sf)-1);
+    short_sf[sizeof(short_sf)-1] = '\0';
+    char* ext = strrchr(short_sf, '.');
+
+    if (ext && (strcasecmp(ext, ".sf2") == 0 || strcasecmp(ext, ".sf2" SF2PACK_SUFFIX) == 0)) { *ext = '\0'; }
+
+    int max_sf_header_len = max_line_width - 12;
+
+ //   if (strlen(short_sf) > max_sf_header_len - 3) {
+    if (strlen(short_sf) > max_sf_header_len - 3 && max_sf_header_len >= 3 && max_sf_header_len <= 48) {
+    short_sf[max_sf_header_len - 3] = '.';
+    short_sf[max_sf_header_len - 2] = '.';
+    short_sf[max_sf_header_len - 1] = '.';
+    short_sf[max_sf_header_len] = '\0';
+    }
+
+    printf("  SoundFont: %s\n", short_sf);
+    printf("├────────────────────────────────────────────────────────────────┤\n");
+
+    int active_channels = 0;
+
+    for (int i = 0; i < 16; i++) {
+        if (channel_presets[i].preset >= 0 && channel_presets[i].sf_index != sf_list->active_sf && channel_presets[i].sf_index >= 0) {
+            const char* inst_name = (channel_presets[i].preset < 128) ?
+                                    midi_instrument_names[channel_presets[i].preset] : "Unknown";
+            char display_inst[48];
+            strncpy(display_inst, inst_name, sizeof(display_inst)-1);
+            display_inst[sizeof(display_inst)-1] = '\0';
+            char channel_sf[48];
+            const char* alt_sf = strrchr(sf_list->files[channel_presets[i].sf_index], '/') ?
+                                 strrchr(sf_list->files[channel_presets[i].sf_index], '/') + 1 :
+                                 sf_list->files[channel_presets[i].sf_index];
+            const char* clean_alt_sf = alt_sf;
+
+            if (strncmp(alt_sf, "_SF2__", 6) == 0) { clean_alt_sf = alt_sf + 6; }
+
+            else if (strncmp(alt_sf, "SF2_", 4) == 0) { clean_alt_sf = alt_sf + 4; }
+
+            strncpy(channel_sf, clean_alt_sf, sizeof(channel_sf)-1);
+            channel_sf[sizeof(channel_sf)-1] = '\0';
+            char* ext = strrchr(channel_sf, '.');
+
+            if (ext && (strcasecmp(ext, ".sf2") == 0 || strcasecmp(ext, ".sf2" SF2PACK_SUFFIX) == 0)) { *ext = '\0'; }
+
+            int inst_len = strlen(display_inst);
+            int max_sf_len = max_line_width - fixed_width - inst_len;
+
+            if (max_sf_len < 0) { max_sf_len = 0; }
+
+            if (strlen(channel_sf) > max_sf_len - 3 && max_sf_len >= 3) {
+                channel_sf[max_sf_len - 3] = '.';
+                channel_sf[max_sf_len - 2] = '.';
+                channel_sf[max_sf_len - 1] = '.';
+                channel_sf[max_sf_len] = '\0';
+            }
+
+            char format[32];
+            snprintf(format, sizeof(format), "  %%2d: %%-%ds %%s\n", max_sf_len);
+            printf(format, i, channel_sf, display_inst);
+            active_channels++;
+        }
+    }
+
+    if (active_channels == 0) {
+        printf("  No channels with borrowed instruments\n");
+    }
+
+    printf("└────────────────────────────────────────────────────────────────┘\n");
+}
+
+// Прямой опрос шрифтов через BASS_MIDI_FontGetPreset; оставлен для сравнения в --bench-presets
+static void resolve_channel_preset_probe(SoundFontList* sf_list, int chan, int preset, int bank) {
+    // Сбрасываем пресет канала
+    channel_presets[chan].preset = preset;
+    channel_presets[chan].bank = bank;
+    channel_presets[chan].sf_index = -1;
+
+    // Проверяем активный SoundFont
+    if (sf_list->fonts[sf_list->active_sf].font &&
+            BASS_MIDI_FontGetPreset(sf_list->fonts[sf_list->active_sf].font, preset, bank)) {
+        channel_presets[chan].sf_index = sf_list->active_sf;
+        return;
+    }
+
+    // Проверяем другие банки в активном SoundFont'е
+    if (sf_list->fonts[sf_list->active_sf].font) {
+        for (int b = 0; b <= 127; b++) {
+            if (BASS_MIDI_FontGetPreset(sf_list->fonts[sf_list->active_sf].font, preset, b)) {
+                channel_presets[chan].sf_index = sf_list->active_sf;
+                channel_presets[chan].bank = b;
+                return;
+            }
+        }
+    }
+
+    // Ищем в других SoundFont'ах
+    for (int i = 0; i < sf_list->count; i++) {
+        if (i == sf_list->active_sf) { continue; }
+
+        if (sf_list->fonts[i].font &&
+                BASS_MIDI_FontGetPreset(sf_list->fonts[i].font, preset, bank)) {
+            channel_presets[chan].sf_index = i;
+            return;
+        }
+    }
+
+    // Если пресет не найден, ищем в той же категории
+    int category = get_category(preset);
+
+    if (category >= 0) {
+        int min_preset = midi_categories[category].min_preset;
+        int max_preset = midi_categories[category].max_preset;
+
+        // Сначала активный SoundFont
+        if (sf_list->fonts[sf_list->active_sf].font) {
+            for (int p = min_preset; p <= max_preset; p++) {
+                for (int b = 0; b <= 127; b++) {
+                    if (BASS_MIDI_FontGetPreset(sf_list->fonts[sf_list->active_sf].font, p, b)) {
+                        channel_presets[chan].sf_index = sf_list->active_sf;
+                        channel_presets[chan].preset = p;
+                        channel_presets[chan].bank = b;
+                        return;
+                    }
+                }
+            }
+        }
+
+        // Затем другие SoundFont'ы
+        for (int i = 0; i < sf_list->count; i++) {
+            if (i == sf_list->active_sf) { continue; }
+
+            for (int p = min_preset; p <= max_preset; p++) {
+                for (int b = 0; b <= 127; b++) {
+                    if (sf_list->fonts[i].font &&
+                            BASS_MIDI_FontGetPreset(sf_list->fonts[i].font, p, b)) {
+                        channel_presets[chan].sf_index = i;
+                        channel_presets[chan].preset = p;
+                        channel_presets[chan].bank = b;
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    // Если ничего не найдено, устанавливаем пресет по умолчанию только для неударных каналов
+    if (chan != 9) { // Канал 10 (9 в 0-индексации) — ударные
+        channel_presets[chan].preset = 0; // Grand Piano
+        channel_presets[chan].bank = 0;
+        channel_presets[chan].sf_index = sf_list->active_sf;
+    }
+
+    else {
+        // Для ударных оставляем пресет как есть или используем активный SoundFont
+        channel_presets[chan].sf_index = sf_list->active_sf;
+    }
+}
+
+// Выбор шрифта для программы канала — одно обращение к таблице (вызывается под sf_list->lock)
+static void resolve_channel_preset(SoundFontList* sf_list, int chan, int preset, int bank) {
+    const PresetChoice* choice = sf_list->table ? &sf_list->table->entries[bank & 0x7F][preset & 0x7F] : NULL;
+
+    if (choice && choice->sf_index >= 0) {
+        channel_presets[chan].preset = choice->preset;
+        channel_presets[chan].bank = choice->bank;
+        channel_presets[chan].sf_index = choice->sf_index;
+        sf_list->last_used[choice->sf_index] = ++sf_list->use_clock; // Шрифт, из которого заимствуют, остаётся открытым
+
+        if (sf_list->status[choice->sf_index] == SF_CLOSED) { sf_list->wanted_font = choice->sf_index; }
+    }
+
+    // Если ничего не найдено, пресет по умолчанию только для неударных каналов
+    else if (chan != 9) {
+        channel_presets[chan].preset = 0; // Grand Piano
+        channel_presets[chan].bank = 0;
+        channel_presets[chan].sf_index = sf_list->active_sf;
+    }
+
+    else {
+        channel_presets[chan].preset = preset;
+        channel_presets[chan].bank = bank;
+        channel_presets[chan].sf_index = sf_list->active_sf;
+    }
+}
+
+void CALLBACK MidiEventProc(HSYNC handle, DWORD channel, DWORD data, void* user) {
+    SoundFontList* sf_list = (SoundFontList*)user;
+
+    if (!sf_list || !sf_list->current_stream) { return; }
+
+    pthread_mutex_lock(&sf_list->lock);
+    resolve_channel_preset(sf_list, channel & 0x0F, data & 0xFF, (data >> 16) & 0x7F);
+    pthread_mutex_unlock(&sf_list->lock);
+}
+
+// Микробенчмарк смены программы: прямой опрос шрифтов против таблицы выбора
+void bench_preset_resolution(SoundFontList* sf_list) {
+    enum { EVENTS = 4096, TABLE_ROUNDS = 1000 };
+    static int events[EVENTS][3];
+    static int expected[EVENTS][3];
+    unsigned seed = 12345;
+
+    for (int i = 0; i < EVENTS; i++) {
+        seed = seed * 1103515245 + 12345;
+        events[i][0] = (seed >> 4) & 15;                           // Канал
+        events[i][1] = (seed >> 8) & 127;                          // Пресет
+        events[i][2] = (seed >> 24) & 3 ? 0 : (seed >> 16) & 127; // Банк, чаще всего 0
+    }
+
+    double start = now_ms();
+
+    for (int i = 0; i < EVENTS; i++) {
+        resolve_channel_preset_probe(sf_list, events[i][0], events[i][1], events[i][2]);
+        expected[i][0] = channel_presets[events[i][0]].sf_index;
+        expected[i][1] = channel_presets[events[i][0]].preset;
+        expected[i][2] = channel_presets[events[i][0]].bank;
+    }
+
+    double probe_ms = now_ms() - start;
+
+    start = now_ms();
+    preset_table_rebuild(sf_list);
+    double rebuild_ms = now_ms() - start;
+
+    int mismatches = 0;
+
+    for (int i = 0; i < EVENTS; i++) {
+        resolve_channel_preset(sf_list, events[i][0], events[i][1], events[i][2]);
+
+        if (channel_presets[events[i][0]].sf_index != expected[i][0] || channel_presets[events[i][0]].preset != expected[i][1] ||
+                channel_presets[events[i][0]].bank != expected[i][2]) {
+            mismatches++;
+        }
+    }
+
+    start = now_ms();
+
+    for (int r = 0; r < TABLE_ROUNDS; r++) {
+        for (int i = 0; i < EVENTS; i++) { resolve_channel_preset(sf_list, events[i][0], events[i][1], events[i][2]); }
+    }
+
+    double table_ms = now_ms() - start;
+    double probe_ns = probe_ms * 1e6 / EVENTS;
+    double table_ns = table_ms * 1e6 / ((double)EVENTS * TABLE_ROUNDS);
+
+    printf("Program change resolution, %d SoundFont(s), %d events:\n", sf_list->count, EVENTS);
+    printf("  FontGetPreset probe: %10.1f ns/event\n", probe_ns);
+    printf("  Resolve table:       %10.1f ns/event (%.0fx faster)\n", table_ns, table_ns > 0 ? probe_ns / table_ns : 0.0);
+    printf("  Table rebuild:       %10.3f ms\n", rebuild_ms);
+    printf("  Mismatches:          %10d\n", mismatches);
+}
+
+static DWORD CALLBACK BenchNoiseProc(HSTREAM handle, void* buffer, DWORD length, void* user) {
+    unsigned* seed = (unsigned*)user;
+    float* out = (float*)buffer;
+
+    for (DWORD i = 0; i < length / sizeof(float); i++) {
+        *seed = *seed * 1103515245 + 12345;
+        out[i] = ((int)((*seed >> 8) & 0xffff) - 32768) / 131072.0f;
+    }
+
+    return length;
+}
+
+// Рендер BENCH_FX_SECONDS шума через декодирующий поток: 0 — без эффектов, 1 — стек BASS FX, 2 — слитный DSP
+double bench_fx_render(int mode, EchoFx* fx) {
+    enum { BENCH_FX_SECONDS = 30, BLOCK_FRAMES = 1024 };
+    static float block[BLOCK_FRAMES * 2];
+    unsigned seed = 12345;
+    HSTREAM stream = BASS_StreamCreate(SAMPLE_RATE, 2, BASS_SAMPLE_FLOAT | BASS_STREAM_DECODE, BenchNoiseProc, &seed);
+
+    if (!stream) {
+        printf("Failed to create benchmark stream: %d\n", BASS_ErrorGetCode());
+        return -1.0;
+    }
+
+    if (mode == 1) {
+        for (int i = 0; i < 6; i++) {
+            FxNode* node = &fx_graph.nodes[i];
+            HFX handle = BASS_ChannelSetFX(stream, node->type, node->priority);
+
+            if (!handle) { printf("  Failed to set %s: %d\n", node->name, BASS_ErrorGetCode()); }
+
+            else { BASS_FXSetParameters(handle, node->params); }
+        }
+    }
+
+    else if (mode == 2) {
+        BASS_ChannelSetDSP(stream, FusedFxProc, fx, 0);
+    }
+
+    double start = now_ms();
+
+    for (long done = 0; done < (long)BENCH_FX_SECONDS * SAMPLE_RATE; done += BLOCK_FRAMES) {
+        BASS_ChannelGetData(stream, block, sizeof(block));
+    }
+
+    double elapsed = now_ms() - start;
+    BASS_StreamFree(stream);
+    return elapsed / BENCH_FX_SECONDS; // мс на секунду звука
+}
+
+// Сравнение стека BASS FX и слитной цепочки при одинаковых настройках, все шесть эффектов включены
+void bench_fx(void) {
+    EchoFx fx;
+    echofx_init(&fx, SAMPLE_RATE);
+    fused_fx_config(&fx);
+    fx.echo_enabled = fx.reverb_enabled = fx.chorus_enabled = 1;
+    fx.flanger_enabled = fx.eq_enabled = fx.rotate_enabled = 1;
+
+    if (!echofx_setup(&fx)) {
+        printf("Out of memory\n");
+        return;
+    }
+
+    double base = bench_fx_render(0, NULL);
+    double stack = bench_fx_render(1, NULL);
+    double fused = bench_fx_render(2, &fx);
+    echofx_free(&fx);
+
+    if (base < 0 || stack < 0 || fused < 0) { return; }
+
+    printf("Effect chain cost, stereo float at %d Hz, 6 effects on (ms per second of audio):\n", SAMPLE_RATE);
+    printf("  Source only:     %8.3f ms\n", base);
+    printf("  BASS FX stack:   %8.3f ms (effects %.3f ms, %.2f%% of one core)\n", stack, stack - base, (stack - base) / 10.0);
+    printf("  Fused DSP:       %8.3f ms (effects %.3f ms, %.2f%% of one core)\n", fused, fused - base, (fused - base) / 10.0);
+
+    if (fused - base > 0) { printf("  Speedup:         %8.1fx\n", (stack - base) / (fused - base)); }
+}
+
+// Горячая смена шрифта: новый шрифт открывается и подгружает пресеты текущего трека в фоновом потоке,
+// затем главный поток подменяет цепочку шрифтов живого потока (без пересоздания и повторного PRESCAN)
+static struct {
+    pthread_t thread;
+    int threaded;
+    int running;
+    volatile int done;
+    int target;
+    int ok;
+    SoundFontList* sf_list;
+    DWORD* programs; // preset | bank << 16 (банк 128 — ударные)
+    int program_count;
+    double requested_ms;
+    double preload_ms;
+    double swap_ms;
+    double total_ms;
+    int reported;
+} font_switch;
+
+// Пресеты, которые использует файл: все смены программ с учётом выбранного банка канала.
+// Вызывается и из потока подготовки треков
+static int stream_programs(HSTREAM midi_stream, DWORD** out) {
+    uint8_t seen[129][16];
+    int count = 0, capacity = 32;
+    int bank[16] = {0};
+    DWORD* programs = malloc(capacity * sizeof(DWORD));
+    memset(seen, 0, sizeof(seen));
+
+    DWORD program_count = midi_stream ? BASS_MIDI_StreamGetEvents(midi_stream, -1, MIDI_EVENT_PROGRAM, NULL) : 0;
+    DWORD bank_count = midi_stream ? BASS_MIDI_StreamGetEvents(midi_stream, -1, MIDI_EVENT_BANK, NULL) : 0;
+
+    if (program_count == (DWORD)-1) { program_count = 0; }
+
+    if (bank_count == (DWORD)-1) { bank_count = 0; }
+
+    BASS_MIDI_EVENT* events = malloc((program_count + bank_count + 1) * sizeof(BASS_MIDI_EVENT));
+
+    if (program_count) { BASS_MIDI_StreamGetEvents(midi_stream, -1, MIDI_EVENT_PROGRAM, events); }
+
+    if (bank_count) { BASS_MIDI_StreamGetEvents(midi_stream, -1, MIDI_EVENT_BANK, events + program_count); }
+
+    // Слияние двух упорядоченных списков по времени; без смен программ звучит пресет 0
+    DWORD p = 0, b = 0;
+
+    for (int chan = 0; chan < 16; chan++) {
+        int preset_bank = chan == 9 ? 128 : 0;
+
+        if (!(seen[preset_bank][0] & 1)) {
+            seen[preset_bank][0] |= 1;
+            programs[count++] = preset_bank << 16;
+        }
+    }
+
+    while (p < program_count) {
+        if (b < bank_count && events[program_count + b].tick <= events[p].tick) {
+            bank[events[program_count + b].chan & 15] = events[program_count + b].param & 0x7F;
+            b++;
+            continue;
+        }
+
+        int chan = events[p].chan & 15;
+        int preset = events[p].param & 0x7F;
+        int preset_bank = chan == 9 ? 128 : bank[chan];
+        p++;
+
+        if (seen[preset_bank][preset >> 3] & (1 << (preset & 7))) { continue; }
+
+        seen[preset_bank][preset >> 3] |= 1 << (preset & 7);
+
+        if (count >= capacity) {
+            capacity *= 2;
+            programs = realloc(programs, capacity * sizeof(DWORD));
+        }
+
+        programs[count++] = preset | preset_bank << 16;
+    }
+
+    free(events);
+    *out = programs;
+    return count;
+}
+
+static void* font_switch_thread(void* arg) {
+    SoundFontList* list = font_switch.sf_list;
+    double start = now_ms();
+    font_switch.ok = soundfont_open(list, font_switch.target);
+
+    if (font_switch.ok) {
+        pthread_mutex_lock(&list->lock);
+        HSOUNDFONT font = list->fonts[font_switch.target].font;
+        pthread_mutex_unlock(&list->lock);
+
+        for (int i = 0; i < font_switch.program_count; i++) {
+            BASS_MIDI_FontLoad(font, LOWORD(font_switch.programs[i]), HIWORD(font_switch.programs[i]));
+        }
+    }
+
+    font_switch.preload_ms = now_ms() - start;
+    font_switch.done = 1;
+    return NULL;
+}
+
+// 0 — смена уже идёт
+int font_switch_start(SoundFontList* list, int target, HSTREAM midi_stream) {
+    if (font_switch.running) { return 0; }
+
+    font_switch.sf_list = list;
+    font_switch.target = target;
+    font_switch.done = 0;
+    font_switch.requested_ms = now_ms();
+    font_switch.program_count = stream_programs(midi_stream, &font_switch.programs);
+
+    // Пока шрифт готовится, LRU его не закрывает
+    pthread_mutex_lock(&list->lock);
+    list->pinned_font = target;
+    pthread_mutex_unlock(&list->lock);
+
+    font_switch.running = 1;
+    font_switch.threaded = pthread_create(&font_switch.thread, NULL, font_switch_thread, NULL) == 0;
+
+    if (!font_switch.threaded) { font_switch_thread(NULL); }
+
+    return 1;
+}
+
+// Возвращает подготовленный шрифт или -1, если открыть его не удалось
+int font_switch_finish() {
+    SoundFontList* list = font_switch.sf_list;
+
+    if (font_switch.threaded) { pthread_join(font_switch.thread, NULL); }
+
+    font_switch.threaded = 0;
+    font_switch.running = 0;
+    free(font_switch.programs);
+    font_switch.programs = NULL;
+
+    pthread_mutex_lock(&list->lock);
+    list->pinned_font = -1;
+    pthread_mutex_unlock(&list->lock);
+    return font_switch.ok ? font_switch.target : -1;
+}
+
+void print_font_switch() {
+    DWORD buffer_ms = BASS_GetConfig(BASS_CONFIG_BUFFER);
+    printf("\nSoundFont switch: %d presets preloaded in %.1f ms, swap %.2f ms (buffer %u ms)%s, total %.1f ms\n",
+           font_switch.program_count, font_switch.preload_ms, font_switch.swap_ms, buffer_ms,
+           font_switch.swap_ms > buffer_ms ? " OVER BUFFER" : "", font_switch.total_ms);
+}
+
+// Цепочка шрифтов потока: активный SoundFont первым, затем остальные загруженные
+BOOL set_stream_fonts(HSTREAM midi_stream, SoundFontList* sf_list) {
+    pthread_mutex_lock(&sf_list->lock);
+    BASS_MIDI_FONT* temp_fonts = malloc((sf_list->count + 1) * sizeof(BASS_MIDI_FONT));
+    int temp_count = 0;
+
+    if (sf_list->status[sf_list->active_sf] == SF_READY) {
+        temp_fonts[temp_count] = sf_list->fonts[sf_list->active_sf];
+        temp_fonts[temp_count].preset = -1;
+        temp_fonts[temp_count].bank = 0;
+        temp_count++;
+    }
+
+    for (int i = 0; i < sf_list->count; i++) {
+        if (i != sf_list->active_sf && sf_list->status[i] == SF_READY) {
+            temp_fonts[temp_count] = sf_list->fonts[i];
+            temp_fonts[temp_count].preset = -1;
+            temp_fonts[temp_count].bank = 0;
+            temp_count++;
+        }
+    }
+
+    pthread_mutex_unlock(&sf_list->lock);
+    BOOL ok = BASS_MIDI_StreamSetFonts(midi_stream, temp_fonts, temp_count);
+    free(temp_fonts);
+
+    // С отображёнными шрифтами сэмплы пресетов файла подгружаются не здесь, а в потоке подготовки (prepare_reload)
+    return ok;
+}
+
+// Заново определяет шрифты каналов по текущим программам потока
+void refresh_channel_presets(HSTREAM midi_stream, SoundFontList* sf_list) {
+    memset(channel_presets, 0, sizeof(channel_presets));
+
+    for (int i = 0; i < 16; i++) {
+        channel_presets[i].sf_index = -1;
+        DWORD prog = BASS_MIDI_StreamGetEvent(midi_stream, i, MIDI_EVENT_PROGRAM);
+        DWORD bank = BASS_MIDI_StreamGetEvent(midi_stream, i, MIDI_EVENT_BANK);
+
+        if (prog != -1) {
+            DWORD event_data = prog | (bank << 16);
+            MidiEventProc(0, i, event_data, sf_list);
+        }
+    }
+}
+
+// Память процесса и отображённых шрифтов по /proc/self/smaps: mapped — размер отображений .sf2 и .sf2pack,
+// resident — их страницы в памяти (общие с другими плеерами), pss — доля этого процесса
+static struct {
+    double mapped_mb;
+    double resident_mb;
+    double pss_mb;
+    double rss_mb;
+    double updated_ms;
+} font_memory;
+
+#define FONT_MEMORY_REFRESH_MS 2000
+
+void font_memory_update() {
+    FILE* f = fopen("/proc/self/smaps", "r");
+
+    if (!f) { return; }
+
+    char line[PATH_MAX + 128];
+    unsigned long mapped_kb = 0, resident_kb = 0, pss_kb = 0, rss_kb = 0, value;
+    int in_font = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start, end;
+        int path_pos = 0;
+
+        // Заголовок отображения: "адрес права смещение устройство inode путь"
+        if (sscanf(line, "%lx-%lx %*s %*s %*s %*s %n", &start, &end, &path_pos) == 2 && path_pos > 0) {
+            char* path = line + path_pos;
+            path[strcspn(path, "\n")] = '\0';
+            in_font = ends_with_ci(path, ".sf2") || ends_with_ci(path, ".sf2" SF2PACK_SUFFIX);
+        }
+
+        else if (sscanf(line, "Rss: %lu kB", &value) == 1) {
+            rss_kb += value;
+
+            if (in_font) { resident_kb += value; }
+        }
+
+        else if (in_font && sscanf(line, "Size: %lu kB", &value) == 1) { mapped_kb += value; }
+
+        else if (in_font && sscanf(line, "Pss: %lu kB", &value) == 1) { pss_kb += value; }
+    }
+
+    fclose(f);
+    font_memory.mapped_mb = mapped_kb / 1024.0;
+    font_memory.resident_mb = resident_kb / 1024.0;
+    font_memory.pss_mb = pss_kb / 1024.0;
+    font_memory.rss_mb = rss_kb / 1024.0;
+    font_memory.updated_ms = now_ms();
+}
+
+// Кэш MIDI-файлов в памяти с LRU и бюджетом (--file-cache MB): потоки создаются из памяти (mem=TRUE),
+// соседние треки заранее читаются фоновым потоком (posix_fadvise + read), так что смена трека не ждёт диска
+#define FILE_CACHE_DEFAULT_MB 64
+
+typedef struct {
+    char* path;
+    uint8_t* data;
+    size_t size;
+    int64_t mtime_ns;
+    uint64_t hash; // FNV-1a содержимого (ключ кэша событий)
+    uint32_t last_used;
+    int refs;      // Потоки, созданные из этих данных
+} FileCacheEntry;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    FileCacheEntry** items;
+    int count;
+    int capacity;
+    size_t bytes;
+    size_t budget;
+    uint32_t clock;
+    uint32_t hits;
+    uint32_t misses;
+    pthread_t thread;
+    int running;
+    int quit;
+    char* requests[2]; // Соседние треки для предвыборки
+    int request_count;
+} file_cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .budget = (size_t)FILE_CACHE_DEFAULT_MB << 20 };
+
+static uint64_t fnv1a64(const uint8_t* data, size_t size);
+
+static void file_cache_entry_free(FileCacheEntry* entry) {
+    free(entry->path);
+    free(entry->data);
+    free(entry);
+}
+
+static FileCacheEntry* file_cache_find(const char* path) {
+    for (int i = 0; i < file_cache.count; i++) {
+        if (strcmp(file_cache.items[i]->path, path) == 0) { return file_cache.items[i]; }
+    }
+
+    return NULL;
+}
+
+static void file_cache_remove(FileCacheEntry* entry) {
+    for (int i = 0; i < file_cache.count; i++) {
+        if (file_cache.items[i] == entry) {
+            file_cache.items[i] = file_cache.items[--file_cache.count];
+            break;
+        }
+    }
+
+    file_cache.bytes -= entry->size;
+}
+
+// Вытесняет давно не использованные файлы, пока не освободится need байт (используемые потоками не трогаются)
+static int file_cache_evict(size_t need) {
+    while (file_cache.bytes + need > file_cache.budget) {
+        FileCacheEntry* lru = NULL;
+
+        for (int i = 0; i < file_cache.count; i++) {
+            if (file_cache.items[i]->refs == 0 && (!lru || file_cache.items[i]->last_used < lru->last_used)) { lru = file_cache.items[i]; }
+        }
+
+        if (!lru) { return 0; }
+
+        file_cache_remove(lru);
+        file_cache_entry_free(lru);
+    }
+
+    return 1;
+}
+
+// Читает файл целиком; файлы больше бюджета не кэшируются (только подсказка ядру о чтении)
+static FileCacheEntry* file_cache_read(const char* path) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) { return NULL; }
+
+    struct stat st;
+    FileCacheEntry* entry = NULL;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (size_t)st.st_size <= file_cache.budget) {
+        uint8_t* data = malloc(st.st_size);
+        size_t done = 0;
+
+        while (done < (size_t)st.st_size) {
+            ssize_t n = read(fd, data + done, st.st_size - done);
+
+            if (n <= 0) { break; }
+
+            done += n;
+        }
+
+        if (done == (size_t)st.st_size) {
+            entry = malloc(sizeof(FileCacheEntry));
+            entry->path = strdup(path);
+            entry->data = data;
+            entry->size = st.st_size;
+            entry->mtime_ns = stat_mtime_ns(&st);
+            entry->hash = fnv1a64(data, st.st_size);
+            entry->last_used = 0;
+            entry->refs = 0;
+        }
+
+        else { free(data); }
+    }
+
+    close(fd);
+    return entry;
+}
+
+// Кладёт прочитанный файл в кэш; если место не освободилось, запись остаётся у вызывающего
+static FileCacheEntry* file_cache_insert(FileCacheEntry* entry) {
+    FileCacheEntry* existing = file_cache_find(entry->path);
+
+    if (existing) {
+        file_cache_entry_free(entry);
+        return existing;
+    }
+
+    if (!file_cache_evict(entry->size)) { return entry; }
+
+    if (file_cache.count >= file_cache.capacity) {
+        file_cache.capacity = file_cache.capacity ? file_cache.capacity * 2 : 16;
+        file_cache.items = realloc(file_cache.items, file_cache.capacity * sizeof(FileCacheEntry*));
+    }
+
+    file_cache.items[file_cache.count++] = entry;
+    file_cache.bytes += entry->size;
+    return entry;
+}
+
+// Данные файла со ссылкой; NULL — кэш выключен или файл не читается/не помещается
+FileCacheEntry* file_cache_acquire(const char* path) {
+    if (file_cache.budget == 0) { return NULL; }
+
+    struct stat st;
+
+    if (stat(path, &st) != 0) { return NULL; }
+
+    pthread_mutex_lock(&file_cache.lock);
+    FileCacheEntry* entry = file_cache_find(path);
+
+    // Изменившийся файл перечитывается; старые данные, которыми ещё играют потоки,
+    // только уходят из кэша — их освободит последний file_cache_release
+    if (entry && (entry->size != (size_t)st.st_size || entry->mtime_ns != stat_mtime_ns(&st))) {
+        file_cache_remove(entry);
+
+        if (entry->refs == 0) { file_cache_entry_free(entry); }
+
+        entry = NULL;
+    }
+
+    if (entry) { file_cache.hits++; }
+
+    else {
+        file_cache.misses++;
+        pthread_mutex_unlock(&file_cache.lock);
+        FileCacheEntry* loaded = file_cache_read(path);
+        pthread_mutex_lock(&file_cache.lock);
+        entry = loaded ? file_cache_insert(loaded) : NULL;
+    }
+
+    if (entry) {
+        entry->refs++;
+        entry->last_used = ++file_cache.clock;
+    }
+
+    pthread_mutex_unlock(&file_cache.lock);
+    return entry;
+}
+
+void file_cache_release(FileCacheEntry* entry) {
+    pthread_mutex_lock(&file_cache.lock);
+    entry->refs--;
+
+    // Запись, не попавшая в кэш (не хватило бюджета), освобождается сразу
+    if (entry->refs == 0 && file_cache_find(entry->path) != entry) { file_cache_entry_free(entry); }
+
+    pthread_mutex_unlock(&file_cache.lock);
+}
+
+static void CALLBACK release_file_proc(HSYNC handle, DWORD channel, DWORD data, void* user) { file_cache_release((FileCacheEntry*)user); }
+
+static void* file_cache_thread(void* arg) {
+    pthread_mutex_lock(&file_cache.lock);
+
+    while (!file_cache.quit) {
+        if (file_cache.request_count == 0) {
+            pthread_cond_wait(&file_cache.cond, &file_cache.lock);
+            continue;
+        }
+
+        char* path = file_cache.requests[--file_cache.request_count];
+        int cached = file_cache_find(path) != NULL;
+        pthread_mutex_unlock(&file_cache.lock);
+
+        if (!cached) {
+            FileCacheEntry* entry = file_cache_read(path);
+
+            pthread_mutex_lock(&file_cache.lock);
+
+            // Не поместившийся в бюджет файл не сохраняется, ядро уже получило подсказку о чтении
+            if (entry && file_cache_insert(entry) == entry && file_cache_find(entry->path) != entry) { file_cache_entry_free(entry); }
+
+            pthread_mutex_unlock(&file_cache.lock);
+        }
+
+        free(path);
+        pthread_mutex_lock(&file_cache.lock);
+    }
+
+    pthread_mutex_unlock(&file_cache.lock);
+    return NULL;
+}
+
+void file_cache_start() {
+    if (file_cache.budget > 0 && pthread_create(&file_cache.thread, NULL, file_cache_thread, NULL) == 0) { file_cache.running = 1; }
+}
+
+// Ставит соседние треки в очередь предвыборки (старые запросы заменяются)
+void file_cache_prefetch(MidiList* list, int index) {
+    if (!file_cache.running || list->count < 2) { return; }
+
+    pthread_mutex_lock(&file_cache.lock);
+
+    while (file_cache.request_count > 0) { free(file_cache.requests[--file_cache.request_count]); }
+
+    file_cache.requests[file_cache.request_count++] = strdup(list->files[(index - 1 + list->count) % list->count]);
+
+    if (list->count > 2) { file_cache.requests[file_cache.request_count++] = strdup(list->files[(index + 1) % list->count]); }
+
+    pthread_cond_signal(&file_cache.cond);
+    pthread_mutex_unlock(&file_cache.lock);
+}
+
+void file_cache_stop() {
+    if (file_cache.running) {
+        pthread_mutex_lock(&file_cache.lock);
+        file_cache.quit = 1;
+        pthread_cond_signal(&file_cache.cond);
+        pthread_mutex_unlock(&file_cache.lock);
+        pthread_join(file_cache.thread, NULL);
+        file_cache.running = 0;
+    }
+
+    while (file_cache.request_count > 0) { free(file_cache.requests[--file_cache.request_count]); }
+
+    for (int i = 0; i < file_cache.count; i++) { file_cache_entry_free(file_cache.items[i]); }
+
+    free(file_cache.items);
+    file_cache.items = NULL;
+    file_cache.count = 0;
+    file_cache.bytes = 0;
+}
+
+// Кэш событий: файл разбирается с PRESCAN один раз, его события сохраняются в .echomidi/events/<FNV-1a хэш>.evc
+// и при следующих открытиях поток создаётся из массива событий (BASS_MIDI_StreamCreateEvents)
+#define EVENT_CACHE_DIR STATE_DIR "/events"
+#define EVENT_CACHE_MAGIC "EMEVT002"
+
+typedef struct {
+    char magic[8];
+    uint32_t ppqn;
+    uint32_t count;
+    uint64_t file_size;
+    uint32_t end_tick;   // Тик End of Track: тишина после последней ноты входит в длину трека
+    uint32_t reserved;
+} EventCacheHeader;
+
+// 12 байт на событие
+typedef struct {
+    uint32_t tick;
+    uint32_t param;
+    uint32_t event_chan; // event << 8 | chan
+} EventCacheRecord;
+
+// Как был открыт трек (для GUI)
+typedef struct {
+    double open_ms;
+    int cached;
+    DWORD events;
+    int prepared;     // Поток собран заранее фоновой подготовкой
+    double switch_ms; // От команды смены трека до начала воспроизведения
+    int partial;      // Играет префикс, полный разбор ещё идёт (--progressive)
+    double prefix_ms; // Открытие префикса, если трек начинался прогрессивно
+    int presets;      // Пресетов, чьи сэмплы загружены до старта
+    double samples_ms;
+} TrackOpenStats;
+
+static TrackOpenStats last_open;
+
+static uint64_t fnv1a64(const uint8_t* data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Хэш содержимого файла; 0 — файл не прочитан
+static uint64_t midi_file_hash(const char* path, uint64_t* file_size) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) { return 0; }
+
+    struct stat st;
+    uint64_t hash = 0;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data != MAP_FAILED) {
+            hash = fnv1a64(data, st.st_size);
+            *file_size = st.st_size;
+            munmap(data, st.st_size);
+        }
+    }
+
+    close(fd);
+    return hash;
+}
+
+// Массив событий (или префикс файла) нужен потоку, пока тот жив
+static void CALLBACK free_events_proc(HSYNC handle, DWORD channel, DWORD data, void* user) { free(user); }
+
+static HSTREAM event_cache_open(const char* cache_path, uint64_t file_size, DWORD flags, DWORD* count) {
+    int fd = open(cache_path, O_RDONLY);
+
+    if (fd < 0) { return 0; }
+
+    struct stat st;
+    const uint8_t* data = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(EventCacheHeader)) { data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0); }
+
+    close(fd);
+
+    if (data == MAP_FAILED) { return 0; }
+
+    const EventCacheHeader* header = (const EventCacheHeader*)data;
+    HSTREAM stream = 0;
+
+    if (memcmp(header->magic, EVENT_CACHE_MAGIC, 8) == 0 && header->file_size == file_size && header->count > 0 &&
+            (uint64_t)st.st_size == sizeof(EventCacheHeader) + (uint64_t)header->count * sizeof(EventCacheRecord)) {
+        const EventCacheRecord* records = (const EventCacheRecord*)(header + 1);
+        BASS_MIDI_EVENT* events = malloc((header->count + 1) * sizeof(BASS_MIDI_EVENT));
+
+        for (uint32_t i = 0; i < header->count; i++) {
+            events[i].event = records[i].event_chan >> 8;
+            events[i].chan = records[i].event_chan & 0xFF;
+            events[i].param = records[i].param;
+            events[i].tick = records[i].tick;
+            events[i].pos = 0;
+        }
+
+        memset(&events[header->count], 0, sizeof(BASS_MIDI_EVENT)); // MIDI_EVENT_END
+        events[header->count].tick = header->end_tick;
+        stream = BASS_MIDI_StreamCreateEvents(events, header->ppqn, flags, SAMPLE_RATE);
+        *count = header->count;
+
+        if (stream) { BASS_ChannelSetSync(stream, BASS_SYNC_FREE, 0, free_events_proc, events); }
+
+        else { free(events); }
+    }
+
+    munmap((void*)data, st.st_size);
+    return stream;
+}
+
+static void event_cache_save(const char* cache_path, HSTREAM midi_stream, uint64_t file_size) {
+    DWORD count = BASS_MIDI_StreamGetEvents(midi_stream, -1, 0, NULL);
+    float ppqn = 0;
+
+    if (count == (DWORD)-1 || count == 0 || !BASS_ChannelGetAttribute(midi_stream, BASS_ATTRIB_MIDI_PPQN, &ppqn)) { return; }
+
+    BASS_MIDI_EVENT* events = malloc(count * sizeof(BASS_MIDI_EVENT));
+    count = BASS_MIDI_StreamGetEvents(midi_stream, -1, 0, events);
+    EventCacheRecord* records = malloc(count * sizeof(EventCacheRecord) + 1);
+    uint32_t kept = 0;
+    // Длина разобранного потока в тиках — та же, что у открытия с PRESCAN
+    QWORD length = BASS_ChannelGetLength(midi_stream, BASS_POS_MIDI_TICK);
+    uint32_t end_tick = length == (QWORD)-1 ? 0 : (uint32_t)length;
+
+    for (DWORD i = 0; i < count; i++) {
+        if (events[i].tick > end_tick) { end_tick = events[i].tick; }
+
+        if (events[i].event == MIDI_EVENT_END || events[i].event == MIDI_EVENT_END_TRACK) { continue; }
+
+        records[kept].tick = events[i].tick;
+        records[kept].param = events[i].param;
+        records[kept].event_chan = events[i].event << 8 | (events[i].chan & 0xFF);
+        kept++;
+    }
+
+    EventCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EVENT_CACHE_MAGIC, 8);
+    header.ppqn = (uint32_t)ppqn;
+    header.count = kept;
+    header.file_size = file_size;
+    header.end_tick = end_tick;
+
+    char tmp_path[80];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+    mkdir(STATE_DIR, 0755);
+    mkdir(EVENT_CACHE_DIR, 0755);
+    FILE* f = fopen(tmp_path, "wb");
+
+    if (f) {
+        int ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(records, sizeof(EventCacheRecord), kept, f) == kept;
+        ok = (fclose(f) == 0) && ok && rename(tmp_path, cache_path) == 0;
+
+        if (!ok) { unlink(tmp_path); }
+    }
+
+    free(records);
+    free(events);
+}
+
+// Прогрессивное открытие (--progressive): большой файл без кэша событий начинает играть с префикса —
+// начала каждой дорожки, обрезанного на общем такте. Полный разбор идёт в фоне, затем поток подменяется
+#define PROGRESSIVE_MIN_BYTES (1 << 20)
+#define PROGRESSIVE_PREFIX_BYTES (256 << 10)
+#define PROGRESSIVE_MAX_TRACKS 256
+
+static int progressive_mode = 0;
+
+// Число переменной длины; 0 — не поместилось в avail
+static size_t midi_vlq(const uint8_t* p, size_t avail, uint32_t* value) {
+    *value = 0;
+
+    for (size_t i = 0; i < avail && i < 4; i++) {
+        *value = (*value << 7) | (p[i] & 0x7F);
+
+        if (!(p[i] & 0x80)) { return i + 1; }
+    }
+
+    return 0;
+}
+
+// Размер события вместе с дельтой; 0 — событие обрезано или испорчено
+static size_t midi_event_size(const uint8_t* p, size_t avail, uint8_t* running, uint32_t* delta) {
+    size_t i = midi_vlq(p, avail, delta);
+    uint32_t length;
+
+    if (!i || i >= avail) { return 0; }
+
+    uint8_t status = p[i];
+
+    if (status < 0x80) {
+        if (!*running) { return 0; }
+
+        status = *running;
+    }
+
+    else { i++; }
+
+    if (status == 0xFF || status == 0xF0 || status == 0xF7) {
+        if (status == 0xFF) { i++; } // Тип мета-события
+
+        size_t n = i < avail ? midi_vlq(p + i, avail - i, &length) : 0;
+
+        if (!n) { return 0; }
+
+        i += n + length;
+    }
+
+    else {
+        i += (status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0 ? 1 : 2;
+        *running = status;
+    }
+
+    return i <= avail ? i : 0;
+}
+
+// Собирает префикс файла в памяти: с каждой дорожки читается не больше своей доли PROGRESSIVE_PREFIX_BYTES,
+// все дорожки обрезаются на самом раннем такте, до которого прочитана каждая, и закрываются End of Track
+static uint8_t* midi_prefix_build(const char* path, size_t* size) {
+    static const uint8_t end_of_track[] = { 0x00, 0xFF, 0x2F, 0x00 };
+    int fd = open(path, O_RDONLY);
+    uint8_t header[14];
+
+    if (fd < 0) { return NULL; }
+
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, "MThd", 4) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    uint32_t header_len = (uint32_t)header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7];
+    int declared = header[10] << 8 | header[11];
+
+    if (header_len < 6 || declared == 0 || declared > PROGRESSIVE_MAX_TRACKS) {
+        close(fd);
+        return NULL;
+    }
+
+    off_t offset = 8 + (off_t)header_len;
+    uint8_t* data[PROGRESSIVE_MAX_TRACKS];
+    size_t got[PROGRESSIVE_MAX_TRACKS], keep[PROGRESSIVE_MAX_TRACKS];
+    int whole[PROGRESSIVE_MAX_TRACKS];
+    int tracks = 0;
+    size_t share = PROGRESSIVE_PREFIX_BYTES / declared;
+    uint64_t cut = UINT64_MAX;
+
+    if (share < 4096) { share = 4096; }
+
+    // Проход 1: куски дорожек и такт, до которого прочитана каждая обрезанная дорожка
+    while (tracks < declared) {
+        uint8_t chunk[8];
+
+        if (pread(fd, chunk, 8, offset) != 8) { break; }
+
+        uint32_t length = (uint32_t)chunk[4] << 24 | chunk[5] << 16 | chunk[6] << 8 | chunk[7];
+
+        if (memcmp(chunk, "MTrk", 4) == 0) {
+            size_t want = length < share ? length : share;
+            data[tracks] = malloc(want + sizeof(end_of_track));
+            ssize_t n = data[tracks] ? pread(fd, data[tracks], want, offset + 8) : -1;
+            got[tracks] = n > 0 ? (size_t)n : 0;
+            whole[tracks] = got[tracks] == length;
+
+            if (!whole[tracks]) {
+                uint64_t tick = 0;
+                uint32_t delta;
+                uint8_t running = 0;
+
+                for (size_t pos = 0, step; pos < got[tracks] && (step = midi_event_size(data[tracks] + pos, got[tracks] - pos, &running, &delta)); pos += step) {
+                    tick += delta;
+                }
+
+                if (tick < cut) { cut = tick; }
+            }
+
+            tracks++;
+        }
+
+        offset += 8 + (off_t)length;
+    }
+
+    close(fd);
+
+    // Первое событие какой-то дорожки не прочиталось — префикс бесполезен
+    if (tracks == 0 || cut == 0) {
+        for (int t = 0; t < tracks; t++) { free(data[t]); }
+
+        return NULL;
+    }
+
+    // Проход 2: дорожки обрезаются на такте cut; целиком прочитанные до него копируются как есть
+    size_t total = 8 + header_len;
+
+    for (int t = 0; t < tracks; t++) {
+        uint64_t tick = 0;
+        uint32_t delta;
+        uint8_t running = 0;
+        size_t pos = 0, step;
+
+        while (pos < got[t] && (step = midi_event_size(data[t] + pos, got[t] - pos, &running, &delta)) && tick + delta <= cut) {
+            tick += delta;
+            pos += step;
+        }
+
+        keep[t] = pos;
+
+        if (!(whole[t] && pos == got[t])) {
+            memcpy(data[t] + keep[t], end_of_track, sizeof(end_of_track));
+            keep[t] += sizeof(end_of_track);
+        }
+
+        total += 8 + keep[t];
+    }
+
+    uint8_t* out = malloc(total);
+
+    if (out) {
+        uint8_t* p = out;
+        memcpy(p, header, sizeof(header));
+        memset(p + sizeof(header), 0, 8 + header_len - sizeof(header));
+        p[10] = tracks >> 8;
+        p[11] = tracks & 0xFF;
+        p += 8 + header_len;
+
+        for (int t = 0; t < tracks; t++) {
+            memcpy(p, "MTrk", 4);
+            p[4] = keep[t] >> 24;
+            p[5] = keep[t] >> 16;
+            p[6] = keep[t] >> 8;
+            p[7] = keep[t];
+            memcpy(p + 8, data[t], keep[t]);
+            p += 8 + keep[t];
+        }
+
+        *size = total;
+    }
+
+    for (int t = 0; t < tracks; t++) { free(data[t]); }
+
+    return out;
+}
+
+// Открывает MIDI-файл как декодирующий поток для микшера: из кэша событий, если он есть, иначе с PRESCAN и записью кэша.
+// progressive — большой файл без кэша открывается префиксом (stats->partial). Глобального состояния не трогает —
+// вызывается и из потока подготовки треков
+HSTREAM open_midi_stream(const char* path, int progressive, TrackOpenStats* stats) {
+    DWORD flags = BASS_STREAM_DECODE | BASS_SAMPLE_FLOAT;
+    double start = now_ms();
+    uint64_t file_size = 0;
+    FileCacheEntry* file = file_cache_acquire(path);
+    uint64_t hash = file ? file->hash : midi_file_hash(path, &file_size);
+    char cache_path[64];
+    HSTREAM stream = 0;
+
+    if (file) { file_size = file->size; }
+
+    snprintf(cache_path, sizeof(cache_path), EVENT_CACHE_DIR "/%016llx.evc", (unsigned long long)hash);
+
+    if (hash) { stream = event_cache_open(cache_path, file_size, flags, &stats->events); }
+
+    stats->cached = stream != 0;
+
+    if (!stream && progressive && file_size >= PROGRESSIVE_MIN_BYTES) {
+        size_t prefix_size = 0;
+        uint8_t* prefix = midi_prefix_build(path, &prefix_size);
+
+        if (prefix) { stream = BASS_MIDI_StreamCreateFile(TRUE, prefix, 0, prefix_size, flags, SAMPLE_RATE); }
+
+        if (stream) {
+            BASS_ChannelSetSync(stream, BASS_SYNC_FREE, 0, free_events_proc, prefix);
+            stats->partial = 1;
+            stats->events = BASS_MIDI_StreamGetEvents(stream, -1, 0, NULL);
+
+            if (file) { file_cache_release(file); }
+
+            stats->open_ms = now_ms() - start;
+            return stream;
+        }
+
+        free(prefix);
+    }
+
+    // Из памяти: данные файла держатся, пока поток жив
+    if (!stream && file) {
+        stream = BASS_MIDI_StreamCreateFile(TRUE, file->data, 0, file->size, flags | BASS_STREAM_PRESCAN, SAMPLE_RATE);
+
+        if (stream) {
+            BASS_ChannelSetSync(stream, BASS_SYNC_FREE, 0, release_file_proc, file);
+            file = NULL;
+            event_cache_save(cache_path, stream, file_size);
+            stats->events = BASS_MIDI_StreamGetEvents(stream, -1, 0, NULL);
+        }
+    }
+
+    if (file) { file_cache_release(file); }
+
+    if (!stream) {
+        stream = BASS_MIDI_StreamCreateFile(FALSE, path, 0, 0, flags | BASS_STREAM_PRESCAN, SAMPLE_RATE);
+
+        if (stream && hash) {
+            event_cache_save(cache_path, stream, file_size);
+            stats->events = BASS_MIDI_StreamGetEvents(stream, -1, 0, NULL);
+        }
+    }
+
+    stats->open_ms = now_ms() - start;
+    return stream;
+}
+
+// Темп и высота (--tempo, --bpm, --pitch, клавиши < > { }). Пока они нейтральны, трек играет
+// прямо из потока BASSMIDI: BASS_FX_TempoCreate с его растяжением и лишней буферизацией не создаётся
+enum { TEMPO_FAST, TEMPO_NORMAL, TEMPO_HIGH };
+static const char* tempo_quality_names[] = { "fast", "normal", "high" };
+
+static struct {
+    float percent;   // BASS_ATTRIB_TEMPO, %
+    float bpm;       // Целевой темп в BPM; 0 — темп задан процентами
+    int pitch;       // Полутоны
+    int quality;     // TEMPO_FAST / TEMPO_NORMAL / TEMPO_HIGH
+    float track_bpm; // Начальный темп текущего трека
+} tempo = { .quality = TEMPO_NORMAL, .track_bpm = 120.0f };
+
+int tempo_active(void) {
+    return tempo.bpm > 0 || fabsf(tempo.percent) >= 0.05f || tempo.pitch != 0;
+}
+
+int tempo_quality_parse(const char* name) {
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(name, tempo_quality_names[i]) == 0) { return i; }
+    }
+
+    return -1;
+}
+
+// Темп первого события MIDI_EVENT_TEMPO (мкс на четверть), без него — 120 BPM
+float midi_initial_bpm(HSTREAM midi_stream) {
+    DWORD count = BASS_MIDI_StreamGetEvents(midi_stream, -1, MIDI_EVENT_TEMPO, NULL);
+    float bpm = 120.0f;
+
+    if (count != (DWORD)-1 && count > 0) {
+        BASS_MIDI_EVENT* events = malloc(count * sizeof(BASS_MIDI_EVENT));
+
+        if (events && BASS_MIDI_StreamGetEvents(midi_stream, -1, MIDI_EVENT_TEMPO, events) > 0 && events[0].param > 0) {
+            bpm = 60000000.0f / events[0].param;
+        }
+
+        free(events);
+    }
+
+    return bpm;
+}
+
+float tempo_percent_for(float track_bpm) {
+    float percent = tempo.bpm > 0 ? (tempo.bpm / track_bpm - 1.0f) * 100.0f : tempo.percent;
+    return percent < -90.0f ? -90.0f : percent > 400.0f ? 400.0f : percent;
+}
+
+void tempo_apply(HSTREAM stream, float track_bpm) {
+    if (!BASS_FX_TempoGetSource(stream)) { return; }
+
+    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_TEMPO, tempo_percent_for(track_bpm));
+    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_TEMPO_PITCH, (float)tempo.pitch);
+}
+
+// Поток воспроизведения для MIDI-потока: темп-поток нужен только при ненейтральных темпе или высоте.
+// Пресеты качества: fast — быстрый алгоритм без AA-фильтра, high — длинный фильтр и интерполяция Шеннона
+HSTREAM play_stream_create(HSTREAM midi_stream, int with_tempo, float track_bpm) {
+    static const DWORD algo[] = { BASS_FX_TEMPO_ALGO_LINEAR, BASS_FX_TEMPO_ALGO_CUBIC, BASS_FX_TEMPO_ALGO_SHANNON };
+
+    if (!with_tempo) { return midi_stream; }
+
+    HSTREAM stream = BASS_FX_TempoCreate(midi_stream, BASS_FX_FREESOURCE | BASS_STREAM_DECODE | algo[tempo.quality]);
+
+    if (!stream) { return 0; }
+
+    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_TEMPO_OPTION_USE_QUICKALGO, tempo.quality == TEMPO_FAST);
+    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_TEMPO_OPTION_USE_AA_FILTER, tempo.quality != TEMPO_FAST);
+    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_TEMPO_OPTION_AA_FILTER_LENGTH, tempo.quality == TEMPO_HIGH ? 64 : 32);
+    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_TEMPO_OPTION_SEQUENCE_MS, tempo.quality == TEMPO_FAST ? 40 : 82);
+    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_TEMPO_OPTION_SEEKWINDOW_MS, tempo.quality == TEMPO_FAST ? 15 : 28);
+    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_TEMPO_OPTION_OVERLAP_MS, 8);
+    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_TEMPO_OPTION_PREVENT_CLICK, tempo.quality == TEMPO_HIGH);
+    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_TEMPO, tempo_percent_for(track_bpm));
+    BASS_ChannelSetAttribute(stream, BASS_ATTRIB_TEMPO_PITCH, (float)tempo.pitch);
+    return stream;
+}
+
+// Шаг темпа в целых BPM текущего трека и шаг высоты в полутонах
+void tempo_step(int bpm_step, int pitch_step) {
+    if (bpm_step && tempo.bpm > 0) {
+        tempo.bpm = roundf(tempo.bpm) + bpm_step;
+
+        if (tempo.bpm < 10.0f) { tempo.bpm = 10.0f; }
+    }
+
+    else if (bpm_step) {
+        float target = roundf(tempo.track_bpm * (1.0f + tempo.percent / 100.0f)) + bpm_step;
+
+        if (target < 10.0f) { target = 10.0f; }
+
+        tempo.percent = fabsf(target - tempo.track_bpm) < 0.5f ? 0.0f : (target / tempo.track_bpm - 1.0f) * 100.0f;
+    }
+
+    tempo.pitch += pitch_step;
+
+    if (tempo.pitch < -24) { tempo.pitch = -24; }
+
+    if (tempo.pitch > 24) { tempo.pitch = 24; }
+}
+
+// Карта плотности трека для регулятора: при открытии события нот разбираются кусками через
+// BASS_MIDI_StreamGetEventsEx в полифонию и число нажатий по интервалам DENSITY_BIN_MS.
+// На тике регулятор смотрит вперёд от позиции рендера (позиция + заполненный буфер) на lookahead мс
+// и заранее опускает уровень, если предсказанная нагрузка густого места не влезает в бюджет
+#define DENSITY_BIN_MS 50
+#define DENSITY_CHUNK 65536
+
+typedef struct {
+    int count;
+    uint16_t* poly;    // Максимум одновременно звучащих нот в интервале
+    uint16_t* onsets;  // Нажатий в интервале
+    int peak_poly;
+    double peak_s;
+    double build_ms;
+} DensityTimeline;
+
+void density_timeline_free(DensityTimeline* timeline) {
+    free(timeline->poly);
+    free(timeline->onsets);
+    memset(timeline, 0, sizeof(*timeline));
+}
+
+int density_timeline_build(DensityTimeline* timeline, HSTREAM midi_stream) {
+    double start = now_ms();
+    double length = BASS_ChannelBytes2Seconds(midi_stream, BASS_ChannelGetLength(midi_stream, BASS_POS_BYTE));
+    DWORD total = BASS_MIDI_StreamGetEvents(midi_stream, -1, MIDI_EVENT_NOTE, NULL);
+
+    density_timeline_free(timeline);
+
+    if (length <= 0 || total == (DWORD)-1) { return 0; }
+
+    timeline->count = (int)(length * 1000.0 / DENSITY_BIN_MS) + 1;
+    timeline->poly = calloc(timeline->count, sizeof(uint16_t));
+    timeline->onsets = calloc(timeline->count, sizeof(uint16_t));
+    BASS_MIDI_EVENT* events = malloc(DENSITY_CHUNK * sizeof(BASS_MIDI_EVENT));
+
+    if (!timeline->poly || !timeline->onsets || !events) {
+        free(events);
+        density_timeline_free(timeline);
+        return 0;
+    }
+
+    uint8_t held[16][128]; // Карта строится и в потоке подготовки треков
+    int active = 0;
+    int last_bin = 0;
+    memset(held, 0, sizeof(held));
+
+    for (DWORD done = 0; done < total;) {
+        DWORD got = BASS_MIDI_StreamGetEventsEx(midi_stream, -1, MIDI_EVENT_NOTE, events, done, DENSITY_CHUNK);
+
+        if (got == (DWORD)-1 || got == 0) { break; }
+
+        for (DWORD i = 0; i < got; i++) {
+            int bin = (int)(BASS_ChannelBytes2Seconds(midi_stream, events[i].pos) * 1000.0 / DENSITY_BIN_MS);
+            int chan = events[i].chan & 15;
+            int key = LOBYTE(events[i].param) & 127;
+            int velocity = HIBYTE(events[i].param);
+
+            if (bin >= timeline->count) { bin = timeline->count - 1; }
+
+            // Полифония тянется через интервалы без событий
+            for (int b = last_bin + 1; b <= bin; b++) { timeline->poly[b] = active; }
+
+            last_bin = bin > last_bin ? bin : last_bin;
+
+            if (velocity) {
+                if (held[chan][key] < 255) { held[chan][key]++; }
+
+                active++;
+
+                if (timeline->onsets[bin] < UINT16_MAX) { timeline->onsets[bin]++; }
+            }
+
+            else if (held[chan][key]) {
+                held[chan][key]--;
+                active--;
+            }
+
+            if (active > timeline->poly[bin]) { timeline->poly[bin] = active > UINT16_MAX ? UINT16_MAX : active; }
+        }
+
+        done += got;
+    }
+
+    free(events);
+
+    for (int b = 0; b < timeline->count; b++) {
+        if (timeline->poly[b] > timeline->peak_poly) {
+            timeline->peak_poly = timeline->poly[b];
+            timeline->peak_s = b * DENSITY_BIN_MS / 1000.0;
+        }
+    }
+
+    timeline->build_ms = now_ms() - start;
+    return 1;
+}
+
+// Максимальная полифония в окне [from, from + span) секунд
+int density_timeline_peak(const DensityTimeline* timeline, double from, double span) {
+    int first = (int)(from * 1000.0 / DENSITY_BIN_MS);
+    int last = (int)((from + span) * 1000.0 / DENSITY_BIN_MS);
+    int peak = 0;
+
+    if (first < 0) { first = 0; }
+
+    for (int b = first; b <= last && b < timeline->count; b++) {
+        if (timeline->poly[b] > peak) { peak = timeline->poly[b]; }
+    }
+
+    return peak;
+}
+
+// Регулятор нагрузки (--cpu-budget): на каждом тике интерфейса смотрит загрузку потока (BASS_ATTRIB_CPU),
+// число звучащих голосов и заполненность буфера воспроизведения и двигается по лестнице уровней:
+// лимит голосов, качество интерполяции (BASS_ATTRIB_MIDI_SRC, BASS_MIDI_SINCINTER) и снятие тяжёлых эффектов.
+// Вниз — сразу при превышении бюджета или проседании буфера, вверх — только после паузы с запасом.
+// Каждое решение пишется в .echomidi/governor.log
+#define GOVERNOR_LOG STATE_DIR "/governor.log"
+#define GOVERNOR_DOWN_HOLD_MS 500.0
+#define GOVERNOR_UP_HOLD_MS 3000.0
+
+static const struct {
+    int voices;
+    int src;        // 0 — линейная, 1 — 8 точек sinc, 2 — 16 точек sinc
+    int sinc;       // BASS_MIDI_SINCINTER
+    unsigned shed;  // Снимаемые эффекты, биты fx_graph.nodes
+    float cost;     // Относительная цена голоса для прогноза
+    const char* name;
+} governor_levels[] = {
+    { 256, 2, 1, 0,                             2.0f, "best" },
+    { 192, 1, 1, 0,                             1.5f, "high" },
+    { 128, 1, 0, 0,                             1.0f, "normal" },
+    { 96,  0, 0, 0,                             0.8f, "reduced" },
+    { 64,  0, 0, 1u << 0,                       0.7f, "no reverb" },
+    { 32,  0, 0, 1u << 0 | 1u << 1 | 1u << 4,   0.6f, "minimal" }, // Без реверберации, хоруса и флэнжера
+};
+
+#define GOVERNOR_LEVELS (int)(sizeof(governor_levels) / sizeof(governor_levels[0]))
+
+static struct {
+    int budget;       // % одного ядра, 0 — регулятор выключен
+    int level;
+    float cpu;        // Сглаженная загрузка
+    float voices;
+    float fill;       // Доля заполненного буфера воспроизведения
+    double changed_ms;
+    unsigned long decisions;
+    FILE* log;
+    DensityTimeline timeline;
+    int lookahead_ms;
+    float voice_cost;  // Загрузка на голос (%) при цене уровня 1.0; до первых замеров — типичная оценка
+    float layers;      // Голосов на звучащую ноту (слои пресетов)
+    int ahead_poly;    // Полифония в окне предпросмотра
+    float predicted;   // Прогноз загрузки на текущем уровне
+} governor = { .level = 2, .lookahead_ms = 400, .voice_cost = 0.05f, .layers = 2.0f };
+
+// Уровень применяется к MIDI-потоку и графу эффектов
+void governor_apply(HSTREAM stream) {
+    HSTREAM source = stream_source(stream);
+    int level = governor.level;
+
+    BASS_ChannelSetAttribute(source, BASS_ATTRIB_MIDI_VOICES, governor_levels[level].voices);
+    BASS_ChannelSetAttribute(source, BASS_ATTRIB_MIDI_SRC, governor_levels[level].src);
+    BASS_ChannelFlags(source, governor_levels[level].sinc ? BASS_MIDI_SINCINTER : 0, BASS_MIDI_SINCINTER);
+
+    if (fx_graph.shed != governor_levels[level].shed) {
+        fx_graph.shed = governor_levels[level].shed;
+        fx_graph_apply(0);
+    }
+}
+
+// Текущий трек получает уровень и карту плотности; предел BASS_ATTRIB_MIDI_CPU ему уже поставил track_attach.
+// Карту плотности строит поток подготовки: собранный в фоне трек приносит её с собой,
+// для собранного по требованию она приходит позже (prepare_density), а до того работают реактивные правила
+void governor_attach(HSTREAM stream, DensityTimeline* prepared) {
+    if (governor.budget <= 0) { return; }
+
+    if (prepared && prepared->count > 0) {
+        density_timeline_free(&governor.timeline);
+        governor.timeline = *prepared;
+        memset(prepared, 0, sizeof(*prepared));
+    }
+
+    else { density_timeline_free(&governor.timeline); }
+
+    governor.cpu = -1.0f; // Сглаживание начнётся с первого замера
+    governor.changed_ms = now_ms();
+    governor_apply(stream);
+}
+
+void governor_log(const char* track, double pos, int from, const char* reason) {
+    if (!governor.log) {
+        mkdir(STATE_DIR, 0755);
+        governor.log = fopen(GOVERNOR_LOG, "a");
+
+        if (!governor.log) { return; }
+    }
+
+    time_t now = time(NULL);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(governor.log, "%s %s @%.1fs cpu %.1f%%/%d%% voices %.0f/%d buffer %.0f%% level %s -> %s (%s)\n",
+            stamp, track, pos, governor.cpu, governor.budget, governor.voices, governor_levels[from].voices,
+            governor.fill * 100.0f, governor_levels[from].name, governor_levels[governor.level].name, reason);
+    fflush(governor.log);
+}
+
+void governor_tick(HSTREAM stream, const char* track, double pos) {
+    float cpu = 0.0f, voices = 0.0f;
+    double now = now_ms();
+
+    // Загрузка микшера включает рендер его источников
+    BASS_ChannelGetAttribute(mix.mixer, BASS_ATTRIB_CPU, &cpu);
+    BASS_ChannelGetAttribute(stream_source(stream), BASS_ATTRIB_MIDI_VOICES_ACTIVE, &voices);
+
+    DWORD buffered = BASS_ChannelGetData(mix.mixer, NULL, BASS_DATA_AVAILABLE);
+    QWORD capacity = BASS_ChannelSeconds2Bytes(mix.mixer, BASS_GetConfig(BASS_CONFIG_BUFFER) / 1000.0);
+
+    governor.cpu = governor.cpu < 0 ? cpu : governor.cpu * 0.7f + cpu * 0.3f;
+    governor.voices = voices;
+    governor.fill = buffered != (DWORD)-1 && capacity > 0 ? (float)buffered / capacity : 1.0f;
+
+    int from = governor.level;
+    const char* reason = NULL;
+    int target = -1;
+    char ahead[64];
+
+    // Прогноз: цена голоса и число голосов на ноту уточняются по замерам, полифония берётся из карты
+    // в окне после позиции рендера, то есть после уже заполненного буфера
+    if (governor.timeline.count > 0) {
+        double render_s = pos + governor.fill * BASS_GetConfig(BASS_CONFIG_BUFFER) / 1000.0;
+        int poly_now = density_timeline_peak(&governor.timeline, pos, DENSITY_BIN_MS / 1000.0);
+
+        if (voices >= 4 && cpu > 0) {
+            float cost = cpu / (voices * governor_levels[governor.level].cost);
+            governor.voice_cost = governor.voice_cost * 0.8f + cost * 0.2f;
+        }
+
+        if (poly_now > 0 && voices > 0) { governor.layers = governor.layers * 0.8f + voices / poly_now * 0.2f; }
+
+        governor.ahead_poly = density_timeline_peak(&governor.timeline, render_s, governor.lookahead_ms / 1000.0);
+
+        float wanted = governor.ahead_poly * governor.layers;
+
+        for (target = 0; target < GOVERNOR_LEVELS - 1; target++) {
+            float capped = wanted < governor_levels[target].voices ? wanted : governor_levels[target].voices;
+
+            if (capped * governor.voice_cost * governor_levels[target].cost <= governor.budget) { break; }
+        }
+
+        float capped = wanted < governor_levels[governor.level].voices ? wanted : governor_levels[governor.level].voices;
+        governor.predicted = capped * governor.voice_cost * governor_levels[governor.level].cost;
+
+        if (target > governor.level) {
+            snprintf(ahead, sizeof(ahead), "dense passage ahead: %d notes", governor.ahead_poly);
+            governor.level = target;
+            reason = ahead;
+        }
+    }
+
+    if (!reason && governor.level < GOVERNOR_LEVELS - 1 && now - governor.changed_ms >= GOVERNOR_DOWN_HOLD_MS) {
+        if (governor.cpu > governor.budget) { reason = "over budget"; }
+
+        else if (governor.fill < 0.25f) { reason = "buffer draining"; }
+
+        if (reason) { governor.level++; }
+    }
+
+    // Вверх нельзя, если густое место впереди требует текущего уровня
+    if (!reason && governor.level > 0 && now - governor.changed_ms >= GOVERNOR_UP_HOLD_MS &&
+            governor.cpu < governor.budget * 0.5f && governor.fill > 0.5f && target < governor.level) {
+        governor.level--;
+        reason = voices >= governor_levels[from].voices * 0.9f ? "voice cap reached, headroom" : "headroom";
+    }
+
+    if (reason) {
+        governor.changed_ms = now;
+        governor.decisions++;
+        governor_apply(stream);
+        governor_log(track, pos, from, reason);
+    }
+}
+
+// Прореживание нот для экстремальных файлов (--cull): фильтр BASS_MIDI_StreamSetFilter отбрасывает
+// нажатия тише порога скорости и сверх лимита нажатий на окно CULL_WINDOW_MS, а одновременные
+// повторы той же ноты на канале сливает в одну. Отпускание проходит, только когда закрыты все
+// нажатия этой клавиши, поэтому выброшенные ноты не обрывают звучащие.
+// Пороги подстраиваются по запасу производительности на каждом тике интерфейса.
+// Итоги по трекам пишутся в .echomidi/cull.log
+#define CULL_LOG STATE_DIR "/cull.log"
+#define CULL_WINDOW_MS 50.0
+#define CULL_MAX_VELOCITY 40
+#define CULL_MIN_DENSITY 8
+
+// Состояние фильтра своё у каждого MIDI-потока: затухающий трек и вступающий фильтруются независимо.
+// Меняется только в потоке рендера, освобождается синхронизацией BASS_SYNC_FREE вместе с потоком
+typedef struct {
+    uint16_t depth[16][128];     // Открытых нажатий на клавишу (сыгранных и выброшенных)
+    uint8_t sounding[16][128];
+    DWORD last_tick[16][128];
+    double window_start;
+    int window_count;
+    // Счётчики трека
+    unsigned long notes, by_velocity, by_density, stacked;
+    char* track;
+} CullState;
+
+static struct {
+    int enabled;
+    int base_velocity;      // --cull-velocity: нажатия тише не играют никогда
+    int base_density;       // --cull-density: нажатий на окно без нехватки запаса
+    volatile int velocity;  // Текущие пороги, общие для всех треков
+    volatile int density;
+    double attached_ms;
+    CullState* current;     // Состояние текущего трека для экрана статистики
+    FILE* log;
+} cull = { .base_velocity = 1, .base_density = 64 };
+
+BOOL CALLBACK CullFilterProc(HSTREAM handle, DWORD track, BASS_MIDI_EVENT* event, BOOL seeking, void* user) {
+    CullState* state = (CullState*)user;
+
+    if (event->event != MIDI_EVENT_NOTE) { return TRUE; }
+
+    int chan = event->chan & 15;
+    int key = LOBYTE(event->param) & 127;
+    int velocity = HIBYTE(event->param);
+
+    if (!velocity) {
+        if (state->depth[chan][key] > 0) { state->depth[chan][key]--; }
+
+        if (state->depth[chan][key] > 0 || !state->sounding[chan][key]) { return FALSE; }
+
+        state->sounding[chan][key] = 0;
+        return TRUE;
+    }
+
+    state->notes++;
+
+    if (state->depth[chan][key] < UINT16_MAX) { state->depth[chan][key]++; }
+
+    if (state->sounding[chan][key] && state->last_tick[chan][key] == event->tick) {
+        state->stacked++;
+        return FALSE;
+    }
+
+    if (velocity < cull.velocity) {
+        state->by_velocity++;
+        return FALSE;
+    }
+
+    double now = BASS_ChannelBytes2Seconds(handle, event->pos) * 1000.0;
+
+    if (now - state->window_start >= CULL_WINDOW_MS || now < state->window_start) {
+        state->window_start = now;
+        state->window_count = 0;
+    }
+
+    if (state->window_count >= cull.density) {
+        state->by_density++;
+        return FALSE;
+    }
+
+    state->window_count++;
+    state->sounding[chan][key] = 1;
+    state->last_tick[chan][key] = event->tick;
+    return TRUE;
+}
+
+void cull_report(const CullState* state) {
+    if (!state->track || !state->notes) { return; }
+
+    if (!cull.log) {
+        mkdir(STATE_DIR, 0755);
+        cull.log = fopen(CULL_LOG, "a");
+
+        if (!cull.log) { return; }
+    }
+
+    unsigned long dropped = state->by_velocity + state->by_density + state->stacked;
+    fprintf(cull.log, "%s: %lu of %lu note-ons dropped (%.1f%%): velocity %lu, density %lu, stacked %lu\n",
+            state->track, dropped, state->notes, dropped * 100.0 / state->notes, state->by_velocity, state->by_density,
+            state->stacked);
+    fflush(cull.log);
+}
+
+// Итоги трека уходят в журнал, когда освобождается его поток; потоки освобождает только основной поток
+static void CALLBACK cull_free_proc(HSYNC handle, DWORD channel, DWORD data, void* user) {
+    CullState* state = (CullState*)user;
+
+    cull_report(state);
+
+    if (cull.current == state) { cull.current = NULL; }
+
+    free(state->track);
+    free(state);
+}
+
+// Фильтр со своим состоянием ставится на MIDI-поток трека; текущим это состояние делает track_activate
+CullState* cull_attach(HSTREAM stream, const char* track) {
+    if (!cull.enabled) { return NULL; }
+
+    HSTREAM source = stream_source(stream);
+    CullState* state = calloc(1, sizeof(CullState));
+
+    if (!state) { return NULL; }
+
+    state->track = strdup(track);
+
+    if (!BASS_ChannelSetSync(source, BASS_SYNC_FREE, 0, cull_free_proc, state)) {
+        free(state->track);
+        free(state);
+        return NULL;
+    }
+
+    if (!cull.velocity) {
+        cull.velocity = cull.base_velocity;
+        cull.density = cull.base_density;
+    }
+
+    BASS_MIDI_StreamSetFilter(source, FALSE, CullFilterProc, state);
+    return state;
+}
+
+// Запас берётся у регулятора нагрузки, а без него — по заполненности буфера воспроизведения
+void cull_tick(HSTREAM stream) {
+    float headroom;
+    int max_velocity = cull.base_velocity > CULL_MAX_VELOCITY ? cull.base_velocity : CULL_MAX_VELOCITY;
+
+    // Пока буфер нового трека заполняется, его уровень о запасе ничего не говорит
+    if (now_ms() - cull.attached_ms < 1000.0) { return; }
+
+    if (governor.budget > 0 && governor.cpu >= 0) { headroom = 1.0f - governor.cpu / governor.budget; }
+
+    else {
+        DWORD buffered = BASS_ChannelGetData(mix.mixer, NULL, BASS_DATA_AVAILABLE);
+        QWORD capacity = BASS_ChannelSeconds2Bytes(mix.mixer, BASS_GetConfig(BASS_CONFIG_BUFFER) / 1000.0);
+        headroom = buffered != (DWORD)-1 && capacity > 0 ? (float)buffered / capacity - 0.3f : 1.0f;
+    }
+
+    if (headroom < 0.2f) {
+        cull.velocity = cull.velocity + 4 > max_velocity ? max_velocity : cull.velocity + 4;
+        cull.density = cull.density * 3 / 4 < CULL_MIN_DENSITY ? CULL_MIN_DENSITY : cull.density * 3 / 4;
+    }
+
+    else if (headroom > 0.5f) {
+        cull.velocity = cull.velocity - 2 < cull.base_velocity ? cull.base_velocity : cull.velocity - 2;
+        cull.density = cull.density + cull.density / 8 + 1 > cull.base_density ? cull.base_density : cull.density + cull.density / 8 + 1;
+    }
+}
+
+// Пресет в конкретном шрифте. Шрифт задан дескриптором, а не индексом: индексы сдвигает soundfont_compact,
+// а учёт сэмплов живёт в потоке подготовки дольше одного трека
+typedef struct {
+    HSOUNDFONT font;
+    uint16_t preset;
+    uint16_t bank;
+} FontPreset;
+
+// Фоновая подготовка соседних треков: отдельный поток собирает следующий и предыдущий треки целиком —
+// кэш событий, цепочка шрифтов, сэмплы пресетов, темп-поток и карта плотности. Смена трека сводится к подмене дескриптора
+typedef struct {
+    char* path;
+    HSTREAM stream;    // Поток воспроизведения: сам MIDI-поток или темп-поток над ним
+    int with_tempo;    // Собран при ненейтральных темпе или высоте
+    uint64_t fonts;    // Подпись цепочки шрифтов на момент сборки
+    float track_bpm;
+    DensityTimeline timeline;
+    TrackOpenStats stats;
+    FontPreset* presets;   // Пресеты трека в тех шрифтах, откуда они прозвучат
+    int preset_count;
+    const char* error; // Этап, на котором сборка не удалась
+    int error_code;
+    int attached;      // track_attach уже поставил синхронизации и фильтр
+    CullState* cull;   // Состояние фильтра нот, живёт вместе с потоком
+} PreparedTrack;
+
+#define PREPARE_SLOTS 3
+
+static struct {
+    pthread_t thread;
+    int running;
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    SoundFontList* sf_list;
+    char* wanted[PREPARE_SLOTS];        // Полный разбор текущего трека (при --progressive) и его соседи
+    PreparedTrack ready[PREPARE_SLOTS]; // Собранные треки; path == NULL — слот свободен
+    const char* building;   // Трек, который собирается прямо сейчас
+    HSTREAM reload;         // Играющий MIDI-поток, чьи пресеты надо подгрузить в новой цепочке шрифтов (--mmap-fonts)
+    FontPreset* samples_current; // Пресеты нового текущего трека для прохода бюджета сэмплов (--sample-budget)
+    int samples_count;
+    int samples_pending;
+    HSTREAM density;        // Играющий MIDI-поток без карты плотности
+    HSTREAM density_for;    // Поток, для которого построена density_ready
+    DensityTimeline density_ready;
+    unsigned long hits, misses;
+} prepare = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// Меняется при смене активного шрифта и при загрузке или закрытии любого из них
+static uint64_t font_chain_signature(SoundFontList* list) {
+    pthread_mutex_lock(&list->lock);
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (uint64_t)list->active_sf;
+
+    for (int i = 0; i < list->count; i++) { hash = (hash ^ (list->status[i] == SF_READY ? list->fonts[i].font : 0)) * 0x100000001b3ULL; }
+
+    pthread_mutex_unlock(&list->lock);
+    return hash;
+}
+
+// Шрифт, из которого прозвучит пресет: для мелодических банков — тот же выбор по таблице, что у MidiEventProc,
+// для ударных (банк 128) — первый открытый шрифт цепочки с таким набором. Вызывается под sf_list->lock
+static PresetChoice preset_resolve(SoundFontList* sf_list, int preset, int bank) {
+    PresetChoice choice = { -1, preset, bank };
+
+    if (bank < 128) {
+        if (sf_list->table) { choice = sf_list->table->entries[bank][preset]; }
+
+        if (choice.sf_index < 0) { choice = (PresetChoice) { sf_list->active_sf, 0, 0 }; }
+    }
+
+    for (int k = -1; bank == 128 && k < sf_list->count && choice.sf_index < 0; k++) {
+        int i = k < 0 ? sf_list->active_sf : k;
+
+        if (sf_list->status[i] == SF_READY && BASS_MIDI_FontGetPreset(sf_list->fonts[i].font, preset, 128)) { choice.sf_index = i; }
+    }
+
+    // Закрытые шрифты в цепочке не участвуют, их пресеты подгрузятся при открытии
+    if (choice.sf_index >= 0 && sf_list->status[choice.sf_index] != SF_READY) { choice.sf_index = -1; }
+
+    return choice;
+}
+
+// Определяет пресеты трека в тех шрифтах, где они будут найдены, и (load) загружает ровно их сэмплы.
+// Память растёт с треком, а не с банком, и первые ноты не ждут подгрузки по ходу игры
+int track_presets_load(PreparedTrack* track, HSTREAM midi_stream, SoundFontList* sf_list, int load) {
+    double start = now_ms();
+    DWORD* programs = NULL;
+    int count = stream_programs(midi_stream, &programs);
+    track->presets = malloc((count + 1) * sizeof(FontPreset));
+    track->preset_count = 0;
+
+    pthread_mutex_lock(&sf_list->lock);
+
+    for (int i = 0; i < count; i++) {
+        PresetChoice choice = preset_resolve(sf_list, LOWORD(programs[i]), HIWORD(programs[i]));
+
+        if (choice.sf_index < 0) { continue; }
+
+        FontPreset preset = { sf_list->fonts[choice.sf_index].font, choice.preset, choice.bank };
+        int seen = 0;
+
+        // Разные программы могут свестись к одному запасному пресету
+        for (int j = 0; j < track->preset_count && !seen; j++) {
+            seen = memcmp(&track->presets[j], &preset, sizeof(preset)) == 0;
+        }
+
+        if (!seen) { track->presets[track->preset_count++] = preset; }
+    }
+
+    pthread_mutex_unlock(&sf_list->lock);
+
+    for (int i = 0; i < track->preset_count && load; i++) {
+        BASS_MIDI_FontLoad(track->presets[i].font, track->presets[i].preset, track->presets[i].bank);
+    }
+
+    free(programs);
+    track->stats.presets = load ? track->preset_count : 0;
+    track->stats.samples_ms = now_ms() - start;
+    return track->preset_count;
+}
+
+void prepared_track_free(PreparedTrack* track) {
+    if (track->stream) { BASS_StreamFree(track->stream); }
+
+    density_timeline_free(&track->timeline);
+    free(track->presets);
+    free(track->path);
+    memset(track, 0, sizeof(*track));
+}
+
+// Собирает трек, но не запускает его: синхронизации и эффекты ставят track_attach() и track_activate().
+// load_samples — заранее подгрузить сэмплы используемых пресетов (в фоне; при сборке по требованию они грузятся по ходу игры),
+// progressive — большой файл можно начать с префикса
+int prepared_track_build(PreparedTrack* track, const char* path, SoundFontList* sf_list, int load_samples, int progressive) {
+    memset(track, 0, sizeof(*track));
+    track->path = strdup(path);
+    track->with_tempo = tempo_active();
+    track->fonts = font_chain_signature(sf_list);
+    HSTREAM midi_stream = open_midi_stream(path, progressive, &track->stats);
+
+    if (!midi_stream) {
+        track->error = "Failed to load MIDI";
+        track->error_code = BASS_ErrorGetCode();
+        return 0;
+    }
+
+    if (sf_list->count > 0) {
+        if (!set_stream_fonts(midi_stream, sf_list)) {
+            track->error = "Failed to set SoundFonts for";
+            track->error_code = BASS_ErrorGetCode();
+            BASS_StreamFree(midi_stream);
+            return 0;
+        }
+
+        // Без загрузки список пресетов всё равно нужен бюджету сэмплов
+        track_presets_load(track, midi_stream, sf_list, load_samples);
+    }
+
+    track->track_bpm = midi_initial_bpm(midi_stream);
+    track->stream = play_stream_create(midi_stream, track->with_tempo, track->track_bpm);
+
+    if (!track->stream) {
+        track->error = "Failed to create tempo stream for";
+        track->error_code = BASS_ErrorGetCode();
+        BASS_StreamFree(midi_stream);
+        return 0;
+    }
+
+    // Сборка по требованию идёт в потоке интерфейса: карта плотности для неё строится позже, в фоне
+    if (governor.budget > 0 && load_samples) { density_timeline_build(&track->timeline, midi_stream); }
+
+    return 1;
+}
+
+static int prepare_find(const char* path) {
+    for (int i = 0; i < PREPARE_SLOTS; i++) {
+        if (prepare.ready[i].path && strcmp(prepare.ready[i].path, path) == 0) { return i; }
+    }
+
+    return -1;
+}
+
+static int prepare_wanted(const char* path) {
+    for (int i = 0; i < PREPARE_SLOTS; i++) {
+        if (prepare.wanted[i] && strcmp(prepare.wanted[i], path) == 0) { return 1; }
+    }
+
+    return 0;
+}
+
+void samples_touch(const FontPreset* presets, int count);
+void samples_enforce(SoundFontList* sf_list, const FontPreset* current, int current_count);
+
+static void* prepare_thread(void* arg) {
+    pthread_mutex_lock(&prepare.lock);
+
+    while (!prepare.quit) {
+        char* path = NULL;
+
+        if (prepare.reload) {
+            HSTREAM midi_stream = prepare.reload;
+            PreparedTrack track = {0};
+            prepare.reload = 0;
+            pthread_mutex_unlock(&prepare.lock);
+            // Поток могли освободить: вызовы BASS с таким дескриптором просто вернут ошибку
+            track_presets_load(&track, midi_stream, prepare.sf_list, 1);
+            free(track.presets);
+            pthread_mutex_lock(&prepare.lock);
+            continue;
+        }
+
+        if (prepare.samples_pending) {
+            FontPreset* presets = prepare.samples_current;
+            int count = prepare.samples_count;
+            prepare.samples_current = NULL;
+            prepare.samples_pending = 0;
+            pthread_mutex_unlock(&prepare.lock);
+            samples_touch(presets, count);
+            samples_enforce(prepare.sf_list, presets, count);
+            free(presets);
+            pthread_mutex_lock(&prepare.lock);
+            continue;
+        }
+
+        if (prepare.density) {
+            HSTREAM midi_stream = prepare.density;
+            DensityTimeline timeline = {0};
+            prepare.density = 0;
+            pthread_mutex_unlock(&prepare.lock);
+            density_timeline_build(&timeline, midi_stream);
+            pthread_mutex_lock(&prepare.lock);
+            density_timeline_free(&prepare.density_ready);
+            prepare.density_ready = timeline;
+            prepare.density_for = midi_stream;
+            continue;
+        }
+
+        for (int i = 0; i < PREPARE_SLOTS && !path; i++) {
+            if (prepare.wanted[i] && prepare_find(prepare.wanted[i]) < 0) { path = strdup(prepare.wanted[i]); }
+        }
+
+        if (!path) {
+            pthread_cond_wait(&prepare.cond, &prepare.lock);
+            continue;
+        }
+
+        prepare.building = path;
+        pthread_mutex_unlock(&prepare.lock);
+
+        PreparedTrack track;
+        prepared_track_build(&track, path, prepare.sf_list, 1, 0);
+
+        pthread_mutex_lock(&prepare.lock);
+        prepare.building = NULL;
+
+        // Неудачная сборка тоже остаётся в слоте, чтобы не повторяться; пока шла сборка, соседи могли смениться
+        int slot = -1;
+
+        for (int i = 0; i < PREPARE_SLOTS && prepare_wanted(path); i++) if (!prepare.ready[i].path) { slot = i; }
+
+        if (slot >= 0) { prepare.ready[slot] = track; }
+
+        else { prepared_track_free(&track); }
+
+        free(path);
+        pthread_cond_broadcast(&prepare.cond);
+    }
+
+    pthread_mutex_unlock(&prepare.lock);
+    return NULL;
+}
+
+void prepare_start(SoundFontList* sf_list) {
+    prepare.sf_list = sf_list;
+
+    if (pthread_create(&prepare.thread, NULL, prepare_thread, NULL) == 0) { prepare.running = 1; }
+}
+
+// Цепочка шрифтов играющего потока изменилась: с --mmap-fonts сэмплы его пресетов подгружаются в фоне
+void prepare_reload(HSTREAM midi_stream) {
+    if (!mmap_fonts || !midi_stream) { return; }
+
+    if (!prepare.running) {
+        BASS_MIDI_StreamLoadSamples(midi_stream);
+        return;
+    }
+
+    pthread_mutex_lock(&prepare.lock);
+    prepare.reload = midi_stream;
+    pthread_cond_signal(&prepare.cond);
+    pthread_mutex_unlock(&prepare.lock);
+}
+
+// Учёт пресетов нового текущего трека и проход бюджета сэмплов уходят в поток подготовки
+void prepare_samples(const FontPreset* presets, int count) {
+    FontPreset* copy = malloc((count + 1) * sizeof(FontPreset));
+    memcpy(copy, presets, count * sizeof(FontPreset));
+
+    if (!prepare.running) {
+        samples_touch(copy, count);
+        samples_enforce(prepare.sf_list, copy, count);
+        free(copy);
+        return;
+    }
+
+    pthread_mutex_lock(&prepare.lock);
+    free(prepare.samples_current);
+    prepare.samples_current = copy;
+    prepare.samples_count = count;
+    prepare.samples_pending = 1;
+    pthread_cond_signal(&prepare.cond);
+    pthread_mutex_unlock(&prepare.lock);
+}
+
+// Карта плотности для трека, собранного по требованию
+void prepare_density(HSTREAM midi_stream) {
+    if (!prepare.running) { return; }
+
+    pthread_mutex_lock(&prepare.lock);
+    prepare.density = midi_stream;
+    pthread_cond_signal(&prepare.cond);
+    pthread_mutex_unlock(&prepare.lock);
+}
+
+// Готовая карта переходит регулятору, если она построена для играющего потока
+void prepare_density_poll(HSTREAM midi_stream) {
+    pthread_mutex_lock(&prepare.lock);
+
+    if (prepare.density_for && prepare.density_for == midi_stream) {
+        density_timeline_free(&governor.timeline);
+        governor.timeline = prepare.density_ready;
+        memset(&prepare.density_ready, 0, sizeof(prepare.density_ready));
+        prepare.density_for = 0;
+    }
+
+    pthread_mutex_unlock(&prepare.lock);
+}
+
+// Заказывает соседей текущего трека, а для прогрессивно открытого (full_current) — и его полный разбор, первым.
+// Собранные треки, которые больше не заказаны или собраны при другой нейтральности темпа, освобождаются
+void prepare_neighbours(MidiList* list, int index, int full_current) {
+    if (!prepare.running) { return; }
+
+    pthread_mutex_lock(&prepare.lock);
+
+    for (int i = 0; i < PREPARE_SLOTS; i++) {
+        free(prepare.wanted[i]);
+        prepare.wanted[i] = NULL;
+    }
+
+    if (full_current) { prepare.wanted[0] = strdup(list->files[index]); }
+
+    if (list->count > 1) { prepare.wanted[1] = strdup(list->files[(index + 1) % list->count]); }
+
+    if (list->count > 2) { prepare.wanted[2] = strdup(list->files[(index - 1 + list->count) % list->count]); }
+
+    for (int i = 0; i < PREPARE_SLOTS; i++) {
+        if (prepare.ready[i].path && (!prepare_wanted(prepare.ready[i].path) || prepare.ready[i].with_tempo != tempo_active())) {
+            prepared_track_free(&prepare.ready[i]);
+        }
+    }
+
+    pthread_cond_signal(&prepare.cond);
+    pthread_mutex_unlock(&prepare.lock);
+}
+
+// Собранный заранее трек; если он ещё собирается — дождаться, если его нет — собрать здесь же
+void prepare_take(PreparedTrack* track, const char* path, SoundFontList* sf_list, int progressive) {
+    int found = -1;
+
+    if (prepare.running) {
+        pthread_mutex_lock(&prepare.lock);
+
+        while (prepare.building && strcmp(prepare.building, path) == 0) { pthread_cond_wait(&prepare.cond, &prepare.lock); }
+
+        found = prepare_find(path);
+
+        if (found >= 0) {
+            *track = prepare.ready[found];
+            memset(&prepare.ready[found], 0, sizeof(PreparedTrack));
+        }
+
+        // Забранный трек больше не заказан, иначе поток соберёт его снова
+        for (int i = 0; i < PREPARE_SLOTS; i++) {
+            if (prepare.wanted[i] && strcmp(prepare.wanted[i], path) == 0) {
+                free(prepare.wanted[i]);
+                prepare.wanted[i] = NULL;
+            }
+        }
+
+        pthread_mutex_unlock(&prepare.lock);
+    }
+
+    // Поток, собранный при других темпе или высоте, не годится: темп-поток в нём либо лишний, либо нужен
+    if (found >= 0 && (!track->stream || track->with_tempo != tempo_active())) {
+        prepared_track_free(track);
+        found = -1;
+    }
+
+    if (found < 0) {
+        prepare.misses++;
+        prepared_track_build(track, path, sf_list, 0, progressive);
+        return;
+    }
+
+    prepare.hits++;
+    track->stats.prepared = 1;
+
+    // Пока трек ждал, шрифт сменился или какой-то из шрифтов закрылся — цепочка и пресеты определяются заново
+    if (track->fonts != font_chain_signature(sf_list)) {
+        set_stream_fonts(stream_source(track->stream), sf_list);
+        free(track->presets);
+        track_presets_load(track, stream_source(track->stream), sf_list, 1);
+    }
+}
+
+// Как prepare_take(), но не ждёт: 1 — трек уже собран в фоне и забран
+int prepare_poll(PreparedTrack* track, const char* path, SoundFontList* sf_list) {
+    pthread_mutex_lock(&prepare.lock);
+    int ready = prepare_find(path) >= 0;
+    pthread_mutex_unlock(&prepare.lock);
+
+    if (ready) { prepare_take(track, path, sf_list, 0); }
+
+    return ready;
+}
+
+void prepare_stop() {
+    if (prepare.running) {
+        pthread_mutex_lock(&prepare.lock);
+        prepare.quit = 1;
+        pthread_cond_signal(&prepare.cond);
+        pthread_mutex_unlock(&prepare.lock);
+        pthread_join(prepare.thread, NULL);
+        prepare.running = 0;
+    }
+
+    for (int i = 0; i < PREPARE_SLOTS; i++) {
+        free(prepare.wanted[i]);
+        prepare.wanted[i] = NULL;
+        prepared_track_free(&prepare.ready[i]);
+    }
+
+    density_timeline_free(&prepare.density_ready);
+    free(prepare.samples_current);
+    prepare.samples_current = NULL;
+}
+
+// Бюджет памяти сэмплов (--sample-budget). BASSMIDI держит всё, что когда-либо загрузил, поэтому на смене трека
+// давно не звучавшие пресеты, не нужные текущему и подготовленным трекам, выгружаются, а шрифты уплотняются
+typedef struct {
+    FontPreset preset;
+    uint32_t last_used;
+} PresetUse;
+
+static struct {
+    size_t budget;          // Байт; 0 — без ограничения
+    PresetUse* uses;        // Пресеты, звучавшие за сеанс
+    int count;
+    int capacity;
+    uint32_t clock;
+    unsigned long unloaded; // Выгружено пресетов за сеанс
+    double last_ms;         // Последний проход выгрузки
+} samples;
+
+// Загружено сэмплов во всех открытых шрифтах, байт; по шрифтам — в loaded[]/total[], если они заданы
+size_t samples_loaded(SoundFontList* sf_list, DWORD* loaded, DWORD* total) {
+    size_t sum = 0;
+    pthread_mutex_lock(&sf_list->lock);
+
+    for (int i = 0; i < sf_list->count; i++) {
+        BASS_MIDI_FONTINFO info = {0};
+
+        if (sf_list->status[i] == SF_READY) { BASS_MIDI_FontGetInfo(sf_list->fonts[i].font, &info); }
+
+        sum += info.samload;
+
+        if (loaded) { loaded[i] = info.samload; }
+
+        if (total) { total[i] = info.samsize; }
+    }
+
+    pthread_mutex_unlock(&sf_list->lock);
+    return sum;
+}
+
+void samples_touch(const FontPreset* presets, int count) {
+    samples.clock++;
+
+    for (int i = 0; i < count; i++) {
+        int j = 0;
+
+        while (j < samples.count && memcmp(&samples.uses[j].preset, &presets[i], sizeof(FontPreset)) != 0) { j++; }
+
+        if (j == samples.count) {
+            if (samples.count >= samples.capacity) {
+                samples.capacity = samples.capacity ? samples.capacity * 2 : 64;
+                samples.uses = realloc(samples.uses, samples.capacity * sizeof(PresetUse));
+            }
+
+            samples.uses[samples.count++].preset = presets[i];
+        }
+
+        samples.uses[j].last_used = samples.clock;
+    }
+}
+
+// От недавних к давним
+static int preset_use_cmp(const void* a, const void* b) {
+    uint32_t x = ((const PresetUse*)a)->last_used, y = ((const PresetUse*)b)->last_used;
+    return x > y ? -1 : x < y;
+}
+
+static int preset_in(const FontPreset* presets, int count, const FontPreset* preset) {
+    for (int i = 0; i < count; i++) {
+        if (memcmp(&presets[i], preset, sizeof(FontPreset)) == 0) { return 1; }
+    }
+
+    return 0;
+}
+
+// Шрифт ещё открыт: у закрытого дескриптор уже освобождён, а сэмплы отданы
+static int samples_font_open(SoundFontList* sf_list, HSOUNDFONT font) {
+    int open = 0;
+    pthread_mutex_lock(&sf_list->lock);
+
+    for (int i = 0; i < sf_list->count && !open; i++) { open = sf_list->status[i] == SF_READY && sf_list->fonts[i].font == font; }
+
+    pthread_mutex_unlock(&sf_list->lock);
+    return open;
+}
+
+// Проход бюджета на смене трека, в потоке подготовки. BASS_MIDI_FontUnload сам память не отдаёт — её отдаёт
+// BASS_MIDI_FontCompact, причём всё, на что не ссылаются потоки. Поэтому каждый открытый шрифт уплотняется один раз,
+// затем заново грузятся пресеты текущего и подготовленных треков, а следом — недавно звучавшие, пока хватает бюджета.
+// Пресет, с которым бюджет переполнился, снимается повторным уплотнением его шрифта, и проход кончается в бюджете.
+// Сборки потока подготовки идут в том же потоке, что и этот проход, так что недособранных треков во время него нет
+void samples_enforce(SoundFontList* sf_list, const FontPreset* current, int current_count) {
+    if (!samples.budget || samples_loaded(sf_list, NULL, NULL) <= samples.budget) { return; }
+
+    double start = now_ms();
+    int keep_count = current_count;
+    FontPreset* keep = malloc((current_count + 1) * sizeof(FontPreset));
+    memcpy(keep, current, current_count * sizeof(FontPreset));
+
+    pthread_mutex_lock(&prepare.lock);
+
+    for (int i = 0; i < PREPARE_SLOTS; i++) {
+        keep = realloc(keep, (keep_count + prepare.ready[i].preset_count + 1) * sizeof(FontPreset));
+        memcpy(keep + keep_count, prepare.ready[i].presets, prepare.ready[i].preset_count * sizeof(FontPreset));
+        keep_count += prepare.ready[i].preset_count;
+    }
+
+    pthread_mutex_unlock(&prepare.lock);
+
+    pthread_mutex_lock(&sf_list->lock);
+
+    for (int i = 0; i < sf_list->count; i++) {
+        if (sf_list->status[i] == SF_READY) { BASS_MIDI_FontCompact(sf_list->fonts[i].font); }
+    }
+
+    pthread_mutex_unlock(&sf_list->lock);
+
+    for (int i = 0; i < keep_count; i++) {
+        if (samples_font_open(sf_list, keep[i].font)) { BASS_MIDI_FontLoad(keep[i].font, keep[i].preset, keep[i].bank); }
+    }
+
+    // Пресет, с которым бюджет переполнился, и всё, что старше, остаются выгруженными
+    qsort(samples.uses, samples.count, sizeof(PresetUse), preset_use_cmp);
+    int kept = 0, full = 0;
+
+    for (int i = 0; i < samples.count; i++) {
+        FontPreset* preset = &samples.uses[i].preset;
+
+        // Закрытый шрифт свои сэмплы уже отдал
+        if (!samples_font_open(sf_list, preset->font)) { continue; }
+
+        if (!preset_in(keep, keep_count, preset)) {
+            if (full) {
+                samples.unloaded++;
+                continue;
+            }
+
+            BASS_MIDI_FontLoad(preset->font, preset->preset, preset->bank);
+
+            if (samples_loaded(sf_list, NULL, NULL) > samples.budget) {
+                BASS_MIDI_FontCompact(preset->font);
+
+                for (int j = 0; j < keep_count; j++) {
+                    if (keep[j].font == preset->font) { BASS_MIDI_FontLoad(keep[j].font, keep[j].preset, keep[j].bank); }
+                }
+
+                for (int j = 0; j < kept; j++) {
+                    FontPreset* other = &samples.uses[j].preset;
+
+                    if (other->font == preset->font) { BASS_MIDI_FontLoad(other->font, other->preset, other->bank); }
+                }
+
+                samples.unloaded++;
+                full = 1;
+                continue;
+            }
+        }
+
+        samples.uses[kept++] = samples.uses[i];
+    }
+
+    samples.count = kept;
+
+    free(keep);
+    samples.last_ms = now_ms() - start;
+}
+
+// Микшер создаётся и запускается один раз; общие эффекты сразу встают на него
+int mix_start() {
+    mix.mixer = BASS_Mixer_StreamCreate(SAMPLE_RATE, 2, BASS_SAMPLE_FLOAT | BASS_MIXER_NONSTOP);
+
+    if (!mix.mixer || !BASS_ChannelPlay(mix.mixer, FALSE)) { return 0; }
+
+    fx_graph_apply(0);
+    return 1;
+}
+
+// Подключение трека к микшеру вместо BASS_ChannelPlay; трек, уже подключённый в конце предыдущего, остаётся как есть
+BOOL mix_add(HSTREAM stream) {
+    int fade = mix.fade_in;
+    mix.fade_in = 0;
+
+    if (BASS_Mixer_ChannelGetMixer(stream) == mix.mixer) { return TRUE; }
+
+    if (fade > 0) { BASS_ChannelSetAttribute(stream, BASS_ATTRIB_VOL, 0.0f); }
+
+    if (!BASS_Mixer_StreamAddChannel(mix.mixer, stream, fade > 0 ? BASS_MIXER_NORAMPIN : 0)) { return FALSE; }
+
+    if (fade > 0) { BASS_ChannelSlideAttribute(stream, BASS_ATTRIB_VOL, 1.0f, fade); }
+
+    return TRUE;
+}
+
+// Снятый трек освобождается сразу или затухает за fade_ms, а следующий тогда войдёт с нарастанием
+void mix_retire(HSTREAM stream, int fade_ms) {
+    int slot = -1;
+
+    for (int i = 0; i < MIX_FADING && fade_ms > 0; i++) {
+        if (!mix.fading[i]) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot < 0) {
+        BASS_StreamFree(stream);
+        return;
+    }
+
+    BASS_ChannelSlideAttribute(stream, BASS_ATTRIB_VOL, 0.0f, fade_ms);
+    mix.fading[slot] = stream;
+    mix.fade_in = mix.crossfade_ms;
+}
+
+// Затухшие или доигравшие треки уходят из микшера
+void mix_reap() {
+    for (int i = 0; i < MIX_FADING; i++) {
+        HSTREAM stream = mix.fading[i];
+
+        if (stream && (!BASS_ChannelIsActive(stream) || !BASS_ChannelIsSliding(stream, BASS_ATTRIB_VOL))) {
+            BASS_StreamFree(stream);
+            mix.fading[i] = 0;
+        }
+    }
+}
+
+// На выходе затухающие треки и сам микшер освобождаются до того, как уйдут данные MIDI-файлов под ними
+void mix_stop() {
+    for (int i = 0; i < MIX_FADING; i++) {
+        if (mix.fading[i]) { BASS_StreamFree(mix.fading[i]); }
+
+        mix.fading[i] = 0;
+    }
+
+    if (mix.mixer) { BASS_StreamFree(mix.mixer); }
+
+    mix.mixer = 0;
+}
+
+// Синхронизация в потоке микшера: следующий трек подключается в том же блоке, где кончился текущий
+static void CALLBACK MixJoinProc(HSYNC handle, DWORD channel, DWORD data, void* user) {
+    if (mix.next && BASS_Mixer_StreamAddChannel(mix.mixer, mix.next, BASS_MIXER_NORAMPIN)) { mix.joins++; }
+
+    mix.next = 0;
+}
+
+// Стык без паузы: next подключится к микшеру сам, когда stream кончится
+void mix_queue(HSTREAM stream, HSTREAM next) {
+    mix.next = next;
+    BASS_Mixer_ChannelSetSync(stream, BASS_SYNC_END | BASS_SYNC_MIXTIME | BASS_SYNC_ONETIME, 0, MixJoinProc, NULL);
+}
+
+// Отменяет стык; блокировка микшера ждёт MixJoinProc, если тот уже выполняется
+void mix_unqueue() {
+    BASS_ChannelLock(mix.mixer, TRUE);
+    mix.next = 0;
+    BASS_ChannelLock(mix.mixer, FALSE);
+}
+
+// Сколько секунд трека осталось отдать микшеру: по MIDI-потоку, с поправкой на темп
+double mix_remaining(HSTREAM stream) {
+    HSTREAM source = stream_source(stream);
+    QWORD length = BASS_ChannelGetLength(source, BASS_POS_BYTE);
+    QWORD pos = BASS_ChannelGetPosition(source, BASS_POS_BYTE);
+
+    if (length == (QWORD)-1 || pos == (QWORD)-1 || pos >= length) { return 0.0; }
+
+    double left = BASS_ChannelBytes2Seconds(source, length - pos);
+    return source != stream ? left / (1.0 + tempo_percent_for(tempo.track_bpm) / 100.0) : left;
+}
+
+// Слышимая позиция трека: с учётом буфера микшера
+double mix_position(HSTREAM stream) {
+    return BASS_ChannelBytes2Seconds(stream, BASS_Mixer_ChannelGetPosition(stream, BASS_POS_BYTE));
+}
+
+// Всё, что должно стоять на потоке до первого отрендеренного блока: темп, синхронизации, эффекты каналов,
+// предел регулятора и фильтр нот. Трек из очереди стыка получает это сразу — микшер запустит его сам, раньше track_activate
+void track_attach(PreparedTrack* track, SoundFontList* sf_list) {
+    HSTREAM stream = track->stream;
+
+    if (track->attached) { return; }
+
+    track->attached = 1;
+    tempo_apply(stream, track->track_bpm);
+    // Синхронизации источника микшера срабатывают, когда событие слышно, а не когда оно отрендерено
+    BASS_Mixer_ChannelSetSync(stream, BASS_SYNC_MIDI_EVENT, MIDI_EVENT_PROGRAM, MidiEventProc, sf_list);
+    BASS_Mixer_ChannelSetSync(stream, BASS_SYNC_MIDI_EVENT, MIDI_EVENT_NOTE, MidiNoteProc, sf_list);
+    fx_graph_apply(stream);
+
+    if (governor.budget > 0) {
+        BASS_ChannelSetAttribute(stream_source(stream), BASS_ATTRIB_MIDI_CPU, governor.budget);
+        governor_apply(stream);
+    }
+
+    track->cull = cull_attach(stream, track->path);
+
+    // Собранный по требованию трек сэмплы заранее не грузил
+    if (!track->stats.presets) { prepare_reload(stream_source(stream)); }
+}
+
+// Делает собранный трек текущим: статистика, регулятор, учёт сэмплов и позиция — всё, кроме запуска
+HSTREAM track_activate(PreparedTrack* track, SoundFontList* sf_list, double position) {
+    track_attach(track, sf_list);
+
+    HSTREAM stream = track->stream;
+    track->stream = 0;
+    last_open = track->stats;
+    tempo.track_bpm = track->track_bpm;
+    sf_list->current_stream = stream;
+    governor_attach(stream, &track->timeline);
+
+    if (governor.budget > 0 && governor.timeline.count == 0) { prepare_density(stream_source(stream)); }
+
+    if (track->cull) {
+        cull.current = track->cull;
+        cull.attached_ms = now_ms();
+    }
+
+    // Выгрузка по бюджету — только здесь: пока трек ждёт в очереди, играющему нужны его сэмплы
+    prepare_samples(track->presets, track->preset_count);
+
+    if (position > 0) { BASS_ChannelSetPosition(stream, BASS_ChannelSeconds2Bytes(stream, position), BASS_POS_BYTE); }
+
+    // Программы каналов читаются уже с новой позиции
+    refresh_channel_presets(stream_source(stream), sf_list);
+    prepared_track_free(track);
+    return stream;
+}
+
+// Снимает текущий трек — сразу или с затуханием за fade_ms — и сбрасывает состояние клавиатуры и каналов
+void track_retire(HSTREAM* stream, SoundFontList* sf_list, int fade_ms) {
+    if (!*stream) { return; }
+
+    mix_unqueue();
+    fx_graph_release(*stream);
+    mix_retire(*stream, fade_ms);
+    *stream = 0;
+    sf_list->current_stream = 0;
+    memset(note_states, 0, sizeof(note_states));
+    memset(note_start_times, 0, sizeof(note_start_times));
+    memset(channel_presets, 0, sizeof(channel_presets));
+
+    for (int i = 0; i < 16; i++) { channel_presets[i].sf_index = -1; }
+}
+
+void track_stop(HSTREAM* stream, SoundFontList* sf_list) {
+    track_retire(stream, sf_list, 0);
 }
 
 const char* progress_bar(float percentage) {
@@ -899,8 +5159,44 @@ void print_help() {
     printf("Usage:\n");
     printf("  ./echomidi [file]\n\n");
     printf("Options:\n");
-    printf("  -h        Display this help message and exit\n");
-    printf("  [file]    Path to a specific MIDI file to play (optional)\n\n");
+    printf("  -h               Display this help message and exit\n");
+    printf("  -j N             Threads for the MIDI library scan (default: number of cores)\n");
+    printf("  --bench-presets  Load all SoundFonts, time program-change handling and exit\n");
+    printf("  -w N             SoundFonts kept open at once, others open on demand (default: %d)\n", working_set);
+    printf("  --font-threads N Threads for SoundFont loading (default: number of cores, max %d)\n", MAX_FONT_THREADS);
+    printf("  --file-cache MB  Memory budget for cached MIDI files, 0 disables (default: %d)\n", FILE_CACHE_DEFAULT_MB);
+    printf("  --index-fonts    Rebuild the SoundFont preset index in .echomidi/ and exit\n");
+    printf("  --mmap-fonts     Memory-map SoundFonts and preload only the samples a file uses\n");
+    printf("  --sample-budget MB  Keep loaded SoundFont samples under MB by unloading the least recently\n");
+    printf("                   used presets on track changes (default: no limit)\n");
+    printf("  --progressive    Start MIDI files over %d MB right away from their beginning; the full scan\n",
+           PROGRESSIVE_MIN_BYTES >> 20);
+    printf("                   runs in the background and then fills in length and seeking\n");
+    printf("  --crossfade MS   Overlap consecutive tracks by MS milliseconds, also on manual switches\n");
+    printf("                   (default: 0, the next track starts gaplessly where the current one ends)\n");
+    printf("  --fused-fx       Run all effects in one DSP pass (echofx.h) instead of BASS FX\n");
+    printf("  --bench-fx       Time the BASS FX stack against the fused DSP chain and exit\n");
+    printf("  --repack         Pack every SoundFont as 16-bit samples into a .sf2pack next to it and exit;\n");
+    printf("                   the player prefers an up-to-date .sf2pack over its .sf2\n");
+    printf("  --repack-encoder CMD  Like --repack, but compress samples losslessly with CMD (stdin to stdout,\n");
+    printf("                   e.g. \"flac --best -\"); playback then needs the matching add-on in ./libbass\n");
+    printf("  --tempo P        Tempo change in percent (-90..400)\n");
+    printf("  --bpm N          Play every track at N BPM (from its initial tempo)\n");
+    printf("  --pitch N        Pitch shift in semitones (-24..24)\n");
+    printf("  --tempo-quality Q  fast, normal or high time-stretch quality (default: normal)\n");
+    printf("                   Without tempo or pitch changes no time-stretch stage is created\n");
+    printf("  --cpu-budget PCT Keep playback under PCT%% of a core by adapting voices, interpolation\n");
+    printf("                   and effects; decisions go to %s\n", GOVERNOR_LOG);
+    printf("  --lookahead MS   How far the governor looks ahead in the note-density map (default: %d)\n",
+           governor.lookahead_ms);
+    printf("  --cull           Drop quiet, excess and duplicate notes in extreme files, adapting to CPU headroom;\n");
+    printf("                   per-track totals go to %s\n", CULL_LOG);
+    printf("  --cull-velocity N  Notes below velocity N are always dropped (default: %d)\n", cull.base_velocity);
+    printf("  --cull-density N   Note-ons allowed per %.0f ms with headroom to spare (default: %d)\n", CULL_WINDOW_MS,
+           cull.base_density);
+    printf("  --chan-fx SPEC   Per-MIDI-channel effects, e.g. \"0-8:rc,10-15:r\" (letters r c e s v t);\n");
+    printf("                   channels not listed get no channel effects\n");
+    printf("  [file]           Path to a specific MIDI file to play (optional)\n\n");
     printf("Controls:\n");
     printf("  → (Right Arrow)  Next track\n");
     printf("  ← (Left Arrow)   Previous track\n");
@@ -916,6 +5212,9 @@ void print_help() {
     printf("  D               Toggle 3D Depth control\n");
     printf("  ]/[             Increase/Decrease 3D Depth (when D is active)\n");
     printf("  0-9             Switch SoundFont\n");
+    printf("  ,/.             Previous/Next SoundFont in the catalog\n");
+    printf("  </>             Tempo -/+ 1 BPM\n");
+    printf("  {/}             Pitch -/+ 1 semitone\n");
     printf("  K               Toggle MIDI Keyboard display\n");
     printf("  I               Toggle Channel Presets display\n\n");
     printf("SoundFont Support:\n");
@@ -926,10 +5225,14 @@ void print_help() {
 }
 
 int main(int argc, char* argv[]) {
+    double startup_ms = now_ms();
     signal(SIGINT, handle_signal);
     signal(SIGTSTP, handle_signal);
 
     const char* explicit_file = NULL;
+    int bench_presets = 0;
+    int index_fonts = 0;
+    int bench_effects = 0;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-h") == 0) {
@@ -937,6 +5240,125 @@ int main(int argc, char* argv[]) {
             return 0;
         }
 
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            scan_threads = atoi(argv[++i]);
+        }
+
+        else if (strcmp(argv[i], "--bench-presets") == 0) {
+            bench_presets = 1;
+        }
+
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            working_set = atoi(argv[++i]);
+
+            if (working_set < 1) { working_set = 1; }
+        }
+
+        else if (strcmp(argv[i], "--font-threads") == 0 && i + 1 < argc) {
+            font_threads = atoi(argv[++i]);
+        }
+
+        else if (strcmp(argv[i], "--file-cache") == 0 && i + 1 < argc) {
+            file_cache.budget = (size_t)atoi(argv[++i]) << 20;
+        }
+
+        else if (strcmp(argv[i], "--index-fonts") == 0) {
+            index_fonts = 1;
+        }
+
+        else if (strcmp(argv[i], "--mmap-fonts") == 0) {
+            mmap_fonts = 1;
+        }
+
+        else if (strcmp(argv[i], "--fused-fx") == 0) {
+            fused_fx = 1;
+        }
+
+        else if (strcmp(argv[i], "--bench-fx") == 0) {
+            bench_effects = 1;
+        }
+
+        else if (strcmp(argv[i], "--repack") == 0) {
+            repack_encoder = REPACK_PCM_ENCODER;
+            repack_16bit = 1;
+        }
+
+        else if (strcmp(argv[i], "--repack-encoder") == 0 && i + 1 < argc) {
+            repack_encoder = argv[++i];
+            repack_16bit = 0;
+        }
+
+        else if (strcmp(argv[i], "--tempo") == 0 && i + 1 < argc) {
+            tempo.percent = atof(argv[++i]);
+        }
+
+        else if (strcmp(argv[i], "--bpm") == 0 && i + 1 < argc) {
+            tempo.bpm = atof(argv[++i]);
+
+            if (tempo.bpm < 10.0f) { tempo.bpm = 0.0f; }
+        }
+
+        else if (strcmp(argv[i], "--pitch") == 0 && i + 1 < argc) {
+            tempo.pitch = 0;
+            tempo_step(0, atoi(argv[++i]));
+        }
+
+        else if (strcmp(argv[i], "--tempo-quality") == 0 && i + 1 < argc) {
+            tempo.quality = tempo_quality_parse(argv[++i]);
+
+            if (tempo.quality < 0) {
+                printf("Invalid --tempo-quality value: %s\n", argv[i]);
+                return 1;
+            }
+        }
+
+        else if (strcmp(argv[i], "--cpu-budget") == 0 && i + 1 < argc) {
+            governor.budget = atoi(argv[++i]);
+        }
+
+        else if (strcmp(argv[i], "--lookahead") == 0 && i + 1 < argc) {
+            governor.lookahead_ms = atoi(argv[++i]);
+        }
+
+        else if (strcmp(argv[i], "--cull") == 0) {
+            cull.enabled = 1;
+        }
+
+        else if (strcmp(argv[i], "--cull-velocity") == 0 && i + 1 < argc) {
+            cull.enabled = 1;
+            cull.base_velocity = atoi(argv[++i]);
+        }
+
+        else if (strcmp(argv[i], "--cull-density") == 0 && i + 1 < argc) {
+            cull.enabled = 1;
+            cull.base_density = atoi(argv[++i]);
+
+            if (cull.base_density < CULL_MIN_DENSITY) { cull.base_density = CULL_MIN_DENSITY; }
+        }
+
+        else if (strcmp(argv[i], "--sample-budget") == 0 && i + 1 < argc) {
+            samples.budget = (size_t)(atof(argv[++i]) * 1024 * 1024);
+        }
+
+        else if (strcmp(argv[i], "--progressive") == 0) {
+            progressive_mode = 1;
+        }
+
+        else if (strcmp(argv[i], "--crossfade") == 0 && i + 1 < argc) {
+            mix.crossfade_ms = atoi(argv[++i]);
+
+            if (mix.crossfade_ms < 0) { mix.crossfade_ms = 0; }
+
+            if (mix.crossfade_ms > 10000) { mix.crossfade_ms = 10000; }
+        }
+
+        else if (strcmp(argv[i], "--chan-fx") == 0 && i + 1 < argc) {
+            if (!fx_graph_parse_channels(argv[++i])) {
+                printf("Invalid --chan-fx value: %s\n", argv[i]);
+                return 1;
+            }
+        }
+
         else if (argv[i][0] != '-') {
             explicit_file = argv[i];
         }
@@ -948,6 +5370,50 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // Индекс читает .sf2 напрямую, BASS для него не нужен
+    if (index_fonts) {
+        SoundFontList* catalog = find_soundfonts(1);
+        printf("Indexing %d SoundFont(s) in '%s':\n", catalog->count, catalog->catalog_dir);
+        soundfont_index_catalog(catalog, 1);
+        soundfont_list_free(catalog);
+        return 0;
+    }
+
+    // Упаковка шрифтов идёт без звукового устройства
+    if (repack_encoder) {
+        if (!BASS_Init(0, SAMPLE_RATE, BASS_SAMPLE_FLOAT, 0, NULL)) {
+            printf("BASS_Init failed: %d\n", BASS_ErrorGetCode());
+            return 1;
+        }
+
+        load_codec_plugins();
+        int ok = repack_fonts();
+        BASS_Free();
+        return ok ? 0 : 1;
+    }
+
+    // Замер идёт на декодирующих потоках, звуковое устройство не нужно
+    if (bench_effects) {
+        if (!BASS_Init(0, SAMPLE_RATE, BASS_SAMPLE_FLOAT, 0, NULL)) {
+            printf("BASS_Init failed: %d\n", BASS_ErrorGetCode());
+            return 1;
+        }
+
+        bench_fx();
+        BASS_Free();
+        return 0;
+    }
+
+    if (fused_fx) {
+        echofx_init(&echofx, SAMPLE_RATE);
+        fused_fx_config(&echofx);
+
+        if (!echofx_setup(&echofx)) {
+            printf("Out of memory for the fused effect chain, using BASS FX\n");
+            fused_fx = 0;
+        }
+    }
+
     init_terminal();
 
     if (!BASS_Init(-1, SAMPLE_RATE, BASS_SAMPLE_FLOAT, 0, NULL)) {
@@ -956,18 +5422,75 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    SoundFontList* sf_list = find_soundfonts();
+    // Сжатые без потерь шрифты (--repack-encoder) читаются через дополнения BASS
+    load_codec_plugins();
+
+    if (!mix_start()) {
+        printf("Failed to create mixer: %d\n", BASS_ErrorGetCode());
+        reset_terminal();
+        BASS_Free();
+        return 1;
+    }
+
+    // Тёплый старт: каталог шрифтов и плейлист берутся из снимка прошлого запуска, если каталоги не менялись
+    Snapshot* snap = snapshot_load();
+    SoundFontList* sf_list = snap ? snapshot_soundfonts(snap) : NULL;
+    int warm_fonts = sf_list != NULL;
 
-    if (sf_list->count == 0) {
+    if (!sf_list) { sf_list = find_soundfonts(1); }
+
+    // Первый шрифт загружается сразу, остальные — в фоне
+    if (!soundfont_load_first(sf_list, warm_fonts ? snap->header->active_sf : 0)) {
         printf("No valid SoundFont (.sf2) files found in 'bank' or current directory\n");
         reset_terminal();
         BASS_Free();
         soundfont_list_free(sf_list);
+        snapshot_close(snap);
         return 1;
     }
 
+    soundfont_start_indexer(sf_list);
+
+    if (bench_presets) {
+        soundfont_loader(sf_list); // Все шрифты синхронно
+        soundfont_poll(sf_list);
+        bench_preset_resolution(sf_list);
+        reset_terminal();
+        BASS_Free();
+        soundfont_list_free(sf_list);
+        snapshot_close(snap);
+        return 0;
+    }
+
+    soundfont_start_loader(sf_list);
+
+    // Играем явно указанный файл, плейлист из снимка или первый найденный файл; полный список собирается в фоне
     MidiList* midi_list = midi_list_init();
-    update_midi_list(midi_list, explicit_file);
+    DirStampList warm_dirs = {0};
+    int current_index = 0;
+    char* restore_track = NULL;
+    double restore_pos = 0.0;
+
+    if (explicit_file) { midi_list_add(midi_list, explicit_file); }
+
+    else if (snap && snap->header->track_count > 0) {
+        snapshot_tracks(snap, midi_list);
+        snapshot_dirs(snap, &warm_dirs);
+
+        if (snap->header->current_track >= 0 && snap->header->current_track < midi_list->count) {
+            current_index = snap->header->current_track;
+            restore_track = strdup(midi_list->files[current_index]);
+            restore_pos = snap->header->position;
+        }
+    }
+
+    else {
+        char* first = find_first_midi("midi");
+
+        if (!first) { first = find_first_midi("."); }
+
+        if (first) { midi_list_push(midi_list, first); }
+    }
 
     if (midi_list->count == 0) {
         printf("Please place MIDI files in current directory\n");
@@ -975,22 +5498,28 @@ int main(int argc, char* argv[]) {
         BASS_Free();
         soundfont_list_free(sf_list);
         midi_list_free(midi_list);
+        snapshot_close(snap);
         return 1;
     }
 
-    int current_index = 0;
-
-    if (explicit_file) {
-        for (int i = 0; i < midi_list->count; i++) {
-            if (strcmp(midi_list->files[i], explicit_file) == 0) {
-                current_index = i;
-                break;
-            }
-        }
+    if (warm_fonts || warm_dirs.count > 0) {
+        printf("Warm start: %d SoundFont(s)%s, %d track(s)%s\n", sf_list->count, warm_fonts ? " from snapshot" : "",
+               midi_list->count, warm_dirs.count > 0 ? " from snapshot" : "");
     }
 
+    snapshot_close(snap);
+    library_start(explicit_file, &warm_dirs);
+    file_cache_start();
+    prepare_start(sf_list);
+
+    ScanStats scan_stats = {0};
+    int scan_reported = 0;
+    double first_audio_ms = -1.0;
+    double switch_start_ms = -1.0;
+
     HSTREAM stream = 0;
-    HFX reverb = 0, chorus = 0, echo = 0, vibrato = 0, tremolo = 0, rotate = 0;
+    PreparedTrack queued = {0}; // Следующий трек, ждущий стыка в микшере
+    int queued_index = -1;
     int paused = 0, last_file_count = 0;
     char last_track[256] = "";
     int d_pressed = 0;
@@ -1001,44 +5530,26 @@ int main(int argc, char* argv[]) {
         if (key == 1) { // Next
             if (midi_list->count > 0) {
                 current_index = (current_index + 1) % midi_list->count;
-
-                if (stream) {
-                    BASS_StreamFree(stream);
-                    stream = 0;
-                    sf_list->current_stream = 0;
-                    paused = 0;
-                    memset(note_states, 0, sizeof(note_states));
-                    memset(note_start_times, 0, sizeof(note_start_times));
-                    memset(channel_presets, 0, sizeof(channel_presets));
-
-                    for (int i = 0; i < 16; i++) { channel_presets[i].sf_index = -1; }
-                }
+                track_retire(&stream, sf_list, mix.crossfade_ms);
+                paused = 0;
+                switch_start_ms = now_ms();
             }
         }
 
         else if (key == 2) {   // Previous
             if (midi_list->count > 0) {
                 current_index = (current_index - 1 + midi_list->count) % midi_list->count;
-
-                if (stream) {
-                    BASS_StreamFree(stream);
-                    stream = 0;
-                    sf_list->current_stream = 0;
-                    paused = 0;
-                    memset(note_states, 0, sizeof(note_states));
-                    memset(note_start_times, 0, sizeof(note_start_times));
-                    memset(channel_presets, 0, sizeof(channel_presets));
-
-                    for (int i = 0; i < 16; i++) { channel_presets[i].sf_index = -1; }
-                }
+                track_retire(&stream, sf_list, mix.crossfade_ms);
+                paused = 0;
+                switch_start_ms = now_ms();
             }
         }
 
         else if (key == 3) {   // Pause/Resume
             if (stream) {
-                if (paused) { BASS_ChannelPlay(stream, FALSE); }
+                if (paused) { BASS_ChannelPlay(mix.mixer, FALSE); }
 
-                else { BASS_ChannelPause(stream); }
+                else { BASS_ChannelPause(mix.mixer); }
 
                 paused = !paused;
             }
@@ -1051,13 +5562,13 @@ int main(int argc, char* argv[]) {
         else if (key == 5) {   // Reverb
             reverb_enabled = !reverb_enabled;
 
-            if (stream) { apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate); }
+            fx_graph_apply(0);
         }
 
         else if (key == 6) {   // Chorus
             chorus_enabled = !chorus_enabled;
 
-            if (stream) { apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate); }
+            fx_graph_apply(0);
         }
 
         else if (key == 7) {   // Stereo Rotate
@@ -1065,25 +5576,25 @@ int main(int argc, char* argv[]) {
 
             if (stereo_pan_enabled) { depth_3d = 0.0f; }
 
-            if (stream) { apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate); }
+            fx_graph_apply(0);
         }
 
         else if (key == 8) {   // Vibrato
             vibrato_enabled = !vibrato_enabled;
 
-            if (stream) { apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate); }
+            fx_graph_apply(0);
         }
 
         else if (key == 9) {   // Tremolo
             tremolo_enabled = !tremolo_enabled;
 
-            if (stream) { apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate); }
+            fx_graph_apply(0);
         }
 
         else if (key == 10) {   // Echo
             echo_enabled = !echo_enabled;
 
-            if (stream) { apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate); }
+            fx_graph_apply(0);
         }
 
         else if (key == 12) {   // Decrease Rotate Rate
@@ -1094,7 +5605,7 @@ int main(int argc, char* argv[]) {
 
                 if (rotateParams.fRate < 0.01f) { rotateParams.fRate = 0.01f; }
 
-                if (stream) { apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate); }
+                fx_graph_apply(0);
             }
         }
 
@@ -1106,7 +5617,7 @@ int main(int argc, char* argv[]) {
 
                 if (rotateParams.fRate > 2.0f) { rotateParams.fRate = 2.0f; }
 
-                if (stream) { apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate); }
+                fx_graph_apply(0);
             }
         }
 
@@ -1120,7 +5631,7 @@ int main(int argc, char* argv[]) {
 
                 if (depth_3d > 50.0f) { depth_3d = 50.0f; }
 
-                if (stream) { apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate); }
+                fx_graph_apply(0);
             }
         }
 
@@ -1130,7 +5641,7 @@ int main(int argc, char* argv[]) {
 
                 if (depth_3d < -50.0f) { depth_3d = -50.0f; }
 
-                if (stream) { apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate); }
+                fx_graph_apply(0);
             }
         }
 
@@ -1142,95 +5653,99 @@ int main(int argc, char* argv[]) {
             channel_info_visible = !channel_info_visible;
         }
 
-        else if (key >= 20 && key <= 29) {   // Switch SoundFont
-            int new_sf = key - 20;
+        else if (key >= 32 && key <= 35) {   // Tempo / Pitch
+            int was_active = tempo_active();
+            tempo_step(key == 32 ? -1 : key == 33 ? 1 : 0, key == 34 ? -1 : key == 35 ? 1 : 0);
 
-            if (new_sf < sf_list->count) {
-                sf_list->active_sf = new_sf;
+            if (stream && tempo_active() != was_active) {
+                // Темп-поток появляется или уходит: трек переоткрывается с той же позиции
+                free(restore_track);
+                restore_track = strdup(midi_list->files[current_index]);
+                restore_pos = BASS_ChannelBytes2Seconds(stream, BASS_ChannelGetPosition(stream, BASS_POS_BYTE));
+                track_stop(&stream, sf_list);
+                paused = 0;
+            }
 
-                if (stream) {
-                    QWORD pos = BASS_ChannelGetPosition(stream, BASS_POS_BYTE);
-                    int was_paused = !BASS_ChannelIsActive(stream) || paused;
-                    BASS_StreamFree(stream);
-                    stream = 0;
-                    sf_list->current_stream = 0;
-                    HSTREAM midi_stream = BASS_MIDI_StreamCreateFile(
-                                              FALSE,
-                                              midi_list->files[current_index],
-                                              0, 0,
-                                              BASS_STREAM_DECODE | BASS_STREAM_PRESCAN | BASS_SAMPLE_FLOAT,
-                                              SAMPLE_RATE
-                                          );
-
-                    if (!midi_stream) {
-                        printf("Failed to recreate MIDI stream: %d\n", BASS_ErrorGetCode());
-                        continue;
-                    }
+            else if (stream) {
+                tempo_apply(stream, tempo.track_bpm);
 
-                    if (sf_list->count > 0) {
-                        BASS_MIDI_FONT temp_fonts[MAX_SOUNDFONTS];
-                        int temp_count = 0;
-                        temp_fonts[temp_count] = sf_list->fonts[sf_list->active_sf];
-                        temp_fonts[temp_count].preset = -1;
-                        temp_fonts[temp_count].bank = 0;
-                        temp_count++;
-
-                        for (int i = 0; i < sf_list->count && temp_count < MAX_SOUNDFONTS; i++) {
-                            if (i != sf_list->active_sf) {
-                                temp_fonts[temp_count] = sf_list->fonts[i];
-                                temp_fonts[temp_count].preset = -1;
-                                temp_fonts[temp_count].bank = 0;
-                                temp_count++;
-                            }
-                        }
-
-                        if (!BASS_MIDI_StreamSetFonts(midi_stream, temp_fonts, temp_count)) {
-                            printf("Failed to set SoundFonts: %d\n", BASS_ErrorGetCode());
-                            BASS_StreamFree(midi_stream);
-                            continue;
-                        }
-                    }
+                if (queued.stream) { tempo_apply(queued.stream, queued.track_bpm); }
+            }
+        }
 
-                    stream = BASS_FX_TempoCreate(midi_stream, BASS_FX_FREESOURCE);
+        else if ((key >= 20 && key <= 29) || key == 30 || key == 31) {   // Switch SoundFont
+            int new_sf = key == 30 ? (sf_list->active_sf - 1 + sf_list->count) % sf_list->count :
+                         key == 31 ? (sf_list->active_sf + 1) % sf_list->count : key - 20;
 
-                    if (!stream) {
-                        printf("Failed to create tempo stream: %d\n", BASS_ErrorGetCode());
-                        BASS_StreamFree(midi_stream);
-                        continue;
-                    }
+            if (new_sf < sf_list->count && new_sf != sf_list->active_sf) {
+                if (sf_list->status[new_sf] == SF_PENDING || sf_list->status[new_sf] == SF_FAILED) {
+                    printf("\nSoundFont %d is %s\n", new_sf, sf_list->status[new_sf] == SF_PENDING ? "still loading" : "not loadable");
+                }
 
-                    sf_list->current_stream = stream;
-                    BASS_ChannelSetSync(stream, BASS_SYNC_MIDI_EVENT, MIDI_EVENT_PROGRAM, MidiEventProc, sf_list);
-                    BASS_ChannelSetSync(stream, BASS_SYNC_MIDI_EVENT, MIDI_EVENT_NOTE, MidiNoteProc, NULL);
-                    apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate);
-                    BASS_ChannelSetPosition(stream, pos, BASS_POS_BYTE);
-                    memset(channel_presets, 0, sizeof(channel_presets));
-
-                    for (int i = 0; i < 16; i++) {
-                        channel_presets[i].sf_index = -1;
-                        DWORD prog = BASS_MIDI_StreamGetEvent(midi_stream, i, MIDI_EVENT_PROGRAM);
-                        DWORD bank = BASS_MIDI_StreamGetEvent(midi_stream, i, MIDI_EVENT_BANK);
-
-                        if (prog != -1) {
-                            DWORD event_data = prog | (bank << 16);
-                            MidiEventProc(0, i, event_data, sf_list);
-                        }
-                    }
+                // Шрифт открывается и подгружает пресеты трека в фоне, поток продолжает играть
+                else if (!font_switch_start(sf_list, new_sf, stream ? stream_source(stream) : 0)) {
+                    printf("\nSoundFont switch already in progress\n");
+                }
+            }
+        }
 
-                    if (!was_paused) {
-                        if (!BASS_ChannelPlay(stream, FALSE)) {
-                            printf("Failed to play stream: %d\n", BASS_ErrorGetCode());
-                            BASS_StreamFree(stream);
-                            stream = 0;
-                            sf_list->current_stream = 0;
-                            continue;
-                        }
-                    }
+        // Подготовленный шрифт подменяется в живом потоке между блоками
+        if (font_switch.running && font_switch.done) {
+            int target = font_switch_finish();
+
+            if (target < 0) { printf("\nSoundFont %d is not loadable\n", font_switch.target); }
+
+            else {
+                double swap_start = now_ms();
+                soundfont_set_active(sf_list, target);
+                soundfont_trim(sf_list);
+
+                if (stream) {
+                    HSTREAM midi_stream = stream_source(stream);
+                    BASS_ChannelLock(stream, TRUE);
+                    set_stream_fonts(midi_stream, sf_list);
+                    refresh_channel_presets(midi_stream, sf_list);
+                    BASS_ChannelLock(stream, FALSE);
+                    prepare_reload(midi_stream);
                 }
+
+                font_switch.swap_ms = now_ms() - swap_start;
+                font_switch.total_ms = now_ms() - font_switch.requested_ms;
+                font_switch.reported = 1;
+
+                if (!gui_mode) { print_font_switch(); }
+            }
+        }
+
+        if (library_poll(midi_list, &current_index, &scan_stats) && !scan_reported) {
+            print_scan_stats(&scan_stats);
+            scan_reported = 1;
+        }
+
+        // Подгруженные в фоне шрифты подключаются к играющему потоку
+        if (soundfont_poll(sf_list) && stream) {
+            HSTREAM midi_stream = stream_source(stream);
+            set_stream_fonts(midi_stream, sf_list);
+            refresh_channel_presets(midi_stream, sf_list);
+            prepare_reload(midi_stream);
+        }
+
+        // Пресет канала нашёлся по индексу только в закрытом шрифте — открываем его и перестраиваем цепочку
+        int wanted = soundfont_take_wanted(sf_list);
+
+        if (wanted >= 0 && soundfont_open(sf_list, wanted)) {
+            soundfont_trim(sf_list);
+
+            if (stream) {
+                HSTREAM midi_stream = stream_source(stream);
+                set_stream_fonts(midi_stream, sf_list);
+                refresh_channel_presets(midi_stream, sf_list);
+                prepare_reload(midi_stream);
             }
         }
 
-        update_midi_list(midi_list, explicit_file);
+        // Закрытые по LRU шрифты уже не входят в цепочку потока
+        soundfont_release_closed(sf_list);
 
         if (midi_list->count == 0) {
             if (last_file_count != 0) {
@@ -1244,86 +5759,74 @@ int main(int argc, char* argv[]) {
 
         if (midi_list->count != last_file_count) {
             last_file_count = midi_list->count;
+
+            // Плейлист вырос — у текущего трека могли появиться соседи
+            if (stream) { prepare_neighbours(midi_list, current_index, last_open.partial); }
+
+            if (!gui_mode) { print_scan_stats(&scan_stats); }
         }
 
         if (!stream && midi_list->count > 0) {
+            if (current_index >= midi_list->count) { current_index = 0; }
+
             if (file_exists(midi_list->files[current_index])) {
-                HSTREAM midi_stream = BASS_MIDI_StreamCreateFile(
-                                          FALSE,
-                                          midi_list->files[current_index],
-                                          0, 0,
-                                          BASS_STREAM_DECODE | BASS_STREAM_PRESCAN | BASS_SAMPLE_FLOAT,
-                                          SAMPLE_RATE
-                                      );
-
-                if (!midi_stream) {
-                    printf("Failed to load MIDI: %s (error: %d)\n", midi_list->files[current_index], BASS_ErrorGetCode());
-                    current_index = (current_index + 1) % midi_list->count;
-                    continue;
-                }
+                PreparedTrack track;
+                double position = 0.0;
 
-                if (sf_list->count > 0) {
-                    BASS_MIDI_FONT temp_fonts[MAX_SOUNDFONTS];
-                    int temp_count = 0;
-                    temp_fonts[temp_count] = sf_list->fonts[sf_list->active_sf];
-                    temp_fonts[temp_count].preset = -1;
-                    temp_fonts[temp_count].bank = 0;
-                    temp_count++;
-
-                    for (int i = 0; i < sf_list->count && temp_count < MAX_SOUNDFONTS; i++) {
-                        if (i != sf_list->active_sf) {
-                            temp_fonts[temp_count] = sf_list->fonts[i];
-                            temp_fonts[temp_count].preset = -1;
-                            temp_fonts[temp_count].bank = 0;
-                            temp_count++;
-                        }
-                    }
+                // Трек из очереди стыка мог уже заиграть в микшере; не тот трек или темп — очередь сбрасывается
+                if (queued_index == current_index && queued.stream && queued.with_tempo == tempo_active() && !restore_track) {
+                    track = queued;
+                    memset(&queued, 0, sizeof(queued));
+                }
 
-                    if (!BASS_MIDI_StreamSetFonts(midi_stream, temp_fonts, temp_count)) {
-                        printf("Failed to set SoundFonts for %s: %d\n", midi_list->files[current_index], BASS_ErrorGetCode());
-                        BASS_StreamFree(midi_stream);
-                        current_index = (current_index + 1) % midi_list->count;
-                        continue;
-                    }
+                else {
+                    mix_unqueue();
+                    fx_graph_release(queued.stream);
+                    prepared_track_free(&queued);
+                    // Трек, который надо продолжить с позиции, открывается целиком: префикс до неё может не дойти
+                    prepare_take(&track, midi_list->files[current_index], sf_list, progressive_mode && !restore_track);
                 }
 
-                stream = BASS_FX_TempoCreate(midi_stream, BASS_FX_FREESOURCE);
+                queued_index = -1;
 
-                if (!stream) {
-                    printf("Failed to create tempo stream for %s: %d\n", midi_list->files[current_index], BASS_ErrorGetCode());
-                    BASS_StreamFree(midi_stream);
+                if (!track.stream) {
+                    printf("%s %s (error: %d)\n", track.error, midi_list->files[current_index], track.error_code);
+                    prepared_track_free(&track);
                     current_index = (current_index + 1) % midi_list->count;
                     continue;
                 }
 
-                sf_list->current_stream = stream;
-                BASS_ChannelSetSync(stream, BASS_SYNC_MIDI_EVENT, MIDI_EVENT_PROGRAM, MidiEventProc, sf_list);
-                BASS_ChannelSetSync(stream, BASS_SYNC_MIDI_EVENT, MIDI_EVENT_NOTE, MidiNoteProc, NULL);
-                apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate);
-                memset(channel_presets, 0, sizeof(channel_presets));
-
-                for (int i = 0; i < 16; i++) {
-                    channel_presets[i].sf_index = -1;
-                    DWORD prog = BASS_MIDI_StreamGetEvent(midi_stream, i, MIDI_EVENT_PROGRAM);
-                    DWORD bank = BASS_MIDI_StreamGetEvent(midi_stream, i, MIDI_EVENT_BANK);
+                // Позиция из снимка восстанавливается только для того же трека
+                if (restore_track) {
+                    if (strcmp(restore_track, midi_list->files[current_index]) == 0) { position = restore_pos; }
 
-                    if (prog != -1) {
-                        DWORD event_data = prog | (bank << 16);
-                        MidiEventProc(0, i, event_data, sf_list);
-                    }
+                    free(restore_track);
+                    restore_track = NULL;
                 }
 
-                if (!BASS_ChannelPlay(stream, FALSE)) {
+                stream = track_activate(&track, sf_list, position);
+
+                if (!mix_add(stream)) {
                     printf("Failed to play stream for %s: %d\n", midi_list->files[current_index], BASS_ErrorGetCode());
-                    BASS_StreamFree(stream);
-                    stream = 0;
-                    sf_list->current_stream = 0;
+                    track_stop(&stream, sf_list);
                     current_index = (current_index + 1) % midi_list->count;
                     continue;
                 }
 
+                if (switch_start_ms >= 0) {
+                    last_open.switch_ms = now_ms() - switch_start_ms;
+                    switch_start_ms = -1.0;
+                }
+
                 strncpy(last_track, midi_list->files[current_index], sizeof(last_track) - 1);
+                file_cache_prefetch(midi_list, current_index);
+                prepare_neighbours(midi_list, current_index, last_open.partial);
                 last_track[sizeof(last_track) - 1] = '\0';
+
+                if (first_audio_ms < 0) {
+                    first_audio_ms = now_ms() - startup_ms;
+                    printf("Time to first audio: %.1f ms\n", first_audio_ms);
+                }
             }
 
             else {
@@ -1332,112 +5835,96 @@ int main(int argc, char* argv[]) {
             }
         }
 
-        if (!BASS_ChannelIsActive(stream) && !paused) {
-            if (stream) {
-                BASS_StreamFree(stream);
-                stream = 0;
-                sf_list->current_stream = 0;
-                current_index = (current_index + 1) % midi_list->count;
-                paused = 0;
-                memset(note_states, 0, sizeof(note_states));
-                memset(note_start_times, 0, sizeof(note_start_times));
-                memset(channel_presets, 0, sizeof(channel_presets));
+        // Прогрессивно открытый трек: как только полный разбор готов, поток подменяется на той же позиции —
+        // появляются длина, прогресс и перемотка по всему файлу. Разбор не ждётся: доигранный раньше префикс
+        // молчит в микшере, пока полный поток не придёт. Играющий префикс уходит коротким нахлёстом:
+        // оба потока на одной позиции, и звучащие в префиксе ноты затухают, а не обрываются
+        if (stream && last_open.partial && !paused) {
+            PreparedTrack track;
+            int ended = !BASS_ChannelIsActive(stream);
+            int ready = 0;
+
+            if (prepare.running) { ready = prepare_poll(&track, midi_list->files[current_index], sf_list); }
 
-                for (int i = 0; i < 16; i++) { channel_presets[i].sf_index = -1; }
+            else if (ended) {
+                prepare_take(&track, midi_list->files[current_index], sf_list, 0);
+                ready = 1;
             }
 
-            if (current_index >= midi_list->count) { current_index = 0; }
+            if (ready) {
+                double position = BASS_ChannelBytes2Seconds(stream, BASS_ChannelGetPosition(stream, BASS_POS_BYTE));
+                TrackOpenStats prefix = last_open;
 
-            if (file_exists(midi_list->files[current_index])) {
-                HSTREAM midi_stream = BASS_MIDI_StreamCreateFile(
-                                          FALSE,
-                                          midi_list->files[current_index],
-                                          0, 0,
-                                          BASS_STREAM_DECODE | BASS_STREAM_PRESCAN | BASS_SAMPLE_FLOAT,
-                                          SAMPLE_RATE
-                                      );
-
-                if (!midi_stream) {
-                    printf("Failed to load MIDI: %s (error: %d)\n", midi_list->files[current_index], BASS_ErrorGetCode());
-                    current_index = (current_index + 1) % midi_list->count;
-                    continue;
-                }
+                if (track.stream && track.with_tempo == tempo_active()) {
+                    track_retire(&stream, sf_list, ended ? 0 : MIX_SWAP_MS);
 
-                if (sf_list->count > 0) {
-                    BASS_MIDI_FONT temp_fonts[MAX_SOUNDFONTS];
-                    int temp_count = 0;
-                    temp_fonts[temp_count] = sf_list->fonts[sf_list->active_sf];
-                    temp_fonts[temp_count].preset = -1;
-                    temp_fonts[temp_count].bank = 0;
-                    temp_count++;
-
-                    for (int i = 0; i < sf_list->count && temp_count < MAX_SOUNDFONTS; i++) {
-                        if (i != sf_list->active_sf) {
-                            temp_fonts[temp_count] = sf_list->fonts[i];
-                            temp_fonts[temp_count].preset = -1;
-                            temp_fonts[temp_count].bank = 0;
-                            temp_count++;
-                        }
-                    }
+                    if (!ended) { mix.fade_in = MIX_SWAP_MS; }
 
-                    if (!BASS_MIDI_StreamSetFonts(midi_stream, temp_fonts, temp_count)) {
-                        printf("Failed to set SoundFonts for %s: %d\n", midi_list->files[current_index], BASS_ErrorGetCode());
-                        BASS_StreamFree(midi_stream);
-                        current_index = (current_index + 1) % midi_list->count;
-                        continue;
-                    }
+                    stream = track_activate(&track, sf_list, position);
+                    mix_add(stream);
+                    last_open.switch_ms = prefix.switch_ms;
+                    last_open.prefix_ms = prefix.open_ms;
                 }
 
-                stream = BASS_FX_TempoCreate(midi_stream, BASS_FX_FREESOURCE);
+                else {
+                    if (!track.stream) { printf("%s %s (error: %d)\n", track.error, midi_list->files[current_index], track.error_code); }
 
-                if (!stream) {
-                    printf("Failed to create tempo stream for %s: %d\n", midi_list->files[current_index], BASS_ErrorGetCode());
-                    BASS_StreamFree(midi_stream);
-                    current_index = (current_index + 1) % midi_list->count;
-                    continue;
+                    prepared_track_free(&track);
+                    last_open.partial = 0; // Трек доиграет префикс
                 }
+            }
+        }
 
-                sf_list->current_stream = stream;
-                BASS_ChannelSetSync(stream, BASS_SYNC_MIDI_EVENT, MIDI_EVENT_PROGRAM, MidiEventProc, sf_list);
-                BASS_ChannelSetSync(stream, BASS_SYNC_MIDI_EVENT, MIDI_EVENT_NOTE, MidiNoteProc, NULL);
-                apply_effects(stream, &reverb, &chorus, &echo, &vibrato, &tremolo, &rotate);
-                memset(channel_presets, 0, sizeof(channel_presets));
+        // Конец трека близко: с --crossfade следующий входит внахлёст, пока текущий затухает до своего конца,
+        // иначе следующий заранее забирается из подготовки и подключается микшером ровно там, где текущий кончится.
+        // Трек не длиннее нахлёста не затухает от начала, а стыкуется без паузы
+        if (stream && !paused && !last_open.partial && queued_index < 0) {
+            double left_ms = mix_remaining(stream) * 1000.0;
+            double length_ms = BASS_ChannelBytes2Seconds(stream, BASS_ChannelGetLength(stream, BASS_POS_BYTE)) * 1000.0;
+            int crossfade = mix.crossfade_ms > 0 && length_ms > mix.crossfade_ms;
 
-                for (int i = 0; i < 16; i++) {
-                    channel_presets[i].sf_index = -1;
-                    DWORD prog = BASS_MIDI_StreamGetEvent(midi_stream, i, MIDI_EVENT_PROGRAM);
-                    DWORD bank = BASS_MIDI_StreamGetEvent(midi_stream, i, MIDI_EVENT_BANK);
+            if (crossfade && left_ms <= mix.crossfade_ms) {
+                track_retire(&stream, sf_list, (int)left_ms);
+                current_index = (current_index + 1) % midi_list->count;
+                switch_start_ms = now_ms();
+                mix.crossfades++;
+                continue;
+            }
 
-                    if (prog != -1) {
-                        DWORD event_data = prog | (bank << 16);
-                        MidiEventProc(0, i, event_data, sf_list);
-                    }
-                }
+            if (!crossfade && left_ms <= MIX_QUEUE_MS) {
+                queued_index = (current_index + 1) % midi_list->count;
+                prepare_take(&queued, midi_list->files[queued_index], sf_list, progressive_mode);
 
-                if (!BASS_ChannelPlay(stream, FALSE)) {
-                    printf("Failed to play stream for %s: %d\n", midi_list->files[current_index], BASS_ErrorGetCode());
-                    BASS_StreamFree(stream);
-                    stream = 0;
-                    sf_list->current_stream = 0;
-                    current_index = (current_index + 1) % midi_list->count;
-                    continue;
+                if (queued.stream) {
+                    track_attach(&queued, sf_list);
+                    mix_queue(stream, queued.stream);
                 }
-
-                strncpy(last_track, midi_list->files[current_index], sizeof(last_track) - 1);
-                last_track[sizeof(last_track) - 1] = '\0';
             }
+        }
 
-            else {
-                printf("MIDI file not found: %s\n", midi_list->files[current_index]);
-                current_index = (current_index + 1) % midi_list->count;
-            }
+        mix_reap();
+
+        // Трек доиграл: следующий берётся из подготовки на ближайшем проходе цикла, без паузы.
+        // Доигранный префикс трека концом не считается — ждёт полного разбора
+        if (stream && !BASS_ChannelIsActive(stream) && !paused && !last_open.partial) {
+            track_stop(&stream, sf_list);
+            current_index = (current_index + 1) % midi_list->count;
+            switch_start_ms = now_ms();
+            continue;
         }
 
         if (BASS_ChannelIsActive(stream)) {
-            double length = BASS_ChannelBytes2Seconds(stream, BASS_ChannelGetLength(stream, BASS_POS_BYTE));
-            double pos = BASS_ChannelBytes2Seconds(stream, BASS_ChannelGetPosition(stream, BASS_POS_BYTE));
+            // Длина префикса — не длина трека: до конца полного разбора она неизвестна
+            double length = last_open.partial ? 0.0 : BASS_ChannelBytes2Seconds(stream, BASS_ChannelGetLength(stream, BASS_POS_BYTE));
+            double pos = mix_position(stream);
             float percentage = (length > 0) ? (pos * 100.0f / length) : 0.0f;
 
+            if (governor.budget > 0) { prepare_density_poll(stream_source(stream)); }
+
+            if (governor.budget > 0 && !paused) { governor_tick(stream, midi_list->files[current_index], pos); }
+
+            if (cull.enabled && !paused) { cull_tick(stream); }
+
             if (percentage > 100.0f) { percentage = 100.0f; }
 
             char midi_name[62] = {0};
@@ -1473,7 +5960,7 @@ int main(int argc, char* argv[]) {
                 printf("  %s \033[7m%s\033[0m \n", paused ? "⏸" : "►", midi_name);
                 printf("    ⏱ %2.0f:%02d / %2.0f:%02d [%-20s] %5.1f%%      [%d/%d]\n",
                        floor(pos/60), (int)pos%60, floor(length/60), (int)length%60,
-                       progress_bar(percentage), percentage, current_index + 1, midi_list->count);
+                       last_open.partial ? "scanning..." : progress_bar(percentage), percentage, current_index + 1, midi_list->count);
                 printf("├────────────────────────────────────────────────────────────────┤\n");
                 char sf_name[40];
                 const char* sf_fullname = strrchr(sf_list->files[sf_list->active_sf], '/') ?
@@ -1485,9 +5972,110 @@ int main(int argc, char* argv[]) {
                 else { strncpy(sf_name, sf_fullname, sizeof(sf_name)); }
 
                 printf("  SoundFont: %-35s       [%d/%d]\n", sf_name, sf_list->active_sf + 1, sf_list->count);
+
+                // Статус фоновой загрузки, пока она идёт
+                int sf_pending = sf_list->pending;
+                int scanning = library_scanning();
+
+                if (sf_pending > 0 || scanning) {
+                    printf("  Loading: %d SoundFont(s)%s | first audio in %.0f ms\n",
+                           sf_pending, scanning ? ", MIDI library" : "", first_audio_ms);
+                }
+
+                printf("  Track open: %.1f ms, %u events (%s) | file cache %d, %.1f/%zu MB\n", last_open.open_ms,
+                       (unsigned)last_open.events, last_open.partial ? "progressive, full scan running" :
+                       last_open.cached ? "event cache" : "prescan", file_cache.count,
+                       file_cache.bytes / (1024.0 * 1024.0), file_cache.budget >> 20);
+
+                if (last_open.prefix_ms > 0) { printf("  Progressive start: %.1f ms before the full scan\n", last_open.prefix_ms); }
+
+                printf("  Track switch: %.1f ms (%s) | prepared %lu, on demand %lu\n", last_open.switch_ms,
+                       last_open.prepared ? "prepared in background" : "built on switch", prepare.hits, prepare.misses);
+
+                if (mix.crossfade_ms > 0) {
+                    printf("  Mixer: crossfade %d ms | %lu crossfade(s), %lu gapless join(s)\n", mix.crossfade_ms, mix.crossfades, mix.joins);
+                }
+
+                else { printf("  Mixer: gapless | %lu track(s) joined at the end of the previous\n", mix.joins); }
+
+                if (last_open.presets > 0) {
+                    printf("  Samples: %d preset(s) of this track preloaded in %.1f ms\n", last_open.presets, last_open.samples_ms);
+                }
+
+                else { printf("  Samples: loaded on demand while playing\n"); }
+
+                // Сэмплы в памяти по шрифтам (BASS_MIDI_FontGetInfo), первые несколько непустых
+                DWORD* font_loaded = malloc(sf_list->count * sizeof(DWORD));
+                DWORD* font_total = malloc(sf_list->count * sizeof(DWORD));
+                size_t loaded = samples_loaded(sf_list, font_loaded, font_total);
+                int shown = 0, more = 0;
+
+                if (samples.budget) {
+                    printf("  Sample memory: %.1f / %.1f MB | %lu preset(s) unloaded, last pass %.1f ms\n", loaded / (1024.0 * 1024.0),
+                           samples.budget / (1024.0 * 1024.0), samples.unloaded, samples.last_ms);
+                }
+
+                else { printf("  Sample memory: %.1f MB (no budget)\n", loaded / (1024.0 * 1024.0)); }
+
+                for (int i = 0; i < sf_list->count; i++) {
+                    if (!font_loaded[i]) { continue; }
+
+                    if (shown == 3) {
+                        more++;
+                        continue;
+                    }
+
+                    const char* base = strrchr(sf_list->files[i], '/') ? strrchr(sf_list->files[i], '/') + 1 : sf_list->files[i];
+                    printf("    %-32.32s %7.2f / %7.2f MB\n", base, font_loaded[i] / (1024.0 * 1024.0), font_total[i] / (1024.0 * 1024.0));
+                    shown++;
+                }
+
+                if (more) { printf("    ... and %d more font(s) with samples loaded\n", more); }
+
+                free(font_loaded);
+                free(font_total);
+
+                if (BASS_FX_TempoGetSource(stream)) {
+                    float percent = tempo_percent_for(tempo.track_bpm);
+                    printf("  Tempo: %.1f BPM (%+.1f%%) | pitch %+d st | time-stretch %s (</> {/})\n",
+                           tempo.track_bpm * (1.0f + percent / 100.0f), percent, tempo.pitch, tempo_quality_names[tempo.quality]);
+                }
+
+                else { printf("  Tempo: %.1f BPM | direct, no time-stretch (</> {/})\n", tempo.track_bpm); }
+
+                if (cull.current) {
+                    const CullState* state = cull.current;
+                    printf("  Cull: %lu of %lu notes (velocity %lu, density %lu, stacked %lu) | vel < %d, %d per %.0f ms\n",
+                           state->by_velocity + state->by_density + state->stacked, state->notes, state->by_velocity,
+                           state->by_density, state->stacked, cull.velocity, cull.density, CULL_WINDOW_MS);
+                }
+
+                if (governor.budget > 0) {
+                    printf("  Governor: %s | CPU %.1f%% of %d%% | voices %.0f/%d | buffer %.0f%% | %lu change(s)\n",
+                           governor_levels[governor.level].name, governor.cpu, governor.budget, governor.voices,
+                           governor_levels[governor.level].voices, governor.fill * 100.0f, governor.decisions);
+
+                    if (governor.timeline.count > 0) {
+                        printf("  Density: ahead %d notes in %d ms (predicted CPU %.1f%%) | peak %d at %d:%02d | map %.1f ms\n",
+                               governor.ahead_poly, governor.lookahead_ms, governor.predicted, governor.timeline.peak_poly,
+                               (int)governor.timeline.peak_s / 60, (int)governor.timeline.peak_s % 60, governor.timeline.build_ms);
+                    }
+                }
+
+                if (font_switch.reported) {
+                    printf("  Last switch: preload %.1f ms | swap %.2f ms (buffer %u ms) | total %.1f ms\n",
+                           font_switch.preload_ms, font_switch.swap_ms, (unsigned)BASS_GetConfig(BASS_CONFIG_BUFFER), font_switch.total_ms);
+                }
+
+                if (mmap_fonts) {
+                    if (now_ms() - font_memory.updated_ms >= FONT_MEMORY_REFRESH_MS) { font_memory_update(); }
+
+                    printf("  Memory: RSS %.1f MB | fonts mapped %.1f MB, resident %.1f MB, PSS %.1f MB\n",
+                           font_memory.rss_mb, font_memory.mapped_mb, font_memory.resident_mb, font_memory.pss_mb);
+                }
                 printf("├────────────────────────────────────────────────────────────────┤\n");
                 printf("  ");
-                draw_spectrum(stream);
+                draw_spectrum(mix.mixer);
                 printf("\n");
                 printf("├────────────────────────────────────────────────────────────────┤\n");
 
@@ -1504,9 +6092,25 @@ int main(int argc, char* argv[]) {
                 printf("  D Pseudo 3D: %-3s %.1f (%s) (]/[)\n",
                        d_pressed ? "\033[7mON\033[0m" : "OFF", depth_3d,
                        depth_3d > 0 ? "Right" : depth_3d < 0 ? "Left" : "Center");
+                if (fused_fx) { printf("  FX chain: fused DSP | %lu updates | peak %.2f\n", fx_graph.updated, echofx.peak); }
+
+                else {
+                    printf("  FX graph: %lu added | %lu removed | %lu updated\n",
+                           fx_graph.added, fx_graph.removed, fx_graph.updated);
+                }
+
+                int routed = 0, chan_fx = 0;
+
+                for (int ch = 0; ch < 16; ch++) {
+                    if (fx_graph.chan_stream[ch]) { routed++; }
+
+                    for (int i = 0; i < 6; i++) { chan_fx += fx_graph.chan_live[ch][i].handle != 0; }
+                }
+
+                if (routed) { printf("  Channel FX: %d channel(s), %d effect(s), other channels bypass\n", routed, chan_fx); }
                 printf("├────────────────────────────────────────────────────────────────┤\n");
-                printf("  Controls: ← NAV → | P Pause | Q Quit | 0-9 SFonts\n");
-                printf("         K Keyboard | I Channel Mapping\n");
+                printf("  Controls: ← NAV → | P Pause | Q Quit | 0-9 ,/. SFonts\n");
+                printf("         K Keyboard | I Channel Mapping | </> Tempo | {/} Pitch\n");
                 printf("└────────────────────────────────────────────────────────────────┘\n");
                 draw_midi_keyboard();
                 draw_channel_info(sf_list);
@@ -1520,19 +6124,50 @@ int main(int argc, char* argv[]) {
                          sf_list->sizes[sf_list->active_sf] / (1024.0f * 1024.0f));
                 printf("\r%s", buffer);
 
-                if (!paused) { draw_spectrum(stream); }
+                if (!paused) { draw_spectrum(mix.mixer); }
 
                 printf("%*s", 8, "");
                 fflush(stdout);
             }
         }
 
-        usleep(100000);
+        // Пока готовится смена шрифта, цикл проверяет её чаще, чтобы подмена не ждала целый тик
+        usleep(font_switch.running ? 2000 : 100000);
     }
 
+    double exit_pos = stream ? mix_position(stream) : 0.0;
+
     if (stream) { BASS_StreamFree(stream); }
 
+    mix_unqueue();
+    prepared_track_free(&queued);
+    mix_stop();
+
+    prepare_stop();
+    library_stop();
+    soundfont_stop_loader(sf_list);
+
+    if (font_switch.running) { font_switch_finish(); }
+
+    file_cache_stop();
+
+    // Плейлист с явно указанным файлом в снимок не попадает
+    if (!snapshot_save(sf_list, explicit_file ? NULL : midi_list, current_index, exit_pos,
+                       explicit_file ? NULL : &library.stamps)) {
+        printf("Failed to save snapshot %s\n", SNAPSHOT_FILE);
+    }
+
+    dir_stamps_clear(&library.stamps);
+    free(restore_track);
+
+    if (governor.log) { fclose(governor.log); }
+
+    if (cull.log) { fclose(cull.log); }
+
+    density_timeline_free(&governor.timeline);
+
     BASS_Free();
+    echofx_free(&echofx);
     soundfont_list_free(sf_list);
     midi_list_free(midi_list);
     reset_terminal();